@@ -1,6 +1,12 @@
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 const long long max_size = 2000;  // max length of strings
 const long long max_w = 50;  // max length of vocabulary entries
@@ -100,22 +106,64 @@ void get_k_sim(char *vocab, double *vectors, long long vocab_size, long long emb
   }
 }
 
+/*
+  Kernels over float rows, as returned by read_vectors/map_vectors.  The
+  products are formed in blocks the compiler vectorizes; only the prefix scan
+  of the mode-z kernel is sequential.
+*/
+#define SIM_BLOCK 16
+
+/*
+  Dot product over the first z+1 dims, z being the mode of p(z|w1,w2) (same
+  result as get_mode_z + dot_product_sim): exp is monotone, so the mode is
+  the argmax of the running dot product and the similarity is its maximum.
+*/
+double mode_z_sim(const float *v1, const float *v2, long long embed_size) {
+  float prod[SIM_BLOCK];
+  double total = 0, best = 0;
+  int first = 1;
+  for (long long i = 0; i < embed_size; i += SIM_BLOCK) {
+    int n = embed_size - i < SIM_BLOCK ? embed_size - i : SIM_BLOCK;
+    for (int j = 0; j < n; j++) prod[j] = v1[i + j] * v2[i + j];
+    for (int j = 0; j < n; j++) {
+      total += prod[j];
+      if (first || total > best) best = total;
+      first = 0;
+    }
+  }
+  return best;
+}
+
+double cosine_sim_rows(const float *v1, const float *v2, long long embed_size) {
+  float prod = 0, norm1 = 0, norm2 = 0;
+  for (long long i = 0; i < embed_size; i++) {
+    prod += v1[i] * v2[i];
+    norm1 += v1[i] * v1[i];
+    norm2 += v2[i] * v2[i];
+  }
+  return prod / (sqrt(norm1) * sqrt(norm2));
+}
+
 // NOTE: not storing as unit vectors
 void read_vectors(char *file_name, long long *vocab_size, long long *embed_size, char **vocab, float **vectors) {
   FILE *f;
   f = fopen(file_name, "rb");
+  if (f == NULL) {
+    printf("ERROR: vector file %s not found!\n", file_name);
+    exit(1);
+  }
   // Read Header info 
   fscanf(f, "%lld", vocab_size);
   fscanf(f, "%lld", embed_size);
 
-  *vocab = (char *)malloc(*vocab_size * max_w * sizeof(char));
+  *vocab = (char *)calloc(*vocab_size * max_w, sizeof(char));
   *vectors = (float *)malloc(*vocab_size * *embed_size * sizeof(float));
   for (int i = 0; i < *vocab_size; i++) {
     fgetc(f); // read '\n'
     int j = 0;
     while (1) { // read word
       char c = fgetc(f);
-      if (c != ' ' && c != '\n') { (*vocab)[i * max_w + j] = c; } 
+      if (c != ' ' && c != '\n') { if (j < max_w - 1) (*vocab)[i * max_w + j] = c; } 
       else {
         break;
       }
@@ -133,6 +181,368 @@ void read_vectors(char *file_name, long long *vocab_size, long long *embed_size,
     }*/
     fgetc(f); // read space
   }
+  fclose(f);
+}
+
+/*
+  Model images.  read_vectors parses the text into private memory, so every
+  evaluation process pays the parse and holds its own copy of the matrix.
+  map_vectors converts a vector file once into a binary image next to it
+  (vecs.txt -> vecs.img) and maps the image read-only; processes mapping the
+  same image share one copy through the page cache and start without parsing.
+  The image stores the vocab and the matrix in exactly the layout
+  read_vectors returns (max_w bytes per word, float rows), so the pointers
+  drop into the existing code unchanged -- but the memory is read-only.
+  eval_lib.py reads and writes the same images.
+
+  Layout: a 64 byte ModelImageHeader, the vocab right after it, then the
+  vectors at a page aligned offset.  Native byte order.
+*/
+#define IMAGE_MAGIC "IWEMODEL"
+#define IMAGE_VERSION 1
+#define IMAGE_ALIGN 4096
+
+typedef struct {
+  char magic[8];
+  long long version, vocab_size, embed_size, word_width, vocab_offset, vectors_offset, reserved;
+} ModelImageHeader;
+
+// vecs.txt -> vecs.img; anything else gets .img appended, and an image names itself
+void image_file_name(char *file_name, char *image_name) {
+  long long len = strlen(file_name);
+  strcpy(image_name, file_name);
+  if (len >= 4 && !strcmp(file_name + len - 4, ".img")) return;
+  if (len >= 4 && !strcmp(file_name + len - 4, ".txt")) image_name[len - 4] = 0;
+  strcat(image_name, ".img");
+}
+
+/*
+  Writes the image of a text vector file.  The image is written under a
+  temporary name and renamed into place, so processes racing to convert the
+  same file never map a partial image.
+*/
+void write_model_image(char *file_name, char *image_name) {
+  long long vocab_size, embed_size;
+  char *vocab, tmp_name[max_size];
+  float *vectors;
+  ModelImageHeader header;
+  FILE *f;
+  read_vectors(file_name, &vocab_size, &embed_size, &vocab, &vectors);
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, IMAGE_MAGIC, 8);
+  header.version = IMAGE_VERSION;
+  header.vocab_size = vocab_size;
+  header.embed_size = embed_size;
+  header.word_width = max_w;
+  header.vocab_offset = sizeof(header);
+  header.vectors_offset = (header.vocab_offset + vocab_size * max_w + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+  sprintf(tmp_name, "%s.tmp%d", image_name, (int)getpid());
+  f = fopen(tmp_name, "wb");
+  if (f == NULL) {
+    printf("ERROR: cannot write model image %s\n", tmp_name);
+    exit(1);
+  }
+  fwrite(&header, sizeof(header), 1, f);
+  fwrite(vocab, 1, vocab_size * max_w, f);
+  for (long long pad = header.vocab_offset + vocab_size * max_w; pad < header.vectors_offset; pad++) fputc(0, f);
+  if (fwrite(vectors, sizeof(float), vocab_size * embed_size, f) != (size_t)(vocab_size * embed_size) || fclose(f) != 0) {
+    printf("ERROR: cannot write model image %s\n", tmp_name);
+    exit(1);
+  }
+  rename(tmp_name, image_name);
+  free(vocab);
+  free(vectors);
+}
+
+/*
+  Drop-in replacement for read_vectors backed by the shared image, which is
+  (re)built first if it is missing or not newer than the vector file.
+  file_name may also name an image directly.  Release with unmap_vectors.
+
+  Modification times are compared in whole seconds, as eval_lib.py does: an
+  image from the same second as the vector file counts as stale, since the
+  file may have been rewritten after the image was built in that second.
+*/
+void map_vectors(char *file_name, long long *vocab_size, long long *embed_size, char **vocab, float **vectors) {
+  char image_name[max_size];
+  struct stat text_stat, image_stat;
+  ModelImageHeader *header;
+  image_file_name(file_name, image_name);
+  int have_text = strcmp(file_name, image_name) && stat(file_name, &text_stat) == 0;
+  int have_image = stat(image_name, &image_stat) == 0;
+  if (have_text && (!have_image || image_stat.st_mtime <= text_stat.st_mtime)) {
+    printf("Building model image %s\n", image_name);
+    write_model_image(file_name, image_name);
+  }
+  int fd = open(image_name, O_RDONLY);
+  if (fd < 0 || fstat(fd, &image_stat) != 0) {
+    printf("ERROR: model image %s not found!\n", image_name);
+    exit(1);
+  }
+  void *image = mmap(NULL, image_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    printf("ERROR: cannot map model image %s\n", image_name);
+    exit(1);
+  }
+  header = (ModelImageHeader *)image;
+  if (image_stat.st_size < (long long)sizeof(ModelImageHeader) || memcmp(header->magic, IMAGE_MAGIC, 8) ||
+      header->version != IMAGE_VERSION || header->word_width != max_w || header->vocab_offset != sizeof(ModelImageHeader) ||
+      header->vectors_offset + header->vocab_size * header->embed_size * (long long)sizeof(float) > image_stat.st_size) {
+    printf("ERROR: %s is not a valid model image\n", image_name);
+    exit(1);
+  }
+  *vocab_size = header->vocab_size;
+  *embed_size = header->embed_size;
+  *vocab = (char *)image + header->vocab_offset;
+  *vectors = (float *)((char *)image + header->vectors_offset);
+}
+
+void unmap_vectors(char *vocab) {
+  ModelImageHeader *header = (ModelImageHeader *)(vocab - sizeof(ModelImageHeader));
+  munmap(header, header->vectors_offset + header->vocab_size * header->embed_size * sizeof(float));
+}
+
+/*
+  Quantized models, written by Evaluation/quantize for serving.  Two codings:
+  - QUANT_INT8: every row is scaled by its largest magnitude into int8,
+    4x smaller than float;
+  - QUANT_PQ: product quantization; the dims are split into pq_m subspaces
+    of pq_dsub dims (the last one zero padded), each coded as one byte
+    indexing a 256 entry codebook of its subspace.  With pq_dsub = 4 a row
+    takes 16x less space.
+  The files are mapped read-only like the model images and the kernels below
+  work on the codes without decoding the model.
+
+  Layout: a 128 byte QuantizedHeader, the vocab (max_w bytes per word), the
+  per-row int8 scales, the codebooks and the codes, each section 64 byte
+  aligned.  Native byte order.
+*/
+#define QUANT_MAGIC "IWEQUANT"
+#define QUANT_VERSION 1
+#define QUANT_INT8 1
+#define QUANT_PQ 2
+#define PQ_CENTROIDS 256
+
+typedef struct {
+  char magic[8];
+  long long version, type, vocab_size, embed_size, word_width, pq_m, pq_dsub;
+  long long vocab_offset, scales_offset, codebooks_offset, codes_offset, size, reserved[3];
+} QuantizedHeader;
+
+typedef struct {
+  long long type, vocab_size, embed_size, pq_m, pq_dsub;
+  char *vocab;
+  float *scales;           // int8: vocab_size
+  signed char *codes;      // int8: vocab_size x embed_size
+  float *codebooks;        // pq: pq_m x PQ_CENTROIDS x pq_dsub
+  unsigned char *pq_codes; // pq: vocab_size x pq_m
+  void *image;
+  long long image_size;
+} QuantizedModel;
+
+int is_quantized_file(char *file_name) {
+  char magic[8];
+  FILE *f = fopen(file_name, "rb");
+  if (f == NULL) return 0;
+  int is_quantized = fread(magic, 1, 8, f) == 8 && !memcmp(magic, QUANT_MAGIC, 8);
+  fclose(f);
+  return is_quantized;
+}
+
+void map_quantized(char *file_name, QuantizedModel *model) {
+  struct stat st;
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    printf("ERROR: quantized model %s not found!\n", file_name);
+    exit(1);
+  }
+  char *image = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    printf("ERROR: cannot map quantized model %s\n", file_name);
+    exit(1);
+  }
+  QuantizedHeader *header = (QuantizedHeader *)image;
+  if (st.st_size < (long long)sizeof(QuantizedHeader) || memcmp(header->magic, QUANT_MAGIC, 8) ||
+      header->version != QUANT_VERSION || header->word_width != max_w || header->size > st.st_size) {
+    printf("ERROR: %s is not a valid quantized model\n", file_name);
+    exit(1);
+  }
+  model->type = header->type;
+  model->vocab_size = header->vocab_size;
+  model->embed_size = header->embed_size;
+  model->pq_m = header->pq_m;
+  model->pq_dsub = header->pq_dsub;
+  model->vocab = image + header->vocab_offset;
+  model->scales = (float *)(image + header->scales_offset);
+  model->codes = (signed char *)(image + header->codes_offset);
+  model->codebooks = (float *)(image + header->codebooks_offset);
+  model->pq_codes = (unsigned char *)(image + header->codes_offset);
+  model->image = image;
+  model->image_size = st.st_size;
+}
+
+void unmap_quantized(QuantizedModel *model) {
+  munmap(model->image, model->image_size);
+}
+
+// Reconstructs the float row of a quantized word
+void quant_decode_row(QuantizedModel *model, long long row, float *dest) {
+  if (model->type == QUANT_INT8) {
+    const signed char *code = model->codes + row * model->embed_size;
+    for (long long i = 0; i < model->embed_size; i++) dest[i] = model->scales[row] * code[i];
+    return;
+  }
+  for (long long m = 0; m < model->pq_m; m++) {
+    const float *centroid = model->codebooks + (m * PQ_CENTROIDS + model->pq_codes[row * model->pq_m + m]) * model->pq_dsub;
+    for (long long i = 0; i < model->pq_dsub && m * model->pq_dsub + i < model->embed_size; i++) dest[m * model->pq_dsub + i] = centroid[i];
+  }
+}
+
+// mode_z_sim on two int8 rows: the running dot product is kept in integers and scaled once
+double int8_mode_z_sim(const signed char *v1, float scale1, const signed char *v2, float scale2, long long embed_size) {
+  int total = 0, best = 0;
+  for (long long i = 0; i < embed_size; i++) {
+    total += v1[i] * v2[i];
+    if (i == 0 || total > best) best = total;
+  }
+  return (double)best * scale1 * scale2;
+}
+
+double int8_cosine_sim(const signed char *v1, const signed char *v2, long long embed_size) {
+  int prod = 0, norm1 = 0, norm2 = 0;
+  for (long long i = 0; i < embed_size; i++) {
+    prod += v1[i] * v2[i];
+    norm1 += v1[i] * v1[i];
+    norm2 += v2[i] * v2[i];
+  }
+  return prod / (sqrt((double)norm1) * sqrt((double)norm2));
+}
+
+/*
+  Asymmetric distance table of a float query against the PQ codebooks, 2 x
+  pq_m x PQ_CENTROIDS floats: for every centroid the query's dot product
+  with it over its subspace, then the best running dot product inside the
+  subspace.  A row's mode_z_sim is then one table lookup pair per subspace.
+*/
+void pq_query_table(QuantizedModel *model, const float *query, float *table) {
+  float *total = table, *best = table + model->pq_m * PQ_CENTROIDS;
+  for (long long m = 0; m < model->pq_m; m++) for (int c = 0; c < PQ_CENTROIDS; c++) {
+    const float *centroid = model->codebooks + (m * PQ_CENTROIDS + c) * model->pq_dsub;
+    float running = 0, max_running = 0;
+    for (long long i = 0; i < model->pq_dsub && m * model->pq_dsub + i < model->embed_size; i++) {
+      running += query[m * model->pq_dsub + i] * centroid[i];
+      if (i == 0 || running > max_running) max_running = running;
+    }
+    total[m * PQ_CENTROIDS + c] = running;
+    best[m * PQ_CENTROIDS + c] = max_running;
+  }
+}
+
+double pq_mode_z_sim(QuantizedModel *model, const float *table, long long row) {
+  const float *total = table, *best = table + model->pq_m * PQ_CENTROIDS;
+  const unsigned char *code = model->pq_codes + row * model->pq_m;
+  double running = 0, max_running = 0;
+  for (long long m = 0; m < model->pq_m; m++) {
+    double candidate = running + best[m * PQ_CENTROIDS + code[m]];
+    if (m == 0 || candidate > max_running) max_running = candidate;
+    running += total[m * PQ_CENTROIDS + code[m]];
+  }
+  return max_running;
+}
+
+/*
+  Ragged models, written by the trainers' -raggedOutput (ragged.h): row a
+  keeps only the first lengths of its vector, the dims holding its p(z|w)
+  mass, at values + offsets[a].  Dims past a row's length are zero, so the
+  kernels below stop at the shorter row.
+*/
+#define RAGGED_MAGIC "IWERAGGD"
+#define RAGGED_VERSION 1
+
+typedef struct {
+  char magic[8];
+  long long version, vocab_size, embed_size, word_width, vocab_offset, offsets_offset, values_offset, num_values, size;
+  long long reserved[6];
+} RaggedHeader;
+
+typedef struct {
+  long long vocab_size, embed_size, num_values;
+  char *vocab;
+  long long *offsets;  // vocab_size + 1
+  float *values;
+  void *image;
+  long long image_size;
+} RaggedModel;
+
+int is_ragged_file(char *file_name) {
+  char magic[8];
+  FILE *f = fopen(file_name, "rb");
+  if (f == NULL) return 0;
+  int is_ragged = fread(magic, 1, 8, f) == 8 && !memcmp(magic, RAGGED_MAGIC, 8);
+  fclose(f);
+  return is_ragged;
+}
+
+void map_ragged(char *file_name, RaggedModel *model) {
+  struct stat st;
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    printf("ERROR: ragged model %s not found!\n", file_name);
+    exit(1);
+  }
+  char *image = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    printf("ERROR: cannot map ragged model %s\n", file_name);
+    exit(1);
+  }
+  RaggedHeader *header = (RaggedHeader *)image;
+  if (st.st_size < (long long)sizeof(RaggedHeader) || memcmp(header->magic, RAGGED_MAGIC, 8) ||
+      header->version != RAGGED_VERSION || header->word_width != max_w || header->size > st.st_size) {
+    printf("ERROR: %s is not a valid ragged model\n", file_name);
+    exit(1);
+  }
+  model->vocab_size = header->vocab_size;
+  model->embed_size = header->embed_size;
+  model->num_values = header->num_values;
+  model->vocab = image + header->vocab_offset;
+  model->offsets = (long long *)(image + header->offsets_offset);
+  model->values = (float *)(image + header->values_offset);
+  model->image = image;
+  model->image_size = st.st_size;
+}
+
+void unmap_ragged(RaggedModel *model) {
+  munmap(model->image, model->image_size);
+}
+
+// Returns row a and stores its length
+static inline const float *ragged_row(RaggedModel *model, long long a, long long *length) {
+  *length = model->offsets[a + 1] - model->offsets[a];
+  return model->values + model->offsets[a];
+}
+
+// Widens row a to embed_size floats
+void ragged_decode_row(RaggedModel *model, long long a, float *dest) {
+  long long length;
+  const float *row = ragged_row(model, a, &length);
+  memcpy(dest, row, length * sizeof(float));
+  memset(dest + length, 0, (model->embed_size - length) * sizeof(float));
+}
+
+// mode_z_sim of two ragged rows: past the shorter row the running dot product no longer changes
+double ragged_mode_z_sim(const float *v1, long long length1, const float *v2, long long length2) {
+  return mode_z_sim(v1, v2, length1 < length2 ? length1 : length2);
+}
+
+double ragged_cosine_sim(const float *v1, long long length1, const float *v2, long long length2) {
+  float prod = 0, norm1 = 0, norm2 = 0;
+  for (long long i = 0; i < length1 && i < length2; i++) prod += v1[i] * v2[i];
+  for (long long i = 0; i < length1; i++) norm1 += v1[i] * v1[i];
+  for (long long i = 0; i < length2; i++) norm2 += v2[i] * v2[i];
+  return prod / (sqrt(norm1) * sqrt(norm2));
 }
 
 void print_vector(char *vocab, double *vectors, long long embed_size, int idx) {
@@ -1,8 +1,9 @@
+import os
 import os.path
+import struct
 from math import exp, log
 from scipy import spatial
 import numpy as np
-import cPickle
 
 ### cosine similarity
 def cosine_sim(v1,v2):
@@ -73,33 +74,100 @@ def get_matrix(embeddings):
 
   return W
 
-### get vocab and word-embeddings from file 
-def read_embedding_file(embedding_filename):
-  txt = ".txt"
-  pckl = ".p"
-  pckl_filename = embedding_filename.replace(txt, pckl)
-  pckl_exists = os.path.isfile(pckl_filename)
+### Model images: a vector file is converted once into a binary image next to
+### it (vecs.txt -> vecs.img) that is memory-mapped read-only, so concurrent
+### evaluation processes share one copy of the matrix through the page cache
+### and load without parsing.  Same format as map_vectors in eval_lib.h: a
+### 64 byte header, max_w (50) bytes per word, then float32 rows at a page
+### aligned offset, in native byte order.
+IMAGE_MAGIC = "IWEMODEL"
+IMAGE_VERSION = 1
+IMAGE_ALIGN = 4096
+IMAGE_WORD_WIDTH = 50
+IMAGE_HEADER = struct.Struct("=8s7q")
+
+def image_filename_for(embedding_filename):
+  if embedding_filename.endswith(".img"):
+    return embedding_filename
+  if embedding_filename.endswith(".txt"):
+    return embedding_filename[:-4] + ".img"
+  return embedding_filename + ".img"
+
+### write the image under a temporary name and rename it into place, so
+### processes racing on the same file never map a partial image
+def write_model_image(embedding_filename, image_filename):
   embeddings = []
   vocab = []
- 
-  if pckl_exists:
-    ### read embeddings from pckl file
-    print "loading from pickle file: ", pckl_filename
-    data = cPickle.load(open(pckl_filename,"rb"))
-    vocab, W = data[0], data[1] 
-  elif txt in embedding_filename:
-    ### read embeddings from txt file
-    print "loading from txt file: ", embedding_filename
-    
-    with open(embedding_filename) as f:
-      for line in f.readlines()[1:]:
-        line = line.strip().split()
-        vocab.append(line[0])
-        embeddings.append([float(x) for x in line[1:]])
-   
-    ### save as matrix in pckl file
-    W = get_matrix(embeddings)
-    cPickle.dump([vocab, W], open(pckl_filename, "wb"),-1)  
+  with open(embedding_filename) as f:
+    f.readline()
+    for line in f:
+      line = line.strip().split()
+      vocab.append(line[0][:IMAGE_WORD_WIDTH-1])
+      embeddings.append([float(x) for x in line[1:]])
+  W = get_matrix(embeddings)
+  n, k = W.shape
+  vocab_offset = IMAGE_HEADER.size
+  vectors_offset = (vocab_offset + n*IMAGE_WORD_WIDTH + IMAGE_ALIGN - 1) // IMAGE_ALIGN * IMAGE_ALIGN
+  tmp_filename = "%s.tmp%d" % (image_filename, os.getpid())
+  with open(tmp_filename, "wb") as f:
+    f.write(IMAGE_HEADER.pack(IMAGE_MAGIC, IMAGE_VERSION, n, k, IMAGE_WORD_WIDTH, vocab_offset, vectors_offset, 0))
+    f.write(np.array(vocab, dtype='S%d' % IMAGE_WORD_WIDTH).tostring())
+    f.write('\0' * (vectors_offset - vocab_offset - n*IMAGE_WORD_WIDTH))
+    f.write(W.tostring())
+  os.rename(tmp_filename, image_filename)
+
+### map an image read-only; W is a read-only (n, k) float32 memmap
+def map_model_image(image_filename):
+  with open(image_filename, "rb") as f:
+    magic, version, n, k, width, vocab_offset, vectors_offset, _ = IMAGE_HEADER.unpack(f.read(IMAGE_HEADER.size))
+  if magic != IMAGE_MAGIC or version != IMAGE_VERSION:
+    raise ValueError("not a model image: %s" % image_filename)
+  vocab = np.memmap(image_filename, dtype='S%d' % width, mode='r', offset=vocab_offset, shape=(n,)).tolist()
+  W = np.memmap(image_filename, dtype='float32', mode='r', offset=vectors_offset, shape=(n, k))
+  return vocab, W
+
+### Ragged models (-raggedOutput in the trainers): row i keeps only its first
+### offsets[i+1]-offsets[i] dims, the ones holding its p(z|w) mass; the dims
+### past a row's length are zero.  Same format as map_ragged in eval_lib.h.
+RAGGED_MAGIC = "IWERAGGD"
+RAGGED_VERSION = 1
+RAGGED_HEADER = struct.Struct("=8s15q")
+
+### map a ragged model read-only; returns vocab and one float32 view per row
+def read_ragged_file(ragged_filename):
+  with open(ragged_filename, "rb") as f:
+    header = RAGGED_HEADER.unpack(f.read(RAGGED_HEADER.size))
+  magic, version, n, k, width, vocab_offset, offsets_offset, values_offset, num_values = header[:9]
+  if magic != RAGGED_MAGIC or version != RAGGED_VERSION:
+    raise ValueError("not a ragged model: %s" % ragged_filename)
+  vocab = np.memmap(ragged_filename, dtype='S%d' % width, mode='r', offset=vocab_offset, shape=(n,)).tolist()
+  offsets = np.memmap(ragged_filename, dtype='int64', mode='r', offset=offsets_offset, shape=(n+1,))
+  values = np.memmap(ragged_filename, dtype='float32', mode='r', offset=values_offset, shape=(max(num_values, 1),))
+  rows = [values[offsets[i]:offsets[i+1]] for i in xrange(n)]
+  return vocab, rows
+
+### widen ragged rows to the (n, k) matrix the other functions expect
+def ragged_to_matrix(rows, k):
+  W = np.zeros(shape=(len(rows), k), dtype='float32')
+  for i, row in enumerate(rows):
+    W[i, :len(row)] = row
+  return W
+
+### get vocab and word-embeddings from file 
+def read_embedding_file(embedding_filename):
+  image_filename = image_filename_for(embedding_filename)
+  vocab, W = [], None
+
+  if embedding_filename != image_filename and os.path.isfile(embedding_filename):
+    ### whole seconds, like map_vectors in eval_lib.h: an image from the same second may predate a rewrite
+    if not os.path.isfile(image_filename) or int(os.path.getmtime(image_filename)) <= int(os.path.getmtime(embedding_filename)):
+      ### convert once; later calls and other processes map the image
+      print "building model image from txt file: ", embedding_filename
+      write_model_image(embedding_filename, image_filename)
+
+  if os.path.isfile(image_filename):
+    print "mapping model image: ", image_filename
+    vocab, W = map_model_image(image_filename)
   else:
     print "format not recognized: ", embedding_filename
 
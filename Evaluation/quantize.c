@@ -0,0 +1,287 @@
+/*
+  Quantized export for serving.
+
+  Converts a vector file (text or model image) into an int8 or product
+  quantized model (see QuantizedModel in eval_lib.h) and measures what the
+  coding costs: the recall of the mode-z nearest neighbours of sample
+  queries, exact float search against the kernels on the codes.  The
+  similarity benchmarks can be run on the output with sim_eval, which
+  accepts quantized models next to float ones.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <pthread.h>
+#include "eval_lib.h"
+
+char *input_file, *output_file;
+int type = QUANT_INT8, pq_dsub = 4, kmeans_iter = 15, num_threads = 4, recall_queries = 200, recall_k = 10;
+long long kmeans_sample = 65536, recall_vocab = 100000;
+long long vocab_size, embed_size, pq_m;
+char *vocab;
+float *vectors, *codebooks, *scales;
+signed char *codes;
+unsigned char *pq_codes;
+
+// component i of row a in subspace m, zero past the last dim
+static inline float sub_value(long long a, long long m, long long i) {
+  long long d = m * pq_dsub + i;
+  return d < embed_size ? vectors[a * embed_size + d] : 0;
+}
+
+int nearest_centroid(const float *centroids, long long a, long long m) {
+  int best = 0;
+  float best_dist = FLT_MAX;
+  for (int c = 0; c < PQ_CENTROIDS; c++) {
+    float dist = 0;
+    for (int i = 0; i < pq_dsub; i++) {
+      float diff = sub_value(a, m, i) - centroids[c * pq_dsub + i];
+      dist += diff * diff;
+    }
+    if (dist < best_dist) {
+      best_dist = dist;
+      best = c;
+    }
+  }
+  return best;
+}
+
+// k-means on a strided sample of the rows, then encodes every row of subspace m
+void TrainSubspace(long long m) {
+  float *centroids = codebooks + m * PQ_CENTROIDS * pq_dsub;
+  long long sample = vocab_size < kmeans_sample ? vocab_size : kmeans_sample, stride = vocab_size / sample;
+  double *sums = (double *)malloc(PQ_CENTROIDS * pq_dsub * sizeof(double));
+  long long *counts = (long long *)malloc(PQ_CENTROIDS * sizeof(long long));
+  unsigned long long next_random = m + 1;
+  for (int c = 0; c < PQ_CENTROIDS; c++) for (int i = 0; i < pq_dsub; i++)
+    centroids[c * pq_dsub + i] = sub_value((c % sample) * stride, m, i);
+  for (int it = 0; it < kmeans_iter; it++) {
+    memset(sums, 0, PQ_CENTROIDS * pq_dsub * sizeof(double));
+    memset(counts, 0, PQ_CENTROIDS * sizeof(long long));
+    for (long long s = 0; s < sample; s++) {
+      int c = nearest_centroid(centroids, s * stride, m);
+      counts[c]++;
+      for (int i = 0; i < pq_dsub; i++) sums[c * pq_dsub + i] += sub_value(s * stride, m, i);
+    }
+    for (int c = 0; c < PQ_CENTROIDS; c++) {
+      // an empty cluster restarts at a random sample row
+      next_random = next_random * (unsigned long long)25214903917 + 11;
+      long long restart = (next_random >> 16) % sample * stride;
+      for (int i = 0; i < pq_dsub; i++)
+        centroids[c * pq_dsub + i] = counts[c] ? sums[c * pq_dsub + i] / counts[c] : sub_value(restart, m, i);
+    }
+  }
+  for (long long a = 0; a < vocab_size; a++) pq_codes[a * pq_m + m] = nearest_centroid(centroids, a, m);
+  free(sums);
+  free(counts);
+}
+
+long long next_subspace = 0;
+pthread_mutex_t next_subspace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *TrainSubspaceThread(void *unused) {
+  while (1) {
+    pthread_mutex_lock(&next_subspace_lock);
+    long long m = next_subspace++;
+    pthread_mutex_unlock(&next_subspace_lock);
+    if (m >= pq_m) break;
+    TrainSubspace(m);
+  }
+  pthread_exit(NULL);
+}
+
+void QuantizeInt8() {
+  scales = (float *)malloc(vocab_size * sizeof(float));
+  codes = (signed char *)malloc(vocab_size * embed_size);
+  for (long long a = 0; a < vocab_size; a++) {
+    float max_abs = 0;
+    for (long long i = 0; i < embed_size; i++) if (fabsf(vectors[a * embed_size + i]) > max_abs) max_abs = fabsf(vectors[a * embed_size + i]);
+    scales[a] = max_abs > 0 ? max_abs / 127 : 1;
+    for (long long i = 0; i < embed_size; i++) codes[a * embed_size + i] = (signed char)lrintf(vectors[a * embed_size + i] / scales[a]);
+  }
+}
+
+void QuantizePQ() {
+  pq_m = (embed_size + pq_dsub - 1) / pq_dsub;
+  codebooks = (float *)malloc(pq_m * PQ_CENTROIDS * pq_dsub * sizeof(float));
+  pq_codes = (unsigned char *)malloc(vocab_size * pq_m);
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  for (int a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, TrainSubspaceThread, NULL);
+  for (int a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  free(pt);
+}
+
+long long write_section(FILE *f, const void *data, long long bytes) {
+  long long offset = (ftell(f) + 63) / 64 * 64;
+  while (ftell(f) < offset) fputc(0, f);
+  fwrite(data, 1, bytes, f);
+  return offset;
+}
+
+void WriteQuantized() {
+  QuantizedHeader header;
+  char tmp_name[max_size];
+  memset(&header, 0, sizeof(header));
+  sprintf(tmp_name, "%s.tmp%d", output_file, (int)getpid());
+  FILE *f = fopen(tmp_name, "wb");
+  if (f == NULL) {
+    printf("ERROR: cannot write %s\n", tmp_name);
+    exit(1);
+  }
+  fwrite(&header, sizeof(header), 1, f);
+  memcpy(header.magic, QUANT_MAGIC, 8);
+  header.version = QUANT_VERSION;
+  header.type = type;
+  header.vocab_size = vocab_size;
+  header.embed_size = embed_size;
+  header.word_width = max_w;
+  header.vocab_offset = write_section(f, vocab, vocab_size * max_w);
+  if (type == QUANT_INT8) {
+    header.scales_offset = write_section(f, scales, vocab_size * sizeof(float));
+    header.codes_offset = write_section(f, codes, vocab_size * embed_size);
+  } else {
+    header.pq_m = pq_m;
+    header.pq_dsub = pq_dsub;
+    header.codebooks_offset = write_section(f, codebooks, pq_m * PQ_CENTROIDS * pq_dsub * sizeof(float));
+    header.codes_offset = write_section(f, pq_codes, vocab_size * pq_m);
+  }
+  header.size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, f);
+  if (fclose(f) != 0) {
+    printf("ERROR: cannot write %s\n", tmp_name);
+    exit(1);
+  }
+  rename(tmp_name, output_file);
+  // the vectors alone, without the vocab both formats share
+  long long vector_bytes = header.size - header.vocab_offset - vocab_size * max_w;
+  printf("Wrote %s: %lld words, %lld dims, %lld bytes; vectors %lld bytes (%.1fx smaller than float)\n", output_file,
+         vocab_size, embed_size, header.size, vector_bytes, (double)vocab_size * embed_size * sizeof(float) / vector_bytes);
+}
+
+// keeps the k best (score, row) pairs, best first
+void insert_top(double *score, long long *row, int k, double s, long long a) {
+  if (s <= score[k - 1]) return;
+  int j = k - 1;
+  while (j > 0 && score[j - 1] < s) {
+    score[j] = score[j - 1];
+    row[j] = row[j - 1];
+    j--;
+  }
+  score[j] = s;
+  row[j] = a;
+}
+
+/*
+  Recall@k of the mode-z nearest neighbours among the first recall_vocab
+  (most frequent) words: exact float search vs the kernels on the codes
+*/
+void MeasureRecall() {
+  QuantizedModel model;
+  long long candidates = vocab_size < recall_vocab ? vocab_size : recall_vocab, hits = 0, total = 0;
+  if (candidates <= recall_k) return;
+  double *exact_score = (double *)malloc(recall_k * sizeof(double)), *quant_score = (double *)malloc(recall_k * sizeof(double));
+  long long *exact_row = (long long *)malloc(recall_k * sizeof(long long)), *quant_row = (long long *)malloc(recall_k * sizeof(long long));
+  float *query = (float *)malloc(embed_size * sizeof(float)), *table = NULL;
+  map_quantized(output_file, &model);
+  if (model.type == QUANT_PQ) table = (float *)malloc(2 * model.pq_m * PQ_CENTROIDS * sizeof(float));
+  for (int q = 0; q < recall_queries; q++) {
+    long long w = 1 + (long long)q * (candidates - 1) / recall_queries;  // skip </s>
+    for (int j = 0; j < recall_k; j++) exact_score[j] = quant_score[j] = -DBL_MAX;
+    if (model.type == QUANT_PQ) {
+      quant_decode_row(&model, w, query);
+      pq_query_table(&model, query, table);
+    }
+    for (long long a = 0; a < candidates; a++) {
+      if (a == w) continue;
+      insert_top(exact_score, exact_row, recall_k, mode_z_sim(vectors + w * embed_size, vectors + a * embed_size, embed_size), a);
+      double s = model.type == QUANT_INT8 ?
+        int8_mode_z_sim(model.codes + w * embed_size, model.scales[w], model.codes + a * embed_size, model.scales[a], embed_size) :
+        pq_mode_z_sim(&model, table, a);
+      insert_top(quant_score, quant_row, recall_k, s, a);
+    }
+    for (int i = 0; i < recall_k; i++) for (int j = 0; j < recall_k; j++) if (exact_row[i] == quant_row[j]) hits++;
+    total += recall_k;
+  }
+  printf("Mode-z neighbour recall@%d over %d queries among the top %lld words: %.4f\n", recall_k, recall_queries, candidates,
+         (double)hits / total);
+  unmap_quantized(&model);
+  free(exact_score);
+  free(quant_score);
+  free(exact_row);
+  free(quant_row);
+  free(query);
+  free(table);
+}
+
+int main(int argc, char **argv) {
+  int a;
+  if (argc == 1) {
+    printf("Quantized export of word vectors\n\n");
+    printf("Options:\n");
+    printf("\t-input <file>\n");
+    printf("\t\tWord vectors to quantize (text or model image)\n");
+    printf("\t-output <file>\n");
+    printf("\t\tWrite the quantized model to <file>\n");
+    printf("\t-type <string>\n");
+    printf("\t\tint8 (per-row scaled, 4x smaller) or pq (product quantized); default is int8\n");
+    printf("\t-dsub <int>\n");
+    printf("\t\tpq: dims per subspace, one byte each; default is 4 (16x smaller)\n");
+    printf("\t-iter <int>\n");
+    printf("\t\tpq: k-means iterations; default is 15\n");
+    printf("\t-sample <int>\n");
+    printf("\t\tpq: rows the codebooks are trained on; default is 65536\n");
+    printf("\t-threads <int>\n");
+    printf("\t\tpq: subspaces trained concurrently; default is 4\n");
+    printf("\t-recall <int>\n");
+    printf("\t\tQueries for the neighbour recall measurement, 0 to skip; default is 200\n");
+    printf("\t-recallVocab <int>\n");
+    printf("\t\tSearch the neighbours among the <int> most frequent words; default is 100000\n");
+    printf("\nExamples:\n");
+    printf("./quantize -input vecs.txt -output vecs.pq -type pq -dsub 4\n\n");
+    return 0;
+  }
+  for (a = 1; a < argc; a++) {
+    if (a == argc - 1) {
+      printf("Argument missing for %s\n", argv[a]);
+      exit(1);
+    }
+    if (!strcmp(argv[a], "-input")) input_file = argv[++a];
+    else if (!strcmp(argv[a], "-output")) output_file = argv[++a];
+    else if (!strcmp(argv[a], "-type")) {
+      a++;
+      if (!strcmp(argv[a], "int8")) type = QUANT_INT8;
+      else if (!strcmp(argv[a], "pq")) type = QUANT_PQ;
+      else {
+        printf("ERROR: unknown quantization type %s\n", argv[a]);
+        exit(1);
+      }
+    }
+    else if (!strcmp(argv[a], "-dsub")) pq_dsub = atoi(argv[++a]);
+    else if (!strcmp(argv[a], "-iter")) kmeans_iter = atoi(argv[++a]);
+    else if (!strcmp(argv[a], "-sample")) kmeans_sample = atoll(argv[++a]);
+    else if (!strcmp(argv[a], "-threads")) num_threads = atoi(argv[++a]);
+    else if (!strcmp(argv[a], "-recall")) recall_queries = atoi(argv[++a]);
+    else if (!strcmp(argv[a], "-recallVocab")) recall_vocab = atoll(argv[++a]);
+    else {
+      printf("ERROR: unknown option %s\n", argv[a]);
+      exit(1);
+    }
+  }
+  if (input_file == NULL || output_file == NULL) {
+    printf("ERROR: -input and -output are required\n");
+    exit(1);
+  }
+  if (pq_dsub < 1 || num_threads < 1 || kmeans_sample < 1) {
+    printf("ERROR: -dsub, -threads and -sample must be positive\n");
+    exit(1);
+  }
+  map_vectors(input_file, &vocab_size, &embed_size, &vocab, &vectors);
+  if (type == QUANT_INT8) QuantizeInt8();
+  else QuantizePQ();
+  WriteQuantized();
+  if (recall_queries > 0) MeasureRecall();
+  unmap_vectors(vocab);
+  return 0;
+}
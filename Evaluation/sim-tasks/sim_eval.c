@@ -1,127 +1,274 @@
+/*
+  Batch word similarity evaluation.
+
+  Scores any number of models on any number of similarity benchmarks and
+  prints one table of Spearman correlations, so a hyperparameter sweep is
+  evaluated by a single run instead of one process per model and task.
+  Benchmark words are put into a hash once; each model is then resolved by
+  one pass over its vocabulary.  Models are mapped through their shared
+  images (map_vectors) and evaluated concurrently, one model per thread.
+  Ties in the human or the model scores get averaged ranks.  Quantized
+  models (Evaluation/quantize) are scored by the kernels on their codes and
+  ragged models (-raggedOutput) by the ragged kernels, so the cost of a
+  coding or a truncation shows up as a row next to its float model.
+*/
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "../eval_lib.h"
+#include "../../vocab.h"
 
-int my_pair_cmp(const void *const first, const void *const second);
+#define MAX_BENCHMARKS 64
 
-const char* WORD_SIM353_FILE = "Evaluation/wordSim353_sorted.csv";
-const int WORD_SIM_LEN = 353;
+const char *WORD_SIM353_FILE = "Evaluation/sim-tasks/wordSim353_sorted.csv";
+const char *MEN_FILE = "Evaluation/sim-tasks/MEN_sorted.txt";
 
-const char *MEN_FILE = "Evaluation/MEN_sorted.txt";
-const int MEN_LEN = 3000;
+typedef struct {
+  const char *file_name;
+  int pairs;
+  int *word1, *word2;  // benchmark vocabulary ids
+  double *human_sim;
+} Benchmark;
 
-struct pair { 
-  float sim;
+typedef struct {
+  double value;
   int index;
-};
- 
-int main(int argc, char **argv) {  
-  char file_name[max_size];
-  long long vocab_size, embed_size;
-  char *vocab;
-  float *vectors;
-  int is_MEN = 0;
-  int full_dim = 0;
-
-  if (argc < 2) {
-    printf("Input file not found\n");
-    return -1;
-  }
-  if (argc > 2) {
-    is_MEN = atoi(argv[2]);
-  }
-  if (argc > 3) {
-    full_dim = atoi(argv[3]);
-  }  
-  const char *sim_file_name;
-  int len;
-  if (is_MEN == 0) {
-    sim_file_name = WORD_SIM353_FILE;
-    len = WORD_SIM_LEN;
-  }
-  else {
-    sim_file_name = MEN_FILE;
-    len = MEN_LEN;
-  } 
-  strcpy(file_name, argv[1]);
-  read_vectors(file_name, &vocab_size, &embed_size, &vocab, &vectors);  // read vocab & vectors from file
- 
-  printf("Using word vectors from %s\n", file_name);
-  if (full_dim == 0) {
-    printf("Using prob derived dims\n");
-  } else {
-    printf("Using all dims\n");
-  } 
-  printf("Using sim benchmark %s\n", sim_file_name);
-  // Read sim words from file
-  FILE *f;
-  f = fopen(sim_file_name, "rb"); 
-  struct pair w2v_sim[len];
-  float human_sim[len];
-  int valid = 0;
-  for (int i = 0; i < len; i++) { 
-    char word1[max_size] = {0};
-    char word2[max_size] = {0};
-    float sim = 0.0;
-  
-    read_str(word1, f);
-    read_str(word2, f);
-    
-    fscanf(f, "%f", &sim);
-    human_sim[i] = sim;
-    fgetc(f);
-    
-    if (is_MEN == 0)  fgetc(f);  // MEN requires one less fgetc
-
-    int idx1 = find_str(vocab, vocab_size, word1);
-    int idx2 = find_str(vocab, vocab_size, word2);
-    // Keep track of valid examples where both words in vocab 
-    if (idx1 != -1 && idx2 != -1) {
-      if (full_dim == 0) {
-        int mode_z = get_mode_z(vectors, embed_size, idx1, idx2);
-        w2v_sim[i].sim = dot_product_sim(vectors, embed_size, idx1, idx2, mode_z); 
-      } else {  
-        w2v_sim[i].sim = cosine_sim(vectors, embed_size, idx1, idx2); 
+} RankItem;
+
+Benchmark benchmarks[MAX_BENCHMARKS];
+int num_benchmarks = 0, num_models = 0, num_threads = 4, cosine = 0, next_model = 0;
+char **model_files;
+double *rho;  // num_models x num_benchmarks
+int *found;
+pthread_mutex_t next_model_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Reads 'word1,word2,sim' (WordSim353) or 'word1 word2 sim' (MEN) lines; words are lower-cased
+void ReadBenchmark(Benchmark *b, const char *file_name) {
+  char line[max_size], *word1, *word2, *sim;
+  int capacity = 1000;
+  FILE *f = fopen(file_name, "rb");
+  if (f == NULL) {
+    printf("ERROR: benchmark file %s not found!\n", file_name);
+    exit(1);
+  }
+  b->file_name = file_name;
+  b->pairs = 0;
+  b->word1 = (int *)malloc(capacity * sizeof(int));
+  b->word2 = (int *)malloc(capacity * sizeof(int));
+  b->human_sim = (double *)malloc(capacity * sizeof(double));
+  while (fgets(line, max_size, f) != NULL) {
+    for (char *c = line; *c; c++) *c = tolower(*c);
+    word1 = strtok(line, ", \t\r\n");
+    word2 = strtok(NULL, ", \t\r\n");
+    sim = strtok(NULL, ", \t\r\n");
+    if (sim == NULL) continue;
+    if (b->pairs == capacity) {
+      capacity *= 2;
+      b->word1 = (int *)realloc(b->word1, capacity * sizeof(int));
+      b->word2 = (int *)realloc(b->word2, capacity * sizeof(int));
+      b->human_sim = (double *)realloc(b->human_sim, capacity * sizeof(double));
+    }
+    int w1 = SearchVocab(word1);
+    if (w1 == -1) w1 = AddWordToVocab(word1);
+    int w2 = SearchVocab(word2);
+    if (w2 == -1) w2 = AddWordToVocab(word2);
+    b->word1[b->pairs] = w1;
+    b->word2[b->pairs] = w2;
+    b->human_sim[b->pairs] = atof(sim);
+    b->pairs++;
+  }
+  fclose(f);
+}
+
+int RankItemCompare(const void *a, const void *b) {
+  double d = ((RankItem *)a)->value - ((RankItem *)b)->value;
+  return (d > 0) - (d < 0);
+}
+
+// Ranks values in place (1-based); tied values share the average of their ranks
+void Rank(double *values, int n, RankItem *items) {
+  int a, b, c;
+  for (a = 0; a < n; a++) {
+    items[a].value = values[a];
+    items[a].index = a;
+  }
+  qsort(items, n, sizeof(RankItem), RankItemCompare);
+  for (a = 0; a < n; a = b) {
+    for (b = a + 1; b < n && items[b].value == items[a].value; b++);
+    for (c = a; c < b; c++) values[items[c].index] = (a + b + 1) / 2.0;
+  }
+}
+
+// Spearman's rho as the Pearson correlation of the ranks; overwrites x and y with their ranks
+double Spearman(double *x, double *y, int n) {
+  double mean = (n + 1) / 2.0, xy = 0, xx = 0, yy = 0;
+  RankItem *items = (RankItem *)malloc(n * sizeof(RankItem));
+  Rank(x, n, items);
+  Rank(y, n, items);
+  free(items);
+  for (int a = 0; a < n; a++) {
+    xy += (x[a] - mean) * (y[a] - mean);
+    xx += (x[a] - mean) * (x[a] - mean);
+    yy += (y[a] - mean) * (y[a] - mean);
+  }
+  if (xx == 0 || yy == 0) return 0;
+  return xy / sqrt(xx * yy);
+}
+
+void EvaluateModel(int m) {
+  long long model_size, embed_size;
+  char *model_vocab;
+  float *vectors = NULL, *query = NULL, *decoded = NULL, *table = NULL;
+  QuantizedModel quantized;
+  RaggedModel ragged;
+  int is_quantized = is_quantized_file(model_files[m]), is_ragged = is_ragged_file(model_files[m]);
+  if (is_ragged) {
+    map_ragged(model_files[m], &ragged);
+    model_size = ragged.vocab_size;
+    embed_size = ragged.embed_size;
+    model_vocab = ragged.vocab;
+  }
+  else if (is_quantized) {
+    map_quantized(model_files[m], &quantized);
+    model_size = quantized.vocab_size;
+    embed_size = quantized.embed_size;
+    model_vocab = quantized.vocab;
+    query = (float *)malloc(embed_size * sizeof(float));
+    decoded = (float *)malloc(embed_size * sizeof(float));
+    if (quantized.type == QUANT_PQ) table = (float *)malloc(2 * quantized.pq_m * PQ_CENTROIDS * sizeof(float));
+  }
+  else map_vectors(model_files[m], &model_size, &embed_size, &model_vocab, &vectors);
+  // benchmark word -> model row; the first occurrence wins, as with find_str
+  int *row = (int *)malloc(vocab_size * sizeof(int));
+  for (long long a = 0; a < vocab_size; a++) row[a] = -1;
+  for (long long a = 0; a < model_size; a++) {
+    int w = SearchVocab(&model_vocab[a * max_w]);
+    if (w != -1 && row[w] == -1) row[w] = a;
+  }
+  for (int b = 0; b < num_benchmarks; b++) {
+    Benchmark *bench = &benchmarks[b];
+    double *model_sim = (double *)malloc(bench->pairs * sizeof(double));
+    double *human_sim = (double *)malloc(bench->pairs * sizeof(double));
+    int valid = 0;
+    for (int p = 0; p < bench->pairs; p++) {
+      long long row1 = row[bench->word1[p]], row2 = row[bench->word2[p]];
+      // Keep track of valid examples where both words in vocab
+      if (row1 == -1 || row2 == -1) continue;
+      if (is_ragged) {
+        long long length1, length2;
+        const float *v1 = ragged_row(&ragged, row1, &length1), *v2 = ragged_row(&ragged, row2, &length2);
+        model_sim[valid] = cosine ? ragged_cosine_sim(v1, length1, v2, length2) : ragged_mode_z_sim(v1, length1, v2, length2);
+      } else if (!is_quantized) {
+        float *v1 = vectors + row1 * embed_size, *v2 = vectors + row2 * embed_size;
+        model_sim[valid] = cosine ? cosine_sim_rows(v1, v2, embed_size) : mode_z_sim(v1, v2, embed_size);
+      } else if (quantized.type == QUANT_INT8) {
+        signed char *v1 = quantized.codes + row1 * embed_size, *v2 = quantized.codes + row2 * embed_size;
+        model_sim[valid] = cosine ? int8_cosine_sim(v1, v2, embed_size) :
+          int8_mode_z_sim(v1, quantized.scales[row1], v2, quantized.scales[row2], embed_size);
+      } else {
+        quant_decode_row(&quantized, row1, query);
+        if (cosine) {
+          quant_decode_row(&quantized, row2, decoded);
+          model_sim[valid] = cosine_sim_rows(query, decoded, embed_size);
+        } else {
+          pq_query_table(&quantized, query, table);
+          model_sim[valid] = pq_mode_z_sim(&quantized, table, row2);
+        }
       }
-      w2v_sim[i].index = valid;
+      human_sim[valid] = bench->human_sim[p];
       valid++;
     }
-    else {
-      w2v_sim[i].sim = -1;
-    }
+    rho[m * num_benchmarks + b] = Spearman(model_sim, human_sim, valid);
+    found[m * num_benchmarks + b] = valid;
+    free(model_sim);
+    free(human_sim);
   }
-  
-  // Copy valid sims
-  struct pair final_w2v_sim[valid]; 
-  int cnt = 0;
-  for (int i = 0; i < len; i++) {
-    if (w2v_sim[i].sim != -1) {
-      final_w2v_sim[cnt].sim = w2v_sim[i].sim;
-      final_w2v_sim[cnt].index = w2v_sim[i].index;
-      cnt++;
-    }
+  free(row);
+  if (is_ragged) unmap_ragged(&ragged);
+  else if (is_quantized) {
+    unmap_quantized(&quantized);
+    free(query);
+    free(decoded);
+    free(table);
   }
+  else unmap_vectors(model_vocab);
+}
 
-  // Sort w2v sims & calculate rank correlation
-  qsort((void *) final_w2v_sim, valid, sizeof(*final_w2v_sim), my_pair_cmp);
-  float sum_squ_dist = 0.0;
-  for (int i = 0; i < valid; i++) {
-    sum_squ_dist += (i - final_w2v_sim[i].index) * (i - final_w2v_sim[i].index);
+void *EvaluateThread(void *id) {
+  while (1) {
+    pthread_mutex_lock(&next_model_lock);
+    int m = next_model++;
+    pthread_mutex_unlock(&next_model_lock);
+    if (m >= num_models) break;
+    EvaluateModel(m);
   }
-  printf("%lf\n", 1.0 - (6*sum_squ_dist)/(valid*(valid*valid - 1.0)));
-  
-  return 0;
+  pthread_exit(NULL);
 }
 
-int my_pair_cmp(const void *const first, const void *const second)
-{
-  const pair* a = (const pair*)first;
-  const pair* b = (const pair*)second;
-  if (a->sim > b->sim)
-    return 1;
-  else if (a->sim < b->sim)
-    return -1;
-  else
+int main(int argc, char **argv) {
+  int a, b, m, width = 5;
+  const char *benchmark_files[MAX_BENCHMARKS];
+  if (argc == 1) {
+    printf("Word similarity evaluation\n\n");
+    printf("Usage: ./sim_eval [options] <vector file>...\n");
+    printf("Options:\n");
+    printf("\t-benchmark <file>\n");
+    printf("\t\tScore on the pairs in <file> ('w1,w2,sim' or 'w1 w2 sim' lines); may be repeated\n");
+    printf("\t\tdefault is WordSim353 and MEN\n");
+    printf("\t-cosine <int>\n");
+    printf("\t\tUse cosine similarity over all dims instead of the dot product up to the mode of p(z|w1,w2); default is 0\n");
+    printf("\t-threads <int>\n");
+    printf("\t\tEvaluate up to <int> models concurrently; default is 4\n");
+    printf("\nExamples:\n");
+    printf("./sim_eval -threads 8 vectors/iSG_w_vecs_*.txt\n\n");
     return 0;
+  }
+  model_files = (char **)malloc(argc * sizeof(char *));
+  for (a = 1; a < argc; a++) {
+    if (argv[a][0] == '-' && a == argc - 1) {
+      printf("Argument missing for %s\n", argv[a]);
+      exit(1);
+    }
+    if (!strcmp(argv[a], "-benchmark")) {
+      if (num_benchmarks == MAX_BENCHMARKS) {
+        printf("ERROR: at most %d benchmarks\n", MAX_BENCHMARKS);
+        exit(1);
+      }
+      benchmark_files[num_benchmarks++] = argv[++a];
+    }
+    else if (!strcmp(argv[a], "-cosine")) cosine = atoi(argv[++a]);
+    else if (!strcmp(argv[a], "-threads")) num_threads = atoi(argv[++a]);
+    else model_files[num_models++] = argv[a];
+  }
+  if (num_benchmarks == 0) {
+    benchmark_files[num_benchmarks++] = WORD_SIM353_FILE;
+    benchmark_files[num_benchmarks++] = MEN_FILE;
+  }
+  if (num_threads < 1) num_threads = 1;
+
+  InitVocab();
+  for (b = 0; b < num_benchmarks; b++) ReadBenchmark(&benchmarks[b], benchmark_files[b]);
+  rho = (double *)calloc(num_models * num_benchmarks, sizeof(double));
+  found = (int *)calloc(num_models * num_benchmarks, sizeof(int));
+
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, EvaluateThread, (void *)(long)a);
+  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+
+  // results table: one row per model, rho and pairs found per benchmark
+  for (m = 0; m < num_models; m++) if ((int)strlen(model_files[m]) > width) width = strlen(model_files[m]);
+  printf("Similarity: %s\n", cosine ? "cosine over all dims" : "dot product up to mode z");
+  printf("%-*s", width, "model");
+  for (b = 0; b < num_benchmarks; b++) {
+    const char *name = strrchr(benchmarks[b].file_name, '/');
+    printf("  %20s", name == NULL ? benchmarks[b].file_name : name + 1);
+  }
+  printf("\n");
+  for (m = 0; m < num_models; m++) {
+    printf("%-*s", width, model_files[m]);
+    for (b = 0; b < num_benchmarks; b++) printf("  %8.4f (%4d/%4d)", rho[m * num_benchmarks + b], found[m * num_benchmarks + b], benchmarks[b].pairs);
+    printf("\n");
+  }
+  return 0;
 }
@@ -5,41 +5,22 @@
 #include <math.h>
 #include <gsl/gsl_randist.h>
 #include "../Evaluation/eval_lib.h"
+#include "../fastmath.h"
 
 #define MAX_SENTENCE_LENGTH 1000
 #define MAX_STRING 100
 
 #define STATUS_INTERVAL 15
-const int EXP_LEN = 87;
-const int vocab_hash_size = 30000000;  // Maximum 30 * 0.7 = 21M words in the vocabulary
 const double epsilon = 1e-8;
 
-struct vocab_word {
-  long long cn;
-  char *word;
-};
-struct vocab_word *vocab;
+#include "../vocab.h"
 int min_count = 25;
-float *exp_table;
 float dim_penalty, log_dim_penalty, sparsity_weight;
 float *input_embed, *context_embed;
 long long embed_size, train_words;
 const int table_size = 1e8;
-long long vocab_max_size = 1000, vocab_size = 0;
 int *table;
-int *vocab_hash;
 char read_vocab_file[MAX_STRING];
-/*
-  Build table which precompute exp function for certain integer
-  values
-*/
-void build_exp_table() {
-  exp_table = calloc(EXP_LEN * 2 + 1, sizeof(float));
-  for (int i = -EXP_LEN; i <= EXP_LEN; i++) {
-    exp_table[i + EXP_LEN] = exp(i);
-  }
-}
-
 // Reads a single word from a file, assuming space + tab + EOL to be word boundaries
 void ReadWord(char *word, FILE *fin) {
   int a = 0, ch;
@@ -63,25 +44,6 @@ void ReadWord(char *word, FILE *fin) {
   word[a] = 0;
 }
 
-// Returns hash value of a word
-int GetWordHash(char *word) {
-  unsigned long long a, hash = 0;
-  for (a = 0; a < strlen(word); a++) hash = hash * 257 + word[a];
-  hash = hash % vocab_hash_size;
-  return hash;
-}
-
-// Returns position of a word in the vocabulary; if the word is not found, returns -1
-int SearchVocab(char *word) {
-  unsigned int hash = GetWordHash(word);
-  while (1) {
-    if (vocab_hash[hash] == -1) return -1;
-    if (!strcmp(word, vocab[vocab_hash[hash]].word)) return vocab_hash[hash];
-    hash = (hash + 1) % vocab_hash_size;
-  }
-  return -1;
-}
-
 // Reads a word and returns its index in the vocabulary
 int ReadWordIndex(FILE *fin) {
   char word[MAX_STRING];
@@ -90,55 +52,6 @@ int ReadWordIndex(FILE *fin) {
   return SearchVocab(word);
 }
 
-// Adds a word to the vocabulary
-int AddWordToVocab(char *word) {
-  unsigned int hash, length = strlen(word) + 1;
-  if (length > MAX_STRING) length = MAX_STRING;
-  vocab[vocab_size].word = (char *)calloc(length, sizeof(char));
-  strcpy(vocab[vocab_size].word, word);
-  vocab[vocab_size].cn = 0;
-  vocab_size++;
-  // Reallocate memory if needed
-  if (vocab_size + 2 >= vocab_max_size) {
-    vocab_max_size += 1000;
-    vocab = (struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
-  }
-  hash = GetWordHash(word);
-  while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-  vocab_hash[hash] = vocab_size - 1;
-  return vocab_size - 1;
-}
-
-// Used later for sorting by word counts
-int VocabCompare(const void *a, const void *b) {
-  return ((struct vocab_word *)b)->cn - ((struct vocab_word *)a)->cn;
-}
-
-// Sorts the vocabulary by frequency using word counts
-void SortVocab() {
-  int a, size;
-  unsigned int hash;
-  // Sort the vocabulary and keep </s> at the first position
-  qsort(&vocab[1], vocab_size - 1, sizeof(struct vocab_word), VocabCompare);
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  size = vocab_size;
-  train_words = 0;
-  for (a = 0; a < size; a++) {
-    // Words occuring less than min_count times will be discarded from the vocab
-    if ((vocab[a].cn < min_count) && (a != 0)) {
-      vocab_size--;
-      free(vocab[a].word);
-    } else {
-      // Hash will be re-computed, as after the sorting it is not actual
-      hash=GetWordHash(vocab[a].word);
-      while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-      vocab_hash[hash] = a;
-      train_words += vocab[a].cn;
-    }
-  }
-  vocab = (struct vocab_word *)realloc(vocab, (vocab_size + 1) * sizeof(struct vocab_word));
-}
-
 void ReadVocab() {
   long long a, i = 0;
   char c;
@@ -148,8 +61,7 @@ void ReadVocab() {
     printf("Vocabulary file not found\n");
     exit(1);
   }
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  vocab_size = 0;
+  InitVocab();
   while (1) {
     ReadWord(word, fin);
     if (feof(fin)) break;
@@ -157,7 +69,7 @@ void ReadVocab() {
     fscanf(fin, "%lld%c", &vocab[a].cn, &c);
     i++;
   }
-  SortVocab();
+  train_words = SortVocab(min_count);
 }
 
 
@@ -180,37 +92,6 @@ void InitUnigramTable() {
   }
 }
 
-/*
-  Exp approximate function from 
-  http://stackoverflow.com/questions/10552280/fast-exp-calculation-possible-to-improve-accuracy-without-losing-too-much-perfo/14143184#14143184
-  Error in input range [-1,1] is 0.36%
-*/
-float exp_approx(float x) { 
-  return (24+x*(24+x*(12+x*(4+x))))*0.041666666f;
-}
-
-/*
-  Separate into integer and decimal components and use table and 
-  approximate exp function to compute each part, respectively
-*/
-float exp_fast(float x) {
-  int x_int = (int)x;
-  float x_dec = x - x_int;
-
-  float exp_table_val = 0.0;
-  if (x_int < -EXP_LEN) {
-    exp_table_val = exp_table[0];
-  } 
-  else if (x_int > EXP_LEN) {
-    exp_table_val = exp_table[2*EXP_LEN];
-  }
-  else {
-    exp_table_val = exp_table[x_int + EXP_LEN];
-  }
- 
-  return exp_table_val * exp_approx(x_dec);   
-}
-
 
 float get_log_prob(char *test_file_name, float *input_embed, float *context_embed, long embed_size) {
   int negative = 5;
@@ -313,7 +194,7 @@ float get_log_prob(char *test_file_name, float *input_embed, float *context_embe
       Z += prob;
       prob /= Z;
 
-      log_prob_current_context += log(prob + epsilon); 
+      log_prob_current_context += log_fast(prob + epsilon); 
     }
     total_log_prob += log_prob_current_context;
     iter += pos_context_counter;
@@ -339,17 +220,14 @@ int main(int argc, char **argv) {
   char input_file_name[MAX_STRING], context_file_name[MAX_STRING], test_file_name[MAX_STRING];
 
   // Build exp table                                                                                                                                                                                                      
-  build_exp_table();
-  vocab = (struct vocab_word *)calloc(vocab_max_size, sizeof(struct vocab_word));
-  vocab_hash = (int *)calloc(vocab_hash_size, sizeof(int));
   // Read arguments from command line                                                                                                                                                                                            
   strcpy(input_file_name, argv[1]);
   strcpy(context_file_name, argv[2]);
   strcpy(test_file_name, argv[3]);
   strcpy(read_vocab_file, argv[4]);
   // log what we read in                                                                                                                                                                                           
-  read_vectors(input_file_name, &vocab_size_local, &embed_size, &vocab_local, &input_embed);
-  read_vectors(context_file_name, &vocab_size_local, &embed_size, &dummy_vocab, &context_embed);
+  map_vectors(input_file_name, &vocab_size_local, &embed_size, &vocab_local, &input_embed);
+  map_vectors(context_file_name, &vocab_size_local, &embed_size, &dummy_vocab, &context_embed);
 
   ReadVocab();
   InitUnigramTable();
@@ -363,9 +241,7 @@ int main(int argc, char **argv) {
   
   printf("Starting testing...\n");
   float log_prob = get_log_prob(test_file_name, input_embed, context_embed, embed_size);
-  free(exp_table);
-  free(vocab);
-  free(vocab_hash);
+  FreeVocab();
   printf("-----------------------------------\n");
   printf("Final Perplexity: %f\n", log_prob);
   fflush(stdout);
@@ -0,0 +1,329 @@
+/*
+  Multi-node data-parallel training (-nodes), used by iSG.
+
+  N trainer processes, ranks 0 .. N-1, each train their own shard of the
+  corpus with the usual Hogwild threads.  Every process starts from the same
+  model (InitNet is seeded the same way everywhere) and keeps a copy of it,
+  the base, as of the last synchronization.  Every -syncWords local corpus
+  words a sync thread collects the rows of the words the process trained on
+  since (its touched flags) whose values moved away from the base, and
+  exchanges these sparse row deltas with the coordinator, rank 0, over TCP.
+  The coordinator averages each row over the processes that sent it, takes
+  the largest embed_current_size and the total word count, and sends the
+  same merged deltas back to everybody.  Each process then adds the merged
+  delta minus its own to its live rows and the merged delta to its base, so
+  all bases stay identical and the updates the threads made while the
+  exchange was in flight are kept and go out with the next one.  Training
+  threads never wait for a synchronization.
+
+  Rows are averaged over their senders rather than over all N processes, so
+  the rare words only one shard saw keep their whole update.  Once a
+  process is out of corpus it keeps taking part in the exchanges, sending
+  every row that differs from the base, until all of them are; the models
+  are then identical and rank 0 writes the vectors.
+
+  The wire format is native byte order: a ClusterHeader, then num_rows row
+  ids and num_rows x width floats.  Row ids below vocab_size are rows of
+  input_embed, the rest rows of context_embed.  The base copies double the
+  memory taken by the embedding tables.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define CLUSTER_CONNECT_SECONDS 60
+
+typedef struct {
+  long long words;        // to the coordinator: the sender's corpus words; back: everybody's
+  long long embed_size;   // to the coordinator: the sender's embed_current_size; back: the largest
+  long long done;         // to the coordinator: the sender is out of corpus; back: all are
+  long long width, num_rows;
+} ClusterHeader;
+
+// sparse rows, each width values long
+typedef struct {
+  long long rows;                 // ids the slot map covers
+  long long width, num_rows, max_rows;
+  long long *row;                 // per slot: its row id
+  int *senders;                   // per slot: processes whose deltas were added in
+  float *value;                   // num_rows x width
+  int *slot;                      // per row id: its slot, -1 if none
+} ClusterDelta;
+
+typedef struct {
+  int rank, num_nodes;
+  int fd;                         // a worker's connection to the coordinator
+  int *worker_fds;                // the coordinator's, by rank - 1
+  long long *scratch_rows, scratch_size;
+  float *scratch_values;
+  long long bytes_sent;
+} ClusterLink;
+
+ClusterDelta *cluster_delta_new(long long rows) {
+  ClusterDelta *d = (ClusterDelta *) calloc(1, sizeof(ClusterDelta));
+  d->rows = rows;
+  d->slot = (int *) malloc(rows * sizeof(int));
+  if (d->slot == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  for (long long a = 0; a < rows; a++) d->slot[a] = -1;
+  return d;
+}
+
+void cluster_delta_free(ClusterDelta *d) {
+  free(d->row);
+  free(d->senders);
+  free(d->value);
+  free(d->slot);
+  free(d);
+}
+
+// drops all rows; the next ones are width values long
+void cluster_delta_reset(ClusterDelta *d, long long width) {
+  for (long long s = 0; s < d->num_rows; s++) d->slot[d->row[s]] = -1;
+  d->num_rows = 0;
+  if (width > d->width && d->max_rows > 0) {
+    d->value = (float *) realloc(d->value, d->max_rows * width * sizeof(float));
+    if (d->value == NULL) {
+      printf("Memory allocation failed\n");
+      exit(1);
+    }
+  }
+  d->width = width;
+}
+
+// the values of row id, zeroed when the row is new
+float *cluster_delta_row(ClusterDelta *d, long long id) {
+  int s = d->slot[id];
+  if (s >= 0) return d->value + s * d->width;
+  if (d->num_rows == d->max_rows) {
+    d->max_rows = d->max_rows > 0 ? 2 * d->max_rows : 1024;
+    d->row = (long long *) realloc(d->row, d->max_rows * sizeof(long long));
+    d->senders = (int *) realloc(d->senders, d->max_rows * sizeof(int));
+    d->value = (float *) realloc(d->value, d->max_rows * d->width * sizeof(float));
+    if (d->row == NULL || d->senders == NULL || d->value == NULL) {
+      printf("Memory allocation failed\n");
+      exit(1);
+    }
+  }
+  s = d->slot[id] = (int)d->num_rows++;
+  d->row[s] = id;
+  d->senders[s] = 0;
+  memset(d->value + s * d->width, 0, d->width * sizeof(float));
+  return d->value + s * d->width;
+}
+
+// adds num_rows rows of width <= d->width values each, one sender's worth
+void cluster_delta_add(ClusterDelta *d, const long long *rows, const float *values, long long num_rows, long long width) {
+  for (long long s = 0; s < num_rows; s++) {
+    float *dest = cluster_delta_row(d, rows[s]);
+    for (long long i = 0; i < width; i++) dest[i] += values[s * width + i];
+    d->senders[d->slot[rows[s]]]++;
+  }
+}
+
+void cluster_delta_average(ClusterDelta *d) {
+  for (long long s = 0; s < d->num_rows; s++) {
+    if (d->senders[s] < 2) continue;
+    for (long long i = 0; i < d->width; i++) d->value[s * d->width + i] /= d->senders[s];
+  }
+}
+
+// c, when not NULL, counts the bytes
+void cluster_send_all(ClusterLink *c, int fd, const void *data, long long bytes) {
+  const char *p = (const char *)data;
+  while (bytes > 0) {
+    ssize_t n = send(fd, p, bytes, MSG_NOSIGNAL);
+    if (n <= 0) {
+      printf("ERROR: lost the connection to another node\n");
+      exit(1);
+    }
+    p += n;
+    bytes -= n;
+    if (c != NULL) c->bytes_sent += n;
+  }
+}
+
+void cluster_recv_all(int fd, void *data, long long bytes) {
+  char *p = (char *)data;
+  while (bytes > 0) {
+    ssize_t n = recv(fd, p, bytes, 0);
+    if (n <= 0) {
+      printf("ERROR: lost the connection to another node\n");
+      exit(1);
+    }
+    p += n;
+    bytes -= n;
+  }
+}
+
+void cluster_send_delta(ClusterLink *c, int fd, ClusterHeader *h, ClusterDelta *d) {
+  h->width = d->width;
+  h->num_rows = d->num_rows;
+  cluster_send_all(c, fd, h, sizeof(ClusterHeader));
+  cluster_send_all(c, fd, d->row, d->num_rows * sizeof(long long));
+  cluster_send_all(c, fd, d->value, d->num_rows * d->width * sizeof(float));
+}
+
+// reads the rows announced by h and adds them to d
+void cluster_recv_delta(ClusterLink *c, int fd, ClusterHeader *h, ClusterDelta *d) {
+  if (h->num_rows * h->width > c->scratch_size || h->num_rows > c->scratch_size) {
+    c->scratch_size = h->num_rows * (h->width > 1 ? h->width : 1);
+    c->scratch_rows = (long long *) realloc(c->scratch_rows, c->scratch_size * sizeof(long long));
+    c->scratch_values = (float *) realloc(c->scratch_values, c->scratch_size * sizeof(float));
+    if (c->scratch_rows == NULL || c->scratch_values == NULL) {
+      printf("Memory allocation failed\n");
+      exit(1);
+    }
+  }
+  cluster_recv_all(fd, c->scratch_rows, h->num_rows * sizeof(long long));
+  cluster_recv_all(fd, c->scratch_values, h->num_rows * h->width * sizeof(float));
+  for (long long s = 0; s < h->num_rows; s++) {
+    if (c->scratch_rows[s] < 0 || c->scratch_rows[s] >= d->rows) {
+      printf("ERROR: row %lld from another node is out of range\n", c->scratch_rows[s]);
+      exit(1);
+    }
+  }
+  cluster_delta_add(d, c->scratch_rows, c->scratch_values, h->num_rows, h->width);
+}
+
+// splits "host:port"
+void cluster_parse_address(const char *address, char *host, char *port) {
+  const char *colon = strrchr(address, ':');
+  if (colon == NULL || colon == address || colon[1] == 0 || colon - address >= 256) {
+    printf("ERROR: -coordinator must be host:port, not %s\n", address);
+    exit(1);
+  }
+  memcpy(host, address, colon - address);
+  host[colon - address] = 0;
+  strncpy(port, colon + 1, 31);
+  port[31] = 0;
+}
+
+/*
+  Rank 0 listens on address and accepts the other num_nodes - 1 ranks,
+  which connect to it, retrying for CLUSTER_CONNECT_SECONDS while it comes
+  up.  fingerprint sums up what must agree across the processes (vocab,
+  sizes, threads); every rank checks it against rank 0's.
+*/
+ClusterLink *cluster_open(const char *address, int rank, int num_nodes, unsigned long long fingerprint) {
+  char host[256], port[32];
+  struct addrinfo hints, *addr;
+  int one = 1;
+  ClusterLink *c = (ClusterLink *) calloc(1, sizeof(ClusterLink));
+  c->rank = rank;
+  c->num_nodes = num_nodes;
+  c->fd = -1;
+  cluster_parse_address(address, host, port);
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &addr) != 0) {
+    printf("ERROR: cannot resolve %s\n", address);
+    exit(1);
+  }
+  if (rank == 0) {
+    int listener = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (listener < 0 || bind(listener, addr->ai_addr, addr->ai_addrlen) != 0 || listen(listener, num_nodes) != 0) {
+      printf("ERROR: cannot listen on %s\n", address);
+      exit(1);
+    }
+    c->worker_fds = (int *) calloc(num_nodes - 1, sizeof(int));
+    for (int a = 0; a < num_nodes - 1; a++) c->worker_fds[a] = -1;
+    for (int a = 0; a < num_nodes - 1; a++) {
+      long long hello[2];
+      int fd = accept(listener, NULL, NULL);
+      if (fd < 0) {
+        printf("ERROR: accept failed on %s\n", address);
+        exit(1);
+      }
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      cluster_recv_all(fd, hello, sizeof(hello));
+      if (hello[0] < 1 || hello[0] >= num_nodes || c->worker_fds[hello[0] - 1] != -1) {
+        printf("ERROR: a node connected as rank %lld of %d\n", hello[0], num_nodes);
+        exit(1);
+      }
+      cluster_send_all(c, fd, &fingerprint, sizeof(fingerprint));
+      if ((unsigned long long)hello[1] != fingerprint) {
+        printf("ERROR: rank %lld has a different vocabulary, -maxSize or -threads\n", hello[0]);
+        exit(1);
+      }
+      c->worker_fds[hello[0] - 1] = fd;
+    }
+    close(listener);
+  } else {
+    long long hello[2] = {rank, (long long)fingerprint};
+    unsigned long long theirs;
+    for (int attempt = 0; c->fd < 0; attempt++) {
+      c->fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+      if (c->fd >= 0 && connect(c->fd, addr->ai_addr, addr->ai_addrlen) == 0) break;
+      if (c->fd >= 0) close(c->fd);
+      c->fd = -1;
+      if (attempt >= CLUSTER_CONNECT_SECONDS * 10) {
+        printf("ERROR: cannot connect to the coordinator at %s\n", address);
+        exit(1);
+      }
+      struct timespec pause = {0, 100000000};
+      nanosleep(&pause, NULL);
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    cluster_send_all(c, c->fd, hello, sizeof(hello));
+    cluster_recv_all(c->fd, &theirs, sizeof(theirs));
+    if (theirs != fingerprint) {
+      printf("ERROR: this node has a different vocabulary, -maxSize or -threads than rank 0\n");
+      exit(1);
+    }
+  }
+  freeaddrinfo(addr);
+  return c;
+}
+
+void cluster_close(ClusterLink *c) {
+  if (c->fd >= 0) close(c->fd);
+  for (int a = 0; c->worker_fds != NULL && a < c->num_nodes - 1; a++) close(c->worker_fds[a]);
+  free(c->worker_fds);
+  free(c->scratch_rows);
+  free(c->scratch_values);
+  free(c);
+}
+
+/*
+  One synchronization round.  h holds this process's words, embed size and
+  done flag and mine its row deltas; on return h holds the totals and
+  merged the averaged deltas, the same on every process.  A worker blocks
+  until the coordinator has heard from everybody.
+*/
+void cluster_exchange(ClusterLink *c, ClusterHeader *h, ClusterDelta *mine, ClusterDelta *merged) {
+  if (c->rank != 0) {
+    cluster_send_delta(c, c->fd, h, mine);
+    cluster_recv_all(c->fd, h, sizeof(ClusterHeader));
+    cluster_delta_reset(merged, h->width);
+    cluster_recv_delta(c, c->fd, h, merged);
+    return;
+  }
+  ClusterHeader *theirs = (ClusterHeader *) malloc((c->num_nodes - 1) * sizeof(ClusterHeader));
+  long long width = mine->width;
+  for (int a = 0; a < c->num_nodes - 1; a++) {
+    cluster_recv_all(c->worker_fds[a], theirs + a, sizeof(ClusterHeader));
+    h->words += theirs[a].words;
+    if (theirs[a].embed_size > h->embed_size) h->embed_size = theirs[a].embed_size;
+    h->done = h->done && theirs[a].done;
+    if (theirs[a].width > width) width = theirs[a].width;
+  }
+  // summed in rank order, so the averages do not depend on who arrived first
+  cluster_delta_reset(merged, width);
+  cluster_delta_add(merged, mine->row, mine->value, mine->num_rows, mine->width);
+  for (int a = 0; a < c->num_nodes - 1; a++) cluster_recv_delta(c, c->worker_fds[a], theirs + a, merged);
+  cluster_delta_average(merged);
+  for (int a = 0; a < c->num_nodes - 1; a++) cluster_send_delta(c, c->worker_fds[a], h, merged);
+  free(theirs);
+}
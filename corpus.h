@@ -0,0 +1,370 @@
+/*
+  Training corpus reader shared by iSG and iCBOW.
+
+  The corpus can be plain text, gzip (any number of members) or, when built
+  with -DUSE_ZSTD -lzstd, zstd (any number of frames); the format is detected
+  from the magic bytes.  Compressed data cannot be entered at an arbitrary
+  byte, so the first full pass over the file (building the vocabulary, or
+  corpus_scan when the vocabulary is read from disk) records every gzip
+  member / zstd frame boundary as a restart point.  A thread that wants to
+  start at a given text offset then seeks to the closest restart point before
+  it and decompresses forward from there; with multi-member files (pigz -i,
+  bgzip, zstd -B, concatenated chunks) that is a short skip, with a single
+  member it degrades to inflating the prefix.
+
+  Every open stream has its own decompressor thread which fills a small ring
+  of chunks ahead of the consumer, so inflating overlaps with training.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#define CORPUS_CHUNK 262144
+#define CORPUS_BUFFERS 4
+
+enum { CORPUS_PLAIN, CORPUS_GZIP, CORPUS_ZSTD };
+const char *corpus_format_names[] = {"plain text", "gzip", "zstd"};
+
+// a place where decompression can restart from scratch
+typedef struct {
+  long long raw_offset;   // byte offset in the file on disk
+  long long text_offset;  // byte offset in the decompressed text
+} CorpusRestartPoint;
+
+typedef struct {
+  char path[1024];
+  int format;
+  int complete;           // set once a full pass has recorded text_size and the restart points
+  long long raw_size, text_size;
+  long long num_points, max_points;
+  CorpusRestartPoint *points;
+} CorpusIndex;
+
+typedef struct {
+  CorpusIndex *index;
+  FILE *raw;
+  long long raw_read, text_pos, skip;
+  int recording, finished;
+  unsigned char *in;
+  z_stream zs;
+#ifdef USE_ZSTD
+  ZSTD_DCtx *zd;
+  ZSTD_inBuffer zin;
+#endif
+  // ring of decompressed chunks; the consumer owns chunk[head] while it reads it
+  char *chunk[CORPUS_BUFFERS];
+  int chunk_len[CORPUS_BUFFERS];
+  int head, count, holding, producer_done, stop;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t producer;
+  // consumer side
+  char *buf;
+  int pos, len, eof;
+} CorpusFile;
+
+// Opens the corpus and detects its format; returns NULL if the file cannot be opened
+CorpusIndex *corpus_index_new(const char *path) {
+  unsigned char magic[4] = {0, 0, 0, 0};
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) return NULL;
+  CorpusIndex *index = (CorpusIndex *) calloc(1, sizeof(CorpusIndex));
+  strncpy(index->path, path, sizeof(index->path) - 1);
+  size_t n = fread(magic, 1, 4, f);
+  if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) index->format = CORPUS_GZIP;
+  else if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) index->format = CORPUS_ZSTD;
+  else index->format = CORPUS_PLAIN;
+#ifndef USE_ZSTD
+  if (index->format == CORPUS_ZSTD) {
+    printf("ERROR: %s is zstd compressed; rebuild with -DUSE_ZSTD -lzstd\n", path);
+    exit(1);
+  }
+#endif
+  fseeko(f, 0, SEEK_END);
+  index->raw_size = ftello(f);
+  fclose(f);
+  if (index->format == CORPUS_PLAIN) {
+    index->text_size = index->raw_size;
+    index->complete = 1;
+  }
+  index->max_points = 1024;
+  index->points = (CorpusRestartPoint *) calloc(index->max_points, sizeof(CorpusRestartPoint));
+  index->num_points = 1;  // the start of the file
+  return index;
+}
+
+void corpus_index_free(CorpusIndex *index) {
+  free(index->points);
+  free(index);
+}
+
+void corpus_add_point(CorpusIndex *index, long long raw_offset, long long text_offset) {
+  if (index->num_points == index->max_points) {
+    index->max_points *= 2;
+    index->points = (CorpusRestartPoint *) realloc(index->points, index->max_points * sizeof(CorpusRestartPoint));
+  }
+  index->points[index->num_points].raw_offset = raw_offset;
+  index->points[index->num_points].text_offset = text_offset;
+  index->num_points++;
+}
+
+// Last restart point at or before the given text offset
+CorpusRestartPoint corpus_find_point(CorpusIndex *index, long long text_offset) {
+  long long lo = 0, hi = index->num_points - 1;
+  while (lo < hi) {
+    long long mid = (lo + hi + 1) / 2;
+    if (index->points[mid].text_offset <= text_offset) lo = mid;
+    else hi = mid - 1;
+  }
+  return index->points[lo];
+}
+
+// Refills the compressed input buffer; returns the number of bytes read
+int corpus_read_raw(CorpusFile *cf) {
+  int n = fread(cf->in, 1, CORPUS_CHUNK, cf->raw);
+  cf->raw_read += n;
+  return n;
+}
+
+// Decompresses up to cap bytes into out; sets cf->finished at the end of the file
+int corpus_fill(CorpusFile *cf, char *out, int cap) {
+  int produced = 0;
+  if (cf->index->format == CORPUS_PLAIN) {
+    produced = fread(out, 1, cap, cf->raw);
+    if (produced < cap) cf->finished = 1;
+  } else if (cf->index->format == CORPUS_GZIP) {
+    while (produced < cap && !cf->finished) {
+      if (cf->zs.avail_in == 0) {
+        cf->zs.avail_in = corpus_read_raw(cf);
+        cf->zs.next_in = cf->in;
+        if (cf->zs.avail_in == 0) {
+          cf->finished = 1;
+          break;
+        }
+      }
+      cf->zs.next_out = (unsigned char *)out + produced;
+      cf->zs.avail_out = cap - produced;
+      int ret = inflate(&cf->zs, Z_NO_FLUSH);
+      cf->text_pos += (cap - produced) - cf->zs.avail_out;
+      produced = cap - cf->zs.avail_out;
+      if (ret == Z_STREAM_END) {
+        // end of a gzip member: the next one can be inflated on its own
+        if (cf->recording) corpus_add_point(cf->index, cf->raw_read - cf->zs.avail_in, cf->text_pos);
+        inflateReset(&cf->zs);
+      } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        printf("ERROR: corrupt gzip data in %s\n", cf->index->path);
+        exit(1);
+      }
+    }
+#ifdef USE_ZSTD
+  } else {
+    ZSTD_outBuffer zout = {out, (size_t)cap, 0};
+    while (zout.pos < zout.size && !cf->finished) {
+      if (cf->zin.pos == cf->zin.size) {
+        cf->zin.size = corpus_read_raw(cf);
+        cf->zin.pos = 0;
+        if (cf->zin.size == 0) {
+          cf->finished = 1;
+          break;
+        }
+      }
+      size_t before = zout.pos;
+      size_t ret = ZSTD_decompressStream(cf->zd, &zout, &cf->zin);
+      if (ZSTD_isError(ret)) {
+        printf("ERROR: corrupt zstd data in %s: %s\n", cf->index->path, ZSTD_getErrorName(ret));
+        exit(1);
+      }
+      cf->text_pos += zout.pos - before;
+      // end of a zstd frame: the next one can be decompressed on its own
+      if (ret == 0 && cf->recording) corpus_add_point(cf->index, cf->raw_read - (cf->zin.size - cf->zin.pos), cf->text_pos);
+    }
+    produced = zout.pos;
+#endif
+  }
+  return produced;
+}
+
+void *CorpusProducerThread(void *arg) {
+  CorpusFile *cf = (CorpusFile *)arg;
+  while (1) {
+    pthread_mutex_lock(&cf->lock);
+    while (cf->count == CORPUS_BUFFERS && !cf->stop) pthread_cond_wait(&cf->cond, &cf->lock);
+    int slot = (cf->head + cf->count) % CORPUS_BUFFERS;
+    int stop = cf->stop;
+    pthread_mutex_unlock(&cf->lock);
+    if (stop) break;
+    int n = corpus_fill(cf, cf->chunk[slot], CORPUS_CHUNK);
+    // drop the text between the restart point and the requested offset
+    if (cf->skip > 0) {
+      int dropped = (cf->skip < n) ? cf->skip : n;
+      memmove(cf->chunk[slot], cf->chunk[slot] + dropped, n - dropped);
+      n -= dropped;
+      cf->skip -= dropped;
+    }
+    pthread_mutex_lock(&cf->lock);
+    if (n > 0) {
+      cf->chunk_len[slot] = n;
+      cf->count++;
+    }
+    if (cf->finished) cf->producer_done = 1;
+    pthread_cond_broadcast(&cf->cond);
+    pthread_mutex_unlock(&cf->lock);
+    if (cf->finished) break;
+  }
+  if (cf->finished && cf->recording) {
+    cf->index->text_size = cf->text_pos;
+    cf->index->complete = 1;
+  }
+  return NULL;
+}
+
+// Positions the stream at a text offset and starts its decompressor thread
+void corpus_start(CorpusFile *cf, long long text_offset) {
+  CorpusIndex *index = cf->index;
+  CorpusRestartPoint point = {text_offset, text_offset};
+  if (index->format != CORPUS_PLAIN) point = corpus_find_point(index, text_offset);
+  fseeko(cf->raw, point.raw_offset, SEEK_SET);
+  cf->raw_read = point.raw_offset;
+  cf->text_pos = point.text_offset;
+  cf->skip = text_offset - point.text_offset;
+  cf->recording = !index->complete && text_offset == 0;
+  cf->finished = 0;
+  if (index->format == CORPUS_GZIP) {
+    inflateReset(&cf->zs);
+    cf->zs.avail_in = 0;
+  }
+#ifdef USE_ZSTD
+  if (index->format == CORPUS_ZSTD) {
+    ZSTD_DCtx_reset(cf->zd, ZSTD_reset_session_only);
+    cf->zin.pos = cf->zin.size = 0;
+  }
+#endif
+  cf->head = cf->count = cf->holding = cf->producer_done = cf->stop = 0;
+  cf->pos = cf->len = cf->eof = 0;
+  pthread_create(&cf->producer, NULL, CorpusProducerThread, (void *)cf);
+}
+
+void corpus_halt(CorpusFile *cf) {
+  pthread_mutex_lock(&cf->lock);
+  cf->stop = 1;
+  pthread_cond_broadcast(&cf->cond);
+  pthread_mutex_unlock(&cf->lock);
+  pthread_join(cf->producer, NULL);
+}
+
+// Opens an independent stream over the corpus starting at the given text offset
+CorpusFile *corpus_open(CorpusIndex *index, long long text_offset) {
+  CorpusFile *cf = (CorpusFile *) calloc(1, sizeof(CorpusFile));
+  cf->index = index;
+  cf->raw = fopen(index->path, "rb");
+  if (cf->raw == NULL) {
+    printf("ERROR: training data file not found!\n");
+    exit(1);
+  }
+  cf->in = (unsigned char *) malloc(CORPUS_CHUNK);
+  for (int i = 0; i < CORPUS_BUFFERS; i++) cf->chunk[i] = (char *) malloc(CORPUS_CHUNK);
+  if (index->format == CORPUS_GZIP) inflateInit2(&cf->zs, 16 + MAX_WBITS);
+#ifdef USE_ZSTD
+  if (index->format == CORPUS_ZSTD) {
+    cf->zd = ZSTD_createDCtx();
+    cf->zin.src = cf->in;
+  }
+#endif
+  pthread_mutex_init(&cf->lock, NULL);
+  pthread_cond_init(&cf->cond, NULL);
+  corpus_start(cf, text_offset);
+  return cf;
+}
+
+// Restarts the stream at a text offset, e.g. at the beginning of a new epoch
+void corpus_seek(CorpusFile *cf, long long text_offset) {
+  corpus_halt(cf);
+  corpus_start(cf, text_offset);
+}
+
+void corpus_close(CorpusFile *cf) {
+  corpus_halt(cf);
+  fclose(cf->raw);
+  if (cf->index->format == CORPUS_GZIP) inflateEnd(&cf->zs);
+#ifdef USE_ZSTD
+  if (cf->index->format == CORPUS_ZSTD) ZSTD_freeDCtx(cf->zd);
+#endif
+  pthread_mutex_destroy(&cf->lock);
+  pthread_cond_destroy(&cf->cond);
+  for (int i = 0; i < CORPUS_BUFFERS; i++) free(cf->chunk[i]);
+  free(cf->in);
+  free(cf);
+}
+
+// Hands the current chunk back to the decompressor and waits for the next one; returns 0 at the end of the corpus
+int corpus_next_chunk(CorpusFile *cf) {
+  pthread_mutex_lock(&cf->lock);
+  if (cf->holding) {
+    cf->head = (cf->head + 1) % CORPUS_BUFFERS;
+    cf->count--;
+    cf->holding = 0;
+    pthread_cond_broadcast(&cf->cond);
+  }
+  while (cf->count == 0 && !cf->producer_done) pthread_cond_wait(&cf->cond, &cf->lock);
+  if (cf->count > 0) {
+    cf->holding = 1;
+    cf->buf = cf->chunk[cf->head];
+    cf->len = cf->chunk_len[cf->head];
+    cf->pos = 0;
+  } else cf->eof = 1;
+  pthread_mutex_unlock(&cf->lock);
+  return !cf->eof;
+}
+
+static inline int corpus_getc(CorpusFile *cf) {
+  if (cf->pos < cf->len) return (unsigned char)cf->buf[cf->pos++];
+  if (cf->eof || !corpus_next_chunk(cf)) return EOF;
+  return (unsigned char)cf->buf[cf->pos++];
+}
+
+// only valid right after a successful corpus_getc
+static inline void corpus_ungetc(CorpusFile *cf) {
+  cf->pos--;
+}
+
+static inline int corpus_eof(CorpusFile *cf) {
+  return cf->eof;
+}
+
+// Reads a single word, assuming space + tab + EOL to be word boundaries; same rules as ReadWord
+void corpus_read_word(char *word, int max_len, CorpusFile *cf) {
+  int a = 0, ch;
+  while (1) {
+    ch = corpus_getc(cf);
+    if (ch == EOF) break;
+    if (ch == 13) continue;
+    if ((ch == ' ') || (ch == '\t') || (ch == '\n')) {
+      if (a > 0) {
+        if (ch == '\n') corpus_ungetc(cf);
+        break;
+      }
+      if (ch == '\n') {
+        strcpy(word, (char *)"</s>");
+        return;
+      } else continue;
+    }
+    word[a] = ch;
+    a++;
+    if (a >= max_len - 1) a--;   // Truncate too long words
+  }
+  word[a] = 0;
+}
+
+// Runs one full pass to record the text size and restart points, if no pass has done so yet
+void corpus_scan(CorpusIndex *index) {
+  if (index->complete) return;
+  CorpusFile *cf = corpus_open(index, 0);
+  while (corpus_next_chunk(cf));
+  corpus_close(cf);
+}
@@ -0,0 +1,126 @@
+/*
+  Thread-local delta buffers for rows of the embedding tables, shared by iSG
+  and iCBOW.
+
+  The vocabulary is sorted by frequency, so the first few hundred rows of
+  input_embed and context_embed ("the", ",", ...) are positives and
+  negatives in almost every update.  Written Hogwild-style by every thread,
+  their cache lines bounce between cores on each step.  With -hotRows K a
+  thread instead adds its updates of rows < K into a private fp32 buffer and
+  merges it into the shared table every -hotMerge corpus words and when it
+  finishes, so those lines are written once per merge instead of once per
+  update.  Rows >= K go straight to the table as before.
+
+  Between merges a thread reads the shared rows, i.e. its own pending deltas
+  are not visible to it yet: for the hot rows each merge interval acts like
+  a minibatch.  Only the touched prefix of the touched rows is merged, so a
+  merge costs about as much as the updates it replaces.
+
+  -deterministic buffers every row the same way, in a pool of slots sized
+  for one chunk of work, and merges all threads' buffers at the chunk
+  barrier: hot_rows_merge_owned adds, for the rows a thread owns, every
+  thread's deltas in thread order, so the sums do not depend on timing.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+  long long rows, stride, limit;  // buffered rows, row stride and rows * stride
+  long long capacity;             // slots
+  float *delta;                   // capacity x stride pending updates
+  int *slot;                      // per row: its slot, -1 if none
+  int *bound;                     // per slot: length of the prefix holding deltas
+  long long *dirty, num_dirty;    // row of each slot in use
+} HotRows;
+
+// buffers for rows < rows, at most capacity of them touched between merges
+HotRows *hot_rows_new(long long rows, long long stride, long long capacity) {
+  HotRows *h = (HotRows *) calloc(1, sizeof(HotRows));
+  if (capacity > rows) capacity = rows;
+  h->rows = rows;
+  h->stride = stride;
+  h->limit = rows * stride;
+  h->capacity = capacity;
+  h->delta = (float *) calloc(capacity * stride, sizeof(float));
+  h->slot = (int *) malloc(rows * sizeof(int));
+  h->bound = (int *) calloc(capacity, sizeof(int));
+  h->dirty = (long long *) calloc(capacity, sizeof(long long));
+  if (h->delta == NULL || h->slot == NULL || h->bound == NULL || h->dirty == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  for (long long a = 0; a < rows; a++) h->slot[a] = -1;
+  return h;
+}
+
+void hot_rows_free(HotRows *h) {
+  if (h == NULL) return;
+  free(h->delta);
+  free(h->slot);
+  free(h->bound);
+  free(h->dirty);
+  free(h);
+}
+
+/*
+  embed_add(table, idx, delta), buffered when idx is in a buffered row; h may
+  be NULL.  Once all slots are taken new rows go to the table directly,
+  which callers that need the buffer (-deterministic) rule out by sizing it
+*/
+static inline void hot_rows_add(HotRows *h, embed_t *table, long long idx, float delta) {
+  if (h == NULL || idx >= h->limit) {
+    embed_add(table, idx, delta);
+    return;
+  }
+  long long row = idx / h->stride;
+  int col = (int)(idx - row * h->stride), s = h->slot[row];
+  if (s < 0) {
+    if (h->num_dirty == h->capacity) {
+      embed_add(table, idx, delta);
+      return;
+    }
+    s = h->slot[row] = (int)h->num_dirty;
+    h->dirty[h->num_dirty++] = row;
+  }
+  if (col >= h->bound[s]) h->bound[s] = col + 1;
+  h->delta[s * h->stride + col] += delta;
+}
+
+// forgets the pending deltas
+void hot_rows_clear(HotRows *h) {
+  if (h == NULL) return;
+  for (long long s = 0; s < h->num_dirty; s++) {
+    memset(h->delta + s * h->stride, 0, h->bound[s] * sizeof(float));
+    h->bound[s] = 0;
+    h->slot[h->dirty[s]] = -1;
+  }
+  h->num_dirty = 0;
+}
+
+// adds the pending deltas to the shared table and clears them
+void hot_rows_merge(HotRows *h, embed_t *table) {
+  if (h == NULL) return;
+  for (long long s = 0; s < h->num_dirty; s++) {
+    float *delta = h->delta + s * h->stride;
+    embed_t *dest = table + h->dirty[s] * h->stride;
+    for (int i = 0; i < h->bound[s]; i++) embed_add(dest, i, delta[i]);
+  }
+  hot_rows_clear(h);
+}
+
+/*
+  Adds to table the deltas of every buffer in buffers[0 .. num_buffers), in
+  that order, for the rows with row % num_owners == owner; the buffers are
+  left as they are
+*/
+void hot_rows_merge_owned(HotRows **buffers, int num_buffers, embed_t *table, int owner, int num_owners) {
+  for (int b = 0; b < num_buffers; b++) {
+    HotRows *h = buffers[b];
+    for (long long s = 0; s < h->num_dirty; s++) {
+      if (h->dirty[s] % num_owners != owner) continue;
+      float *delta = h->delta + s * h->stride;
+      embed_t *dest = table + h->dirty[s] * h->stride;
+      for (int i = 0; i < h->bound[s]; i++) embed_add(dest, i, delta[i]);
+    }
+  }
+}
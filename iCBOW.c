@@ -6,20 +6,23 @@
 #include <string.h>
 #include <math.h>
 #include <pthread.h>
-#include <gsl/gsl_randist.h>
 #include <gsl/gsl_cdf.h>
+#include "telemetry.h"
+#include "corpus.h"
+#include "stream.h"
+#include "precision.h"
+#include "fastmath.h"
+#include "rng.h"
 
 // Global Variables
 #define MAX_STRING 100
 #define MAX_SENTENCE_LENGTH 1000
 
-const int vocab_hash_size = 30000000;  // Maximum 30 * 0.7 = 21M words in the vocabulary
 typedef float real;                    // Precision of float numbers
 
-struct vocab_word {
-  long long cn;
-  char *word;
-};
+#include "vocab.h"
+#include "ragged.h"
+#include "hotrows.h"
 
 // pthread only allows passing of one argument
 typedef struct {
@@ -27,27 +30,47 @@ typedef struct {
 } ThreadArg;
 
 char train_file[MAX_STRING], output_file[MAX_STRING], context_output_file[MAX_STRING];
-char save_vocab_file[MAX_STRING], read_vocab_file[MAX_STRING];
-struct vocab_word *vocab;
+char save_vocab_file[MAX_STRING], read_vocab_file[MAX_STRING], telemetry_output_file[MAX_STRING];
+char init_input_file[MAX_STRING], init_context_file[MAX_STRING], ragged_output_file[MAX_STRING];
 int debug_mode = 2, window = 5, min_count = 1, num_threads = 1, min_reduce = 1;
 real dim_penalty = 1.1;
-float global_train_loss = 0.0;
+float ragged_mass = 0.99; // -raggedOutput: p(z|w) mass kept per word
+float report_interval = 1.0; // seconds of wall-clock time between progress reports
 float log_dim_penalty; //we'll compute this in the training function
-int *vocab_hash;
-long long vocab_max_size = 1000, vocab_size = 0, embed_max_size = 750, embed_current_size = 5, global_loss_diff = 0;
+long long embed_max_size = 750, embed_current_size = 5;
 long long train_words = 0, word_count_actual = 0, iter = 5, file_size = 0, *alpha_count_adjustment;
+CorpusIndex *corpus;
 real alpha = 0.05, starting_alpha, sample = 1e-3, sparsity_weight = 0.001;
-real *input_embed, *context_embed, *alpha_per_dim;
-clock_t start;
+embed_t *input_embed, *context_embed; // fp16/bf16 when built with -DEMBED_FP16/-DEMBED_BF16
+real *alpha_per_dim;
 int negative = 5;
 int num_z_samples = 5;
+int exact_z_grad = 0; // take the expectation over z of the prediction gradient in closed form instead of from num_z_samples draws
+int stream = 0; // train online on text piped to stdin
+long long stream_vocab_size = 100000; // -stream: maximum number of words (rows) in the model
+int admit_count = 5; // -stream: occurrences before a new word is admitted
+float publish_interval = 600; // -stream: seconds between publications of the vectors
+long long stream_published_size = 0; // -stream: words whose rows are initialized
+SentenceQueue stream_queue;
+int num_readers = 1; // threads reading the corpus into the training threads' sentence queues
+SentenceQueue *train_queues; // one per training thread
+unsigned long long seed = 1; // key of every random stream, see rng.h
+long long hot_rows = 0; // rows of the most frequent words updated through per-thread delta buffers
+long long hot_merge = 100; // corpus words between merges of the delta buffers
+int deterministic = 0; // train in fixed chunks whose updates are merged, and the model grown, at barriers
+long long chunk_size = 64; // -deterministic: center words a thread trains between barriers
+pthread_barrier_t chunk_barrier;
+HotRows **chunk_input_rows, **chunk_context_rows; // -deterministic: every thread's buffers
+int chunk_grow = 0; // -deterministic: 1 + a thread that sampled the new dimension during the chunk
+int chunk_running, chunk_any_running; // -deterministic: threads with sentences left, at the last barrier
+long long *chunk_sync_ns, *chunk_thread_ns; // -deterministic: per thread, time at barriers and in total
+CountMinSketch *stream_sketch;
+int *unigram_tables[2];
 
 const int table_size = 1e8;
 const double epsilon = 1e-10;
 int *table;
 
-const int EXP_LEN = 87;
-float *exp_table; 
 
 // learning rate variables
 int learning_rate_flag = 0; // 0 for regular SGD, 1 for per dimension, 2 for beta cdf sweeps, 3 for linear sweeps
@@ -57,59 +80,16 @@ float beta = 0.9;
 // max debug string size
 const int MAX_DEBUG_SIZE = 10000;
 const int MAX_STR_SIZE = 499;
-/*
-  Build table which precompute exp function for certain integer
-  values
-*/
-void build_exp_table() {
-  exp_table = (float *) calloc(EXP_LEN * 2 + 1, sizeof(float));
-  for (int i = -EXP_LEN; i <= EXP_LEN; i++) {
-    exp_table[i + EXP_LEN] = exp(i);
-  }
-}
-
-/*
-  Exp approximate function from 
-  http://stackoverflow.com/questions/10552280/fast-exp-calculation-possible-to-improve-accuracy-without-losing-too-much-perfo/14143184#14143184
-  Error in input range [-1,1] is 0.36%
-*/
-float exp_approx(float x) { 
-  return (24+x*(24+x*(12+x*(4+x))))*0.041666666f;
-}
-
-/*
-  Separate into integer and decimal components and use table and 
-  approximate exp function to compute each part, respectively
-*/
-float exp_fast(float x) {
-  int x_int = (int)x;
-  float x_dec = x - x_int;
-
-  float exp_table_val = 0.0;
-  if (x_int < -EXP_LEN) {
-    exp_table_val = exp_table[0];
-  } 
-  else if (x_int > EXP_LEN) {
-    exp_table_val = exp_table[2*EXP_LEN];
-  }
-  else {
-    exp_table_val = exp_table[x_int + EXP_LEN];
-  }
- 
-  return exp_table_val * exp_approx(x_dec);   
-}
-
-// Build table from which to rand. sample words
-void InitUnigramTable() {
+// Fill dest with the table from which to rand. sample words
+void BuildUnigramTable(int *dest) {
   int a, i;
   double train_words_pow = 0;
   double d1, power = 0.75;
-  table = (int *)malloc(table_size * sizeof(int));
   for (a = 0; a < vocab_size; a++) train_words_pow += pow(vocab[a].cn, power);
   i = 0;
   d1 = pow(vocab[i].cn, power) / train_words_pow;
   for (a = 0; a < table_size; a++) {
-    table[a] = i;
+    dest[a] = i;
     if (a / (double)table_size > d1) {
       i++;
       d1 += pow(vocab[i].cn, power) / train_words_pow;
@@ -118,6 +98,11 @@ void InitUnigramTable() {
   }
 }
 
+void InitUnigramTable() {
+  table = (int *)malloc(table_size * sizeof(int));
+  BuildUnigramTable(table);
+}
+
 // Reads a single word from a file, assuming space + tab + EOL to be word boundaries
 void ReadWord(char *word, FILE *fin) {
   int a = 0, ch;
@@ -141,118 +126,29 @@ void ReadWord(char *word, FILE *fin) {
   word[a] = 0;
 }
 
-// Returns hash value of a word
-int GetWordHash(char *word) {
-  unsigned long long a, hash = 0;
-  for (a = 0; a < strlen(word); a++) hash = hash * 257 + word[a];
-  hash = hash % vocab_hash_size;
-  return hash;
-}
-
-// Returns position of a word in the vocabulary; if the word is not found, returns -1
-int SearchVocab(char *word) {
-  unsigned int hash = GetWordHash(word);
-  while (1) {
-    if (vocab_hash[hash] == -1) return -1;
-    if (!strcmp(word, vocab[vocab_hash[hash]].word)) return vocab_hash[hash];
-    hash = (hash + 1) % vocab_hash_size;
-  }
-  return -1;
-}
-
 // Reads a word and returns its index in the vocabulary
-int ReadWordIndex(FILE *fin) {
+int ReadWordIndex(CorpusFile *fin) {
   char word[MAX_STRING];
-  ReadWord(word, fin);
-  if (feof(fin)) return -1;
+  corpus_read_word(word, MAX_STRING, fin);
+  if (corpus_eof(fin)) return -1;
   return SearchVocab(word);
 }
 
-// Adds a word to the vocabulary
-int AddWordToVocab(char *word) {
-  unsigned int hash, length = strlen(word) + 1;
-  if (length > MAX_STRING) length = MAX_STRING;
-  vocab[vocab_size].word = (char *)calloc(length, sizeof(char));
-  strcpy(vocab[vocab_size].word, word);
-  vocab[vocab_size].cn = 0;
-  vocab_size++;
-  // Reallocate memory if needed
-  if (vocab_size + 2 >= vocab_max_size) {
-    vocab_max_size += 1000;
-    vocab = (struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
-  }
-  hash = GetWordHash(word);
-  while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-  vocab_hash[hash] = vocab_size - 1;
-  return vocab_size - 1;
-}
-
-// Used later for sorting by word counts
-int VocabCompare(const void *a, const void *b) {
-  return ((struct vocab_word *)b)->cn - ((struct vocab_word *)a)->cn;
-}
-
-// Sorts the vocabulary by frequency using word counts
-void SortVocab() {
-  int a, size;
-  unsigned int hash;
-  // Sort the vocabulary and keep </s> at the first position
-  qsort(&vocab[1], vocab_size - 1, sizeof(struct vocab_word), VocabCompare);
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  size = vocab_size;
-  train_words = 0;
-  for (a = 0; a < size; a++) {
-    // Words occuring less than min_count times will be discarded from the vocab
-    if ((vocab[a].cn < min_count) && (a != 0)) {
-      vocab_size--;
-      free(vocab[a].word);
-    } else {
-      // Hash will be re-computed, as after the sorting it is not actual
-      hash=GetWordHash(vocab[a].word);
-      while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-      vocab_hash[hash] = a;
-      train_words += vocab[a].cn;
-    }
-  }
-  vocab = (struct vocab_word *)realloc(vocab, (vocab_size + 1) * sizeof(struct vocab_word));
-}
-
-// Reduces the vocabulary by removing infrequent tokens
-void ReduceVocab() {
-  int a, b = 0;
-  unsigned int hash;
-  for (a = 0; a < vocab_size; a++) if (vocab[a].cn > min_reduce) {
-      vocab[b].cn = vocab[a].cn;
-      vocab[b].word = vocab[a].word;
-      b++;
-    } else free(vocab[a].word);
-  vocab_size = b;
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  for (a = 0; a < vocab_size; a++) {
-    // Hash will be re-computed, as it is not actual
-    hash = GetWordHash(vocab[a].word);
-    while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-    vocab_hash[hash] = a;
-  }
-  fflush(stdout);
-  min_reduce++;
-}
-
 void LearnVocabFromTrainFile() {
   char word[MAX_STRING];
-  FILE *fin;
+  CorpusFile *fin;
   long long a, i;
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  fin = fopen(train_file, "rb");
-  if (fin == NULL) {
+  corpus = corpus_index_new(train_file);
+  if (corpus == NULL) {
     printf("ERROR: training data file not found!\n");
     exit(1);
   }
-  vocab_size = 0;
+  fin = corpus_open(corpus, 0);
+  InitVocab();
   AddWordToVocab((char *)"</s>");
   while (1) {
-    ReadWord(word, fin);
-    if (feof(fin)) break;
+    corpus_read_word(word, MAX_STRING, fin);
+    if (corpus_eof(fin)) break;
     train_words++;
     if ((debug_mode > 1) && (train_words % 100000 == 0)) {
       printf("%lldK%c", train_words / 1000, 13);
@@ -263,15 +159,17 @@ void LearnVocabFromTrainFile() {
       a = AddWordToVocab(word);
       vocab[a].cn = 1;
     } else vocab[i].cn++;
-    if (vocab_size > vocab_hash_size * 0.7) ReduceVocab();
+    if (vocab_size > vocab_max_words) ReduceVocab(min_reduce++);
   }
-  SortVocab();
+  train_words = SortVocab(min_count);
   if (debug_mode > 0) {
     printf("Vocab size: %lld\n", vocab_size);
     printf("Words in train file: %lld\n", train_words);
   }
-  file_size = ftell(fin);
-  fclose(fin);
+  corpus_close(fin);
+  file_size = corpus->text_size;
+  if (debug_mode > 0 && corpus->format != CORPUS_PLAIN)
+    printf("Corpus is %s, %lld restart points\n", corpus_format_names[corpus->format], corpus->num_points);
 }
 
 void SaveVocab() {
@@ -290,8 +188,7 @@ void ReadVocab() {
     printf("Vocabulary file not found\n");
     exit(1);
   }
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  vocab_size = 0;
+  InitVocab();
   while (1) {
     ReadWord(word, fin);
     if (feof(fin)) break;
@@ -299,42 +196,45 @@ void ReadVocab() {
     fscanf(fin, "%lld%c", &vocab[a].cn, &c);
     i++;
   }
-  SortVocab();
+  train_words = SortVocab(min_count);
   if (debug_mode > 0) {
     printf("Vocab size: %lld\n", vocab_size);
     printf("Words in train file: %lld\n", train_words);
   }
-  fin = fopen(train_file, "rb");
-  if (fin == NULL) {
+  if (stream) return;
+  corpus = corpus_index_new(train_file);
+  if (corpus == NULL) {
     printf("ERROR: training data file not found!\n");
     exit(1);
   }
-  fseek(fin, 0, SEEK_END);
-  file_size = ftell(fin);
-  fclose(fin);
+  corpus_scan(corpus);
+  file_size = corpus->text_size;
 }
 
 void InitNet() {
   long long a, b;
-  unsigned long long next_random = 1;
+  unsigned long long next_random = seed;
+  // -stream allocates rows for every word it may admit later
+  long long rows = stream ? stream_vocab_size : vocab_size;
   // initialize context embeddings
-  a = posix_memalign((void **)&input_embed, 128, (long long)vocab_size * embed_max_size * sizeof(real));
+  a = posix_memalign((void **)&input_embed, 128, rows * embed_max_size * sizeof(embed_t));
   if (input_embed == NULL) {printf("Memory allocation failed\n"); exit(1);}
   for (a = 0; a < vocab_size; a++) for (b = 0; b < embed_max_size; b++) {
       // random (instead of zero) to avoid multi-threaded problems
       next_random = next_random * (unsigned long long)25214903917 + 11;
-      input_embed[a * embed_max_size + b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / embed_current_size; 
+      embed_set(input_embed, a * embed_max_size + b, (((next_random & 0xFFFF) / (real)65536) - 0.5) / embed_current_size); 
   }
   // initialize input embeddings
-  a = posix_memalign((void **)&context_embed, 128, (long long)vocab_size * embed_max_size * sizeof(real));
+  a = posix_memalign((void **)&context_embed, 128, rows * embed_max_size * sizeof(embed_t));
+  if (context_embed == NULL) {printf("Memory allocation failed\n"); exit(1);}
   for (a = 0; a < vocab_size; a++) for (b = 0; b < embed_max_size; b++) {
       // only initialize first few dims so we can tell the true vector length
       if (b < embed_current_size){
 	next_random = next_random * (unsigned long long)25214903917 + 11;
-	context_embed[a * embed_max_size + b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / embed_current_size;
+	embed_set(context_embed, a * embed_max_size + b, (((next_random & 0xFFFF) / (real)65536) - 0.5) / embed_current_size);
       }
       else{
-	context_embed[a * embed_max_size + b] = 0.0;
+	embed_set(context_embed, a * embed_max_size + b, 0.0);
       }
   }
  
@@ -346,6 +246,230 @@ void InitNet() {
   }
 }
 
+// Returns the dimensionality in the header of a vector file written by save_vectors
+long long ReadVectorsDim(char *path) {
+  long long words, dims;
+  FILE *fin = fopen(path, "rb");
+  if (fin == NULL) {
+    printf("ERROR: vector file %s not found\n", path);
+    exit(1);
+  }
+  if (fscanf(fin, "%lld %lld", &words, &dims) != 2) {
+    printf("ERROR: %s is not a vector file\n", path);
+    exit(1);
+  }
+  fclose(fin);
+  return dims;
+}
+
+/*
+  Warm start: overwrites the rows of words that are in the vocabulary with
+  their saved vectors; rows of words the file does not have keep their
+  InitNet values.  Returns the number of rows loaded.
+*/
+long long LoadVectors(char *path, embed_t *embed) {
+  long long words, dims, a, b, i, found = 0;
+  char word[MAX_STRING];
+  float value;
+  FILE *fin = fopen(path, "rb");
+  if (fscanf(fin, "%lld %lld", &words, &dims) != 2) return 0;
+  for (a = 0; a < words; a++) {
+    if (fscanf(fin, "%99s", word) != 1) break;
+    i = SearchVocab(word);
+    for (b = 0; b < dims; b++) {
+      if (fscanf(fin, "%f", &value) != 1) {
+        printf("ERROR: %s is truncated at word %lld\n", path, a);
+        exit(1);
+      }
+      if (i != -1) embed_set(embed, i * embed_max_size + b, value);
+    }
+    if (i != -1) found++;
+  }
+  fclose(fin);
+  return found;
+}
+
+// Starts from the dimensionality of the warm start files, so new words get that many random dims too
+void SetWarmStartSize() {
+  long long dims = -1;
+  if (init_input_file[0] != 0) dims = ReadVectorsDim(init_input_file);
+  if (init_context_file[0] != 0) {
+    long long context_dims = ReadVectorsDim(init_context_file);
+    if (dims != -1 && dims != context_dims) {
+      printf("ERROR: %s has %lld dims but %s has %lld\n", init_input_file, dims, init_context_file, context_dims);
+      exit(1);
+    }
+    dims = context_dims;
+  }
+  if (dims >= embed_max_size) {
+    printf("ERROR: -maxSize must be larger than the %lld dims of the warm start vectors\n", dims);
+    exit(1);
+  }
+  if (dims > 0) {
+    embed_current_size = dims;
+    printf("Warm start: initial dimensionality is %lld\n", dims);
+  }
+}
+
+void WarmStart() {
+  if (init_input_file[0] != 0) printf("Warm start: %lld of %lld input vectors loaded from %s\n",
+                                      LoadVectors(init_input_file, input_embed), vocab_size, init_input_file);
+  if (init_context_file[0] != 0) printf("Warm start: %lld of %lld context vectors loaded from %s\n",
+                                        LoadVectors(init_context_file, context_embed), vocab_size, init_context_file);
+}
+
+// -stream: initialize the rows of a newly admitted word the way InitNet does
+void InitWordRows(long long a, unsigned long long *next_random) {
+  long long b, curr_size = embed_current_size;
+  for (b = 0; b < embed_max_size; b++) {
+    *next_random = *next_random * (unsigned long long)25214903917 + 11;
+    embed_set(input_embed, a * embed_max_size + b, (((*next_random & 0xFFFF) / (real)65536) - 0.5) / curr_size);
+  }
+  for (b = 0; b < embed_max_size; b++) {
+    if (b < curr_size) {
+      *next_random = *next_random * (unsigned long long)25214903917 + 11;
+      embed_set(context_embed, a * embed_max_size + b, (((*next_random & 0xFFFF) / (real)65536) - 0.5) / curr_size);
+    }
+    else embed_set(context_embed, a * embed_max_size + b, 0.0);
+  }
+}
+
+/*
+  -stream: reads stdin, counts words, admits new ones through the count-min
+  sketch and pushes subsampled id sentences to the training threads.  The
+  negative sampling table is rebuilt from the running counts into the spare
+  buffer and swapped in, at doubling intervals up to every 10M words, and
+  whenever the vocabulary has doubled since the last build, so the first
+  admissions get a table instead of the </s>-only one the stream starts with.
+*/
+void *StreamReaderThread(void *unused) {
+  char word[MAX_STRING];
+  long long sen[MAX_SENTENCE_LENGTH], sentence_length = 0, sentence_words = 0, i;
+  long long next_table_words = 10000, table_step_max = 10000000, table_vocab_size = vocab_size;
+  unsigned long long next_random = seed;
+  Rng rng;
+  rng_seed(&rng, seed, RNG_READER_STREAM, 0, 0);
+  while (1) {
+    ReadWord(word, stdin);
+    if (feof(stdin)) break;
+    sentence_words++;
+    i = SearchVocab(word);
+    if (i == -1) {
+      if (vocab_size >= stream_vocab_size) continue;
+      unsigned int seen = cms_add(stream_sketch, word);
+      if (seen < admit_count) continue;
+      i = AddWordToVocab(word);
+      vocab[i].cn = seen - 1;
+      InitWordRows(i, &next_random);
+      __atomic_store_n(&stream_published_size, vocab_size, __ATOMIC_RELEASE);
+    }
+    vocab[i].cn++;
+    train_words++;
+    if (train_words >= next_table_words || vocab_size >= 2 * table_vocab_size) {
+      int *spare = (table == unigram_tables[0]) ? unigram_tables[1] : unigram_tables[0];
+      BuildUnigramTable(spare);
+      __atomic_store_n(&table, spare, __ATOMIC_RELEASE);
+      if (train_words >= next_table_words) next_table_words = train_words + ((train_words < table_step_max) ? train_words : table_step_max);
+      table_vocab_size = vocab_size;
+    }
+    if (i != 0) {
+      // The subsampling randomly discards frequent words while keeping the ranking the same
+      if (sample > 0) {
+        real ran = (sqrt(vocab[i].cn / (sample * train_words)) + 1) * (sample * train_words) / vocab[i].cn;
+        if (ran < rng_uniform(&rng)) continue;
+      }
+      sen[sentence_length] = i;
+      sentence_length++;
+      if (sentence_length < MAX_SENTENCE_LENGTH) continue;
+    }
+    if (sentence_length == 0) continue;
+    sentence_queue_push(&stream_queue, sen, sentence_length, sentence_words);
+    sentence_length = 0;
+    sentence_words = 0;
+  }
+  if (sentence_length > 0) sentence_queue_push(&stream_queue, sen, sentence_length, sentence_words);
+  sentence_queue_close(&stream_queue);
+  return NULL;
+}
+
+// a training thread's shard of the corpus, as read by a CorpusReaderThread
+typedef struct {
+  CorpusFile *fi;
+  long long word_count, pending_words, local_iter;
+  Rng rng;  // subsampling; the stream of (shard, epoch)
+} ReaderShard;
+
+/*
+  Reads the shards of the training threads id, id + num_readers, ... for
+  iter passes each and pushes their subsampled id sentences to the threads'
+  queues, the one with the fewest sentences waiting first.  A queue is
+  closed after its shard's last pass.
+*/
+void *CorpusReaderThread(void *reader_id) {
+  long id = (long) reader_id;
+  int num_shards = (num_threads - id + num_readers - 1) / num_readers, open = num_shards;
+  long long sen[MAX_SENTENCE_LENGTH], sentence_length, sentence_words, word;
+  ReaderShard *shards = (ReaderShard *) calloc(num_shards, sizeof(ReaderShard));
+  for (int s = 0; s < num_shards; s++) {
+    long long t = id + s * num_readers;
+    shards[s].fi = corpus_open(corpus, file_size / (long long)num_threads * t);
+    shards[s].local_iter = iter;
+    rng_seed(&shards[s].rng, seed, RNG_READER_STREAM | t, 0, 0);
+  }
+  while (open > 0) {
+    int s = -1, waiting = 0;
+    for (int k = 0; k < num_shards; k++) {
+      if (shards[k].fi == NULL) continue;
+      int count = sentence_queue_count(train_queues + id + k * num_readers);
+      if (s == -1 || count < waiting) {
+        s = k;
+        waiting = count;
+      }
+    }
+    ReaderShard *shard = shards + s;
+    SentenceQueue *queue = train_queues + id + s * num_readers;
+    sentence_length = sentence_words = 0;
+    while (1) {
+      word = ReadWordIndex(shard->fi);
+      if (corpus_eof(shard->fi)) break;
+      if (word == -1) continue;
+      sentence_words++;
+      if (word == 0) break;
+      // The subsampling randomly discards frequent words while keeping the ranking the same
+      if (sample > 0) {
+        real ran = (sqrt(vocab[word].cn / (sample * train_words)) + 1) * (sample * train_words) / vocab[word].cn;
+        if (ran < rng_uniform(&shard->rng)) continue;
+      }
+      sen[sentence_length] = word;
+      sentence_length++;
+      if (sentence_length >= MAX_SENTENCE_LENGTH) break;
+    }
+    shard->word_count += sentence_words;
+    // words of sentences that subsampling emptied are counted with the next one
+    shard->pending_words += sentence_words;
+    if (sentence_length > 0) {
+      sentence_queue_push(queue, sen, sentence_length, shard->pending_words);
+      shard->pending_words = 0;
+    }
+    // if EOF, reset to beginning
+    if (corpus_eof(shard->fi) || (shard->word_count > train_words / num_threads)) {
+      shard->local_iter--;
+      if (shard->local_iter == 0) {
+        sentence_queue_close(queue);
+        corpus_close(shard->fi);
+        shard->fi = NULL;
+        open--;
+        continue;
+      }
+      shard->word_count = 0;
+      rng_seed(&shard->rng, seed, RNG_READER_STREAM | (id + s * num_readers), iter - shard->local_iter, 0);
+      corpus_seek(shard->fi, file_size / (long long)num_threads * (id + s * num_readers));
+    }
+  }
+  free(shards);
+  return NULL;
+}
+
 /*
   Compute e^(-E(w,c,z)) for z=1,...,curr_z,curr_z+1  
   -> dist: float array to fill; should be of size curr_z+1 
@@ -365,12 +489,12 @@ float compute_z_dist(float *dist, long long *context, int center_idx, int contex
     for (int j = 0; j < context_size; j++){
       if (j == center_idx) continue;
       long long c_idx = context[j] * embed_max_size;
-      context_sum += context_embed[c_idx + a];
-      context_norms += context_embed[c_idx + a] * context_embed[c_idx + a];
+      context_sum += embed_get(context_embed, c_idx + a);
+      context_norms += embed_get(context_embed, c_idx + a) * embed_get(context_embed, c_idx + a);
     }
     // compute entergy
-    float val = -window_norm*input_embed[w_idx + a]*context_sum 
-      + log_dim_penalty + (sparsity_weight/(a+1))*input_embed[w_idx + a]*input_embed[w_idx + a] 
+    float val = -window_norm*embed_get(input_embed, w_idx + a)*context_sum 
+      + log_dim_penalty + (sparsity_weight/(a+1))*embed_get(input_embed, w_idx + a)*embed_get(input_embed, w_idx + a) 
       + window_norm*(sparsity_weight/(a+1))*context_norms;
     for (int b = a; b <= curr_z; b++) {
       dist[b] += val;
@@ -383,23 +507,16 @@ float compute_z_dist(float *dist, long long *context, int center_idx, int contex
   return max_value;
 }
 
-void compute_p_z_given_w_C(float *prob_z_given_w_C, float *sum_prob_z_given_w_C, long long *context, int center_idx, int context_size, int curr_z) {
-  float norm = 0.0;
-  float max_value = compute_z_dist(prob_z_given_w_C, context, center_idx, context_size, curr_z);
-  // now exponentiate and normalize                                              
-  for (int a = 0; a < curr_z; a++) {                    
-    prob_z_given_w_C[a] = exp_fast(-prob_z_given_w_C[a]-max_value);          
-    norm += prob_z_given_w_C[a];            
-  }                   
-  prob_z_given_w_C[curr_z] = (dim_penalty / (dim_penalty - 1.0)) * exp_fast(-prob_z_given_w_C[curr_z]-max_value);      
-  norm += prob_z_given_w_C[curr_z]; 
-
-  // pre-calculate sums
-  float sum = 0.0;
-  for (int a = curr_z; a >= 0; a--) {
-    prob_z_given_w_C[a] = prob_z_given_w_C[a]/norm;
-    sum += prob_z_given_w_C[a];
-    sum_prob_z_given_w_C[a] = sum;
+/*
+  p(z|w,C) is the true center word's row of p(w,z|C) renormalized by the
+  row's mass, so its energies are only computed once
+  -> row, row_sums: the center word's row of prob_w_z_given_C and sum_prob_w_z_given_C
+*/
+void compute_p_z_given_w_C(float *prob_z_given_w_C, float *sum_prob_z_given_w_C, float *row, float *row_sums, int curr_z_plus_one) {
+  float inv_mass = 1.0 / row_sums[0];
+  for (int z = 0; z < curr_z_plus_one; z++) {
+    prob_z_given_w_C[z] = row[z] * inv_mass;
+    sum_prob_z_given_w_C[z] = row_sums[z] * inv_mass;
   }
 }
 
@@ -421,15 +538,11 @@ void compute_p_w_z_given_C(long long center_idx, long long *context, long long *
   // replace true center word
   context[center_idx] = save_true_w;
 
-  // now iterate through again to exponentiate and compute norm
-  for (int s = 0; s < negative_size + 1; s++){
-    for (int j = 0; j < curr_z_plus_one-1; j++){
-      prob_w_z_given_C[s*curr_z_plus_one + j] = exp_fast(-prob_w_z_given_C[s*curr_z_plus_one + j]-max_value);
-      norm += prob_w_z_given_C[s*curr_z_plus_one + j];
-    }
-    prob_w_z_given_C[s*curr_z_plus_one + curr_z_plus_one-1] = (dim_penalty / (dim_penalty - 1.0)) * 
-      exp_fast(-prob_w_z_given_C[s*curr_z_plus_one + curr_z_plus_one-1]-max_value);
-    norm += prob_w_z_given_C[s*curr_z_plus_one + curr_z_plus_one-1];
+  // exponentiate the whole ((negative + 1) x z) block in one pass, then weight each row's infinite tail
+  norm = exp_affine(prob_w_z_given_C, (long long)(negative_size + 1) * curr_z_plus_one, -1.0, -max_value);
+  for (int s = 0; s < negative_size + 1; s++) {
+    norm += (dim_penalty / (dim_penalty - 1.0) - 1.0) * prob_w_z_given_C[s*curr_z_plus_one + curr_z_plus_one-1];
+    prob_w_z_given_C[s*curr_z_plus_one + curr_z_plus_one-1] *= dim_penalty / (dim_penalty - 1.0);
   }
   
   // compute prob
@@ -443,15 +556,16 @@ void compute_p_w_z_given_C(long long center_idx, long long *context, long long *
   }
 }
 
-// function to sample value of z_hat -- modified but essentially coppied from StackOverflow 
-// http://stackoverflow.com/questions/25363450/generating-a-multinomial-distribution
-int sample_from_mult(double probs[], int k, const gsl_rng* r){ // always sample 1 value
-  unsigned int mult_op[k];
-  gsl_ran_multinomial(r, k, 1, probs, mult_op);
-  for (int idx=1; idx<=k; idx++){
-    if (mult_op[idx-1]==1) return idx;
+// samples one value of z_hat from the (unnormalized) probabilities
+int sample_from_mult(double probs[], int k, Rng *r) {
+  double total = 0.0, cdf = 0.0;
+  for (int idx = 0; idx < k; idx++) total += probs[idx];
+  double u = rng_uniform(r) * total;
+  for (int idx = 1; idx <= k; idx++) {
+    cdf += probs[idx-1];
+    if (u < cdf) return idx;
   }
-  return 0;
+  return k;
 }
 
 // Samples N values of z_hat and returns in vals list and returns the max of samples 
@@ -459,32 +573,27 @@ int sample_from_mult(double probs[], int k, const gsl_rng* r){ // always sample
 // probs -- unnormalized probabilities
 // k -- l+1 (size of current embedding + 1)
 // N -- number of samples to draw
-// vals -- N-size array containing the sampled values
+// vals -- N-size array containing the sampled values, in increasing order
 // r -- random number generator 
-int sample_from_mult_list(float float_probs[], int k, int vals[], int N, 
-  const gsl_rng* r) {
-  unsigned int mult_op[k];
-  // copy over to double array
-  double probs[k];
-  for (int i = 0; i < k; i++) {
-    probs[i] = float_probs[i];
+// The N uniforms are sorted, so one pass over the cdf places all of them
+int sample_from_mult_list(float probs[], int k, int vals[], int N, Rng *r) {
+  float u[N], total = 0.0, cdf = 0.0;
+  int last = 1, m = 0;
+  for (int idx = 0; idx < k; idx++) total += probs[idx];
+  for (int n = 0; n < N; n++) {
+    float value = rng_uniform(r) * total;
+    int pos = n;
+    for (; pos > 0 && u[pos-1] > value; pos--) u[pos] = u[pos-1];
+    u[pos] = value;
   }
-
-  gsl_ran_multinomial(r, k, N, probs, mult_op); // returns array of size N with amount of each value sampled 
-  int cnt = 0;
-  // add sampled values to list 
-  int max_idx = -1;
-  for (int idx=1; idx<=k; idx++) {  
-    if (mult_op[idx-1] > 0) { // get max so far
-      max_idx = idx;
-    }
-    // We know amount of this value, so add this many to list
-    for (int num=0; num<mult_op[idx-1]; num++) {
-      vals[cnt] = idx;
-      cnt++;
-    }
+  for (int idx = 1; idx <= k && m < N; idx++) {
+    cdf += probs[idx-1];
+    if (probs[idx-1] > 0) last = idx;
+    while (m < N && u[m] < cdf) vals[m++] = idx;
   }
-  return max_idx;
+  // rounding can leave the cdf short of total
+  while (m < N) vals[m++] = last;
+  return N > 0 ? vals[N-1] : -1;
 }
 
 void write_to_file(char buffer[][MAX_STR_SIZE], int debug_cntr, char *debug_filename) {
@@ -564,11 +673,17 @@ void print_args() {
   printf("Train Corpus: %s\n", train_file);
   printf("Output file: %s\n", output_file);
   printf("Num. of threads: %d\n", num_threads);
+  printf("Random seed: %llu\n", seed);
+  if (deterministic) printf("Deterministic: chunks of %lld center words per thread\n", chunk_size);
+  if (!stream) printf("Corpus reader threads: %d\n", num_readers);
+  if (hot_rows > 0) printf("Hot rows: %lld, merged every %lld words\n", hot_rows, hot_merge);
   printf("Initial dimensionality: %lld\n", embed_current_size);
   printf("Max dimensionality: %lld\n", embed_max_size); 
   printf("Context window size: %d\n", window); 
   printf("Num. of negative samples: %d\n", negative); 
   printf("Training iterations (epochs): %lld\n", iter); 
+  if (exact_z_grad) printf("Z gradient: exact expectation (%d samples decide growth)\n", num_z_samples);
+  else printf("Z gradient: average over %d samples\n", num_z_samples);
   printf("Base learning rate (alpha): %f\n", (float)alpha );
   if (learning_rate_flag == 1) printf("\tOptimization type: per-dimension learning rate\n");
   else if (learning_rate_flag == 2) printf("\tOptimization type: Beta CDF sweeping.\n");
@@ -576,11 +691,12 @@ void print_args() {
   else printf("\tOptimization type: vanilla SGD.  No special per-dimension learning.\n");
   printf("Dimension penalty: %f\n", (float)dim_penalty); 
   printf("Sparsity weight: %f\n", (float)sparsity_weight);
+  printf("Embedding storage: %s\n", EMBED_PRECISION);
   printf("#####################\n");
   fflush(stdout);
 }
 
-void save_vectors(char *output_file, long long int vocab_size, long long int embed_current_size, struct vocab_word *vocab, real *input_embed) {
+void save_vectors(char *output_file, long long int vocab_size, long long int embed_current_size, struct vocab_word *vocab, embed_t *input_embed) {
   FILE *fo;
   fo = fopen(output_file, "wb");
   // Save the word vectors
@@ -589,12 +705,122 @@ void save_vectors(char *output_file, long long int vocab_size, long long int emb
   for (a = 0; a < vocab_size; a++) {
     fprintf(fo, "%s ", vocab[a].word);
     // only print the non-zero dimensions
-    for (b = 0; b < embed_current_size; b++) fprintf(fo, "%f ", input_embed[a * embed_max_size + b]);
+    for (b = 0; b < embed_current_size; b++) fprintf(fo, "%f ", embed_get(input_embed, a * embed_max_size + b));
     fprintf(fo, "\n");
   }
   fclose(fo);
 }
 
+// -stream: replace the output files with the current vectors, via a rename so readers never see a partial file
+void PublishVectors() {
+  char tmp_file[MAX_STRING + 8];
+  long long rows = __atomic_load_n(&stream_published_size, __ATOMIC_ACQUIRE);
+  sprintf(tmp_file, "%s.tmp", output_file);
+  save_vectors(tmp_file, rows, embed_current_size, vocab, input_embed);
+  rename(tmp_file, output_file);
+  if (strlen(context_output_file) > 0) {
+    sprintf(tmp_file, "%s.tmp", context_output_file);
+    save_vectors(tmp_file, rows, embed_current_size, vocab, context_embed);
+    rename(tmp_file, context_output_file);
+  }
+  if (debug_mode > 0) printf("Published %lld words, %lld dims to %s\n", rows, embed_current_size, output_file);
+}
+
+/*
+  one negative word from the unigram table, given 32 random bits; -1 (none)
+  while -stream has published no word besides </s>, since the fallback may
+  only pick rows that are initialized
+*/
+long long negative_from_bits(unsigned int bits, Rng *rng) {
+  long long negative_word = __atomic_load_n(&table, __ATOMIC_ACQUIRE)[rng_scale(bits, table_size)];
+  if (negative_word == 0) {
+    long long rows = stream ? __atomic_load_n(&stream_published_size, __ATOMIC_ACQUIRE) : vocab_size;
+    if (rows < 2) return -1;
+    negative_word = rng_below(rng, rows - 1) + 1;
+  }
+  return negative_word;
+}
+
+/*
+  Negatives are drawn one step ahead: dest gets the count words drawn for
+  this step into ahead (redrawn if one is the positive word or none), then
+  the next step's are drawn, as one batch of random bits, and the first
+  dims values of their rows prefetched, so those rows arrive while this
+  step computes
+*/
+void next_negatives(long long *dest, long long *ahead, int count, long long word, embed_t *rows, int dims, Rng *rng) {
+  unsigned int bits[count];
+  rng_fill(rng, bits, count);
+  for (int d = 0; d < count; d++) {
+    dest[d] = ahead[d];
+    while (dest[d] == word || dest[d] < 0) dest[d] = negative_from_bits(rng_next(rng), rng);
+    ahead[d] = negative_from_bits(bits[d], rng);
+    if (ahead[d] >= 0) embed_prefetch_row(rows + ahead[d] * embed_max_size, dims);
+  }
+}
+
+// per-dimension learning rates, the sweep position or the annealed rate for the words trained so far
+void UpdateLearningRates() {
+  // -stream has no end to anneal towards: learning rates stay at their starting values
+  if (stream) return;
+  if (learning_rate_flag == 1) {
+    for (long long c = 0; c < embed_current_size; c++) {
+      alpha_per_dim[c] = starting_alpha * (1 - (word_count_actual - alpha_count_adjustment[c]) / (real)(iter * train_words - alpha_count_adjustment[c] + 1));
+      if (alpha_per_dim[c] < starting_alpha * 0.0001) alpha_per_dim[c] = starting_alpha * 0.0001;
+    }
+  }
+  else if (learning_rate_flag == 2 || learning_rate_flag == 3) M = (int)((word_count_actual / (real)(iter * train_words + 1)) * embed_current_size);
+  else {
+    alpha = starting_alpha * (1 - word_count_actual / (real)(iter * train_words + 1));
+    if (alpha < starting_alpha * 0.0001) alpha = starting_alpha * 0.0001;
+  }
+}
+
+/*
+  -deterministic: the barrier that ends every chunk.  While the threads
+  train a chunk nothing writes the shared tables; here each thread merges
+  the rows it owns from all threads' buffers, in thread order, then thread
+  0 grows the model if any thread sampled the new dimension and updates
+  the learning rates.  words: the thread's corpus words since its last
+  barrier; done: it is out of sentences.  Returns 0 once every thread is.
+*/
+int ChunkBarrier(long id, long long words, int done) {
+  long long start = telemetry_now_ns();
+  __atomic_add_fetch(&word_count_actual, words, __ATOMIC_RELAXED);
+  if (done) __atomic_sub_fetch(&chunk_running, 1, __ATOMIC_RELAXED);
+  pthread_barrier_wait(&chunk_barrier);
+  hot_rows_merge_owned(chunk_input_rows, num_threads, input_embed, id, num_threads);
+  hot_rows_merge_owned(chunk_context_rows, num_threads, context_embed, id, num_threads);
+  pthread_barrier_wait(&chunk_barrier);
+  hot_rows_clear(chunk_input_rows[id]);
+  hot_rows_clear(chunk_context_rows[id]);
+  if (id == 0) {
+    if (chunk_grow) {
+      if (learning_rate_flag == 1) alpha_count_adjustment[embed_current_size] = word_count_actual;
+      embed_current_size++;
+      telemetry_dim_growth(chunk_grow - 1, embed_current_size, word_count_actual);
+      chunk_grow = 0;
+    }
+    UpdateLearningRates();
+    chunk_any_running = chunk_running > 0;
+  }
+  pthread_barrier_wait(&chunk_barrier);
+  chunk_sync_ns[id] += telemetry_now_ns() - start;
+  return chunk_any_running;
+}
+
+// learning rate shown in progress reports
+float current_alpha() {
+  float lr = alpha;
+  if (learning_rate_flag == 1) lr = alpha_per_dim[embed_current_size-1];
+  else if (learning_rate_flag == 2) lr = alpha * gsl_cdf_beta_P(1.0/(embed_current_size+1.0), (M+0.01)/embed_current_size, (embed_current_size - M + 0.01)/embed_current_size);
+  else if (learning_rate_flag == 3) {
+    if (1 < M) lr = 0.0;
+    else lr = alpha * pow( beta, 1 - M - 1);
+  }
+  return lr;
+}
+
 void *TrainModelThread(void *thread_id) {
   // get thread arguments
   long id = (long) thread_id;
@@ -606,107 +832,90 @@ void *TrainModelThread(void *thread_id) {
   //int debug_cntr = 0;
   //char buffer[MAX_DEBUG_SIZE][MAX_STR_SIZE + 1];  // max string size is 499 
 
-  long long a, b, d, word, center_word, last_word, negative_word, sentence_length = 0, sentence_position = 0;
+  long long a, b, d, center_word, last_word, sentence_length = 0, sentence_position = 0;
   long long word_count = 0, last_word_count = 0, sen[MAX_SENTENCE_LENGTH + 1], pos_context_counter;
-  long long center_word_position, context_word_position, input_word_position, neg_center_word_position, z_max, c, local_iter = iter;
-  unsigned long long next_random = (long long)id;
-  clock_t now;
-
-  // open corpus file and seek to thread's position in it
-  FILE *fi = fopen(train_file, "rb");
-  fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
+  long long center_word_position, context_word_position, input_word_position, neg_center_word_position, z_max, c;
+  // stochastic rounding bits of -DEMBED_FP16/-DEMBED_BF16 updates, keyed by -seed like the other streams
+  Rng round_rng;
+  rng_seed(&round_rng, seed, RNG_ROUND_STREAM | id, 0, 0);
+  embed_round_seed(rng_next(&round_rng));
+
+  // -stream threads share one queue, file training gives every thread its own
+  SentenceQueue *queue = stream ? &stream_queue : train_queues + id;
   
-  // set up random number generator
-  const gsl_rng_type * T2;
-  gsl_rng * r2;
-  srand(time(NULL));
-  unsigned int Seed2 = rand();
-  gsl_rng_env_setup();
-  T2 = gsl_rng_default;
-  r2 = gsl_rng_alloc (T2);
-  gsl_rng_set (r2, Seed2);
+  // random number generator: window sizes, negatives and z samples of the thread's n-th sentence come
+  // from stream (seed, id, 0, n); the negatives drawn ahead of the first from chunk 0
+  Rng rng;
+  long long sentence_count = 0;
+  rng_seed(&rng, seed, id, 0, 0);
 
   int *z_samples = (int *) calloc(num_z_samples, sizeof(int)); // M-sized array of sampled z values
   long long *negative_list = (long long *) calloc(negative, sizeof(long long));
+  // the next step's negatives, see next_negatives
+  long long *negatives_ahead = (long long *) calloc(negative, sizeof(long long));
+  for (d = 0; d < negative; d++) negatives_ahead[d] = negative_from_bits(rng_next(&rng), &rng);
   long long *pos_context_store = (long long *) calloc(2*window+1, sizeof(long long));
   // terms needed for p(z|w,C)
   float *probs_z_given_w_C = (float *) calloc(embed_max_size, sizeof(float));
   float *sum_probs_z_given_w_C = (float *) calloc(embed_max_size, sizeof(float));
+  // -hotRows or -deterministic buffers, NULL when off
+  HotRows *hot_input_rows = NULL, *hot_context_rows = NULL;
+  long long last_merge_count = 0, chunk_steps = 0, thread_start = telemetry_now_ns();
+  if (deterministic) {
+    hot_input_rows = chunk_input_rows[id];
+    hot_context_rows = chunk_context_rows[id];
+  } else if (hot_rows > 0) {
+    long long rows = stream ? stream_vocab_size : vocab_size;
+    if (hot_rows < rows) rows = hot_rows;
+    hot_input_rows = hot_rows_new(rows, embed_max_size, rows);
+    hot_context_rows = hot_rows_new(rows, embed_max_size, rows);
+  }
 
-  float train_log_probability = 0.0;  // track if model is learning 
+  ThreadTelemetry *telemetry = telemetry_threads + id;
+  long long phase_mark = 0;
   while (1) {
     // track training progress
-    if (word_count - last_word_count > 5000) { // TODO: lowered for debugging
-      long long diff = word_count - last_word_count;
-      word_count_actual += word_count - last_word_count;
+    // -deterministic does this at the chunk barriers
+    if (!deterministic && word_count - last_word_count > 5000) { // TODO: lowered for debugging
+      __atomic_add_fetch(&word_count_actual, word_count - last_word_count, __ATOMIC_RELAXED);
       last_word_count = word_count;
-      if (learning_rate_flag == 1){
-        for (c = 0; c < embed_current_size; c++){
-          alpha_per_dim[c] = starting_alpha * (1 - (word_count_actual - alpha_count_adjustment[c]) / (real)(iter * train_words - alpha_count_adjustment[c] + 1));
-          if (alpha_per_dim[c] < starting_alpha * 0.0001) alpha_per_dim[c] = starting_alpha * 0.0001;
-        }
-      }
-      else if (learning_rate_flag == 2 || learning_rate_flag == 3) M = (int)((word_count_actual / (real)(iter * train_words + 1)) * embed_current_size);
-      else {
-	alpha = starting_alpha * (1 - word_count_actual / (real)(iter * train_words + 1));
-        if (alpha < starting_alpha * 0.0001) alpha = starting_alpha * 0.0001;
-      }
-      if ((debug_mode > 1)) {
-        now=clock();
-	float lr = alpha;
-	if (learning_rate_flag == 1) lr = alpha_per_dim[embed_current_size-1];
-	else if (learning_rate_flag == 2) lr = alpha * gsl_cdf_beta_P(1.0/(embed_current_size+1.0), (M+0.01)/embed_current_size, (embed_current_size - M + 0.01)/embed_current_size);
-	else if (learning_rate_flag == 3) {
-	  if (1 < M) lr = 0.0;
-	  else lr = alpha * pow( beta, 1 - M - 1);
-	}
-        printf("%cAlpha: %f  Progress: %.2f%%  Words/thread/sec: %.2fk  ", 13, lr,
-	       word_count_actual / (real)(iter * train_words + 1) * 100,
-	       word_count_actual / ((real)(now - start + 1) / (real)CLOCKS_PER_SEC * 1000));
-	global_loss_diff += diff;
-	global_train_loss += train_log_probability;
-        printf("loss: %f  ", global_train_loss / global_loss_diff);
-	printf("curr dim: %lld\n", embed_current_size);	
-        fflush(stdout);
-        train_log_probability = 0.0;
-      }
+      UpdateLearningRates();
+    }
+    if (deterministic && chunk_steps >= chunk_size) {
+      telemetry_mark(&phase_mark);
+      ChunkBarrier(id, word_count - last_word_count, 0);
+      last_word_count = word_count;
+      chunk_steps = 0;
+      telemetry_phase(telemetry, PHASE_SYNC, &phase_mark);
     }
 
     // read a new sentence / line
     if (sentence_length == 0) {
-      while (1) {
-        word = ReadWordIndex(fi);
-        if (feof(fi)) break;
-        if (word == -1) continue;
-        word_count++;
-        if (word == 0) break;
-        // The subsampling randomly discards frequent words while keeping the ranking the same
-        if (sample > 0) {
-          real ran = (sqrt(vocab[word].cn / (sample * train_words)) + 1) * (sample * train_words) / vocab[word].cn;
-          next_random = next_random * (unsigned long long)25214903917 + 11;
-          if (ran < (next_random & 0xFFFF) / (real)65536) continue;
-        }
-        sen[sentence_length] = word;
-        sentence_length++;
-        if (sentence_length >= MAX_SENTENCE_LENGTH) break;
+      long long sentence_start_count = word_count;
+      telemetry_mark(&phase_mark);
+      long long sentence_words;
+      if (!sentence_queue_pop(queue, sen, &sentence_length, &sentence_words)) {
+        if (deterministic) {
+          // keep meeting the other threads at the barriers until they are out of sentences too
+          if (ChunkBarrier(id, word_count - last_word_count, 1)) while (ChunkBarrier(id, 0, 0));
+          telemetry_phase(telemetry, PHASE_SYNC, &phase_mark);
+        } else __atomic_add_fetch(&word_count_actual, word_count - last_word_count, __ATOMIC_RELAXED);
+        break;
       }
+      word_count += sentence_words;
       sentence_position = 0;
-    }
-    // if EOF, reset to beginning
-    if (feof(fi) || (word_count > train_words / num_threads)) {
-      word_count_actual += word_count - last_word_count;
-      local_iter--;
-      if (local_iter == 0) break;
-      word_count = 0;
-      last_word_count = 0;
-      sentence_length = 0;
-      fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
-      continue;
+      rng_seed(&rng, seed, id, 0, ++sentence_count);
+      if (!deterministic && word_count - last_merge_count >= hot_merge) {
+        hot_rows_merge(hot_input_rows, input_embed);
+        hot_rows_merge(hot_context_rows, context_embed);
+        last_merge_count = word_count;
+      }
+      telemetry_add_words(telemetry, word_count - sentence_start_count);
+      telemetry_phase(telemetry, PHASE_READ, &phase_mark);
     }
     
     // get ALL context words (including word to be predicted (w))
-    next_random = next_random * (unsigned long long)25214903917 + 11;
-    b = next_random % window; // Samples(!) window size 
+    b = rng_below(&rng, window); // Samples(!) window size 
     pos_context_counter = 0;
     input_word_position = 0;
     for (a = b; a < window * 2 + 1 - b; a++){
@@ -734,7 +943,13 @@ void *TrainModelThread(void *thread_id) {
 
     // center word to predict
     center_word = pos_context_store[input_word_position];
+    chunk_steps++;
     center_word_position = center_word * embed_max_size;
+    // the next position's center row and the context row entering its window
+    if (sentence_position + 1 < sentence_length && sen[sentence_position + 1] > 0)
+      embed_prefetch_row(input_embed + sen[sentence_position + 1] * embed_max_size, embed_current_size + 1);
+    if (sentence_position + window + 1 < sentence_length && sen[sentence_position + window + 1] > 0)
+      embed_prefetch_row(context_embed + sen[sentence_position + window + 1] * embed_max_size, embed_current_size + 1);
 
     // lock-in value of embed_current_size for thread since its shared globally                                                    
     int local_embed_size_plus_one = embed_current_size + 1;
@@ -745,58 +960,55 @@ void *TrainModelThread(void *thread_id) {
     float *gradient = (float *) calloc(local_embed_size_plus_one * pos_context_counter, sizeof(float));
     float *neg_gradient = (float *) calloc(local_embed_size_plus_one * negative, sizeof(float));     
  
-    for (c = 0; c < local_embed_size_plus_one; c++) {
-      probs_z_given_w_C[c] = 0.0;
-      sum_probs_z_given_w_C[c] = 0.0;
-    }
+    telemetry_mark(&phase_mark);
+    // NEGATIVE SAMPLING CENTER WORDS
+    next_negatives(negative_list, negatives_ahead, negative, center_word, input_embed, local_embed_size_plus_one, &rng);
 
-    // compute p(z|w,c1,..cK)
-    compute_p_z_given_w_C(probs_z_given_w_C, sum_probs_z_given_w_C, pos_context_store, input_word_position, pos_context_counter, local_embed_size_plus_one - 1); 
+    // compute p(w,z|c1,...,cK)
+    compute_p_w_z_given_C(input_word_position, pos_context_store, negative_list, pos_context_counter, negative, prob_w_z_given_C, 
+        sum_prob_w_z_given_C, local_embed_size_plus_one);
+    telemetry_phase(telemetry, PHASE_PREDICTION, &phase_mark);
+
+    // compute p(z|w,c1,..cK) from the center word's row, the first one
+    compute_p_z_given_w_C(probs_z_given_w_C, sum_probs_z_given_w_C, prob_w_z_given_C, sum_prob_w_z_given_C, local_embed_size_plus_one);
 
     // sample z: z_hat ~ p(z|w,c1,...,cK) and expand if necessary
     // no need to normalize, function does it for us
     z_max = sample_from_mult_list(probs_z_given_w_C, 
-                  local_embed_size_plus_one, z_samples, num_z_samples, r2);
-    if (z_max == local_embed_size_plus_one 
-              && embed_current_size < local_embed_size_plus_one 
-              && z_max < embed_max_size) {
-      if (learning_rate_flag == 1) alpha_count_adjustment[embed_current_size] = word_count_actual;
-      embed_current_size++;
-    }
-
-    // NEGATIVE SAMPLING CENTER WORDS
-    d = negative-1;
-    while (d >= 0) {
-      negative_list[d] = 0; // clear old contexts
-      next_random = next_random * (unsigned long long)25214903917 + 11;
-      negative_word = table[(next_random >> 16) % table_size];
-      if (negative_word == 0) negative_word = next_random % (vocab_size - 1) + 1;
-      if (negative_word == center_word || negative_word <= 0) continue; 
-      negative_list[d] = negative_word;
-      d--;
+                  local_embed_size_plus_one, z_samples, num_z_samples, &rng);
+    // -deterministic grows at the next chunk barrier
+    if (z_max == local_embed_size_plus_one && z_max < embed_max_size && deterministic) {
+      __atomic_store_n(&chunk_grow, id + 1, __ATOMIC_RELAXED);
+    } else if (z_max == local_embed_size_plus_one && z_max < embed_max_size) {
+      // only the thread which moves the size from the value it locked in grows the model
+      long long expected_size = local_embed_size_plus_one - 1;
+      if (__atomic_compare_exchange_n(&embed_current_size, &expected_size, expected_size + 1, false,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        if (learning_rate_flag == 1) alpha_count_adjustment[expected_size] = word_count_actual;
+        telemetry_dim_growth(id, expected_size + 1, word_count_actual);
+      }
     }
-
-    // compute p(w,z|c1,...,cK)
-    compute_p_w_z_given_C(input_word_position, pos_context_store, negative_list, pos_context_counter, negative, prob_w_z_given_C, 
-        sum_prob_w_z_given_C, local_embed_size_plus_one);
+    telemetry_phase(telemetry, PHASE_POSTERIOR, &phase_mark);
 
     // compute p(w|c1...cK) 
     float log_prob_wi_given_C = sum_prob_w_z_given_C[0];
-    log_prob_wi_given_C = log(log_prob_wi_given_C + epsilon); // add small amount for stability
+    log_prob_wi_given_C = log_fast(log_prob_wi_given_C + epsilon); // add small amount for stability
 
     float context_E_grad = 0.0;
     float center_word_E_grad = 0.0;
     float neg_center_word_E_grad = 0.0;
 
+    // -exactZGrad: E_z[1(j < z)] = P(z > j), so the sampled term folds into the dimension term's weight
+    float z_grad_weight = exact_z_grad ? -1.0 : log_prob_wi_given_C - 1;
     // SUM OVER THE SAMPLED Z's
     // ONLY NEED TO CALC FOR PREDICTION PART OF GRAD
-    for (int m = 0; m < num_z_samples; m++) { 
+    if (!exact_z_grad) for (int m = 0; m < num_z_samples; m++) { 
       for (int k = 0; k < pos_context_counter; k++){
 	if (k == input_word_position) continue; // don't use center word w_i
 	context_word_position = pos_context_store[k] * embed_max_size;
 	for (int j = 0; j < z_samples[m]; j++){
-	  context_E_grad = input_embed[center_word_position + j] - (sparsity_weight/(j+1))*2*context_embed[context_word_position + j];
-	  center_word_E_grad = context_embed[context_word_position + j] - (sparsity_weight/(j+1))*2*input_embed[center_word_position + j];
+	  context_E_grad = embed_get(input_embed, center_word_position + j) - (sparsity_weight/(j+1))*2*embed_get(context_embed, context_word_position + j);
+	  center_word_E_grad = embed_get(context_embed, context_word_position + j) - (sparsity_weight/(j+1))*2*embed_get(input_embed, center_word_position + j);
 	  gradient[k*local_embed_size_plus_one + j] += (1.0/num_z_samples) * ( -log_prob_wi_given_C ) * window_normalization * context_E_grad;
 	  gradient[input_word_position*local_embed_size_plus_one + j] += (1.0/num_z_samples) * ( -log_prob_wi_given_C ) * window_normalization * center_word_E_grad;
 	}
@@ -814,37 +1026,45 @@ void *TrainModelThread(void *thread_id) {
       if (k == input_word_position) continue;
       context_word_position = pos_context_store[k] * embed_max_size;
       for (int j = 0; j < loop_bound; j++){
-	context_E_grad = input_embed[center_word_position + j] - (sparsity_weight/(j+1))*2*context_embed[context_word_position + j];
-	center_word_E_grad = context_embed[context_word_position + j] - (sparsity_weight/(j+1))*2*input_embed[center_word_position + j];
-	gradient[k*local_embed_size_plus_one + j] += (log_prob_wi_given_C - 1) * sum_probs_z_given_w_C[j] * window_normalization * context_E_grad;
-	gradient[input_word_position*local_embed_size_plus_one + j] += (log_prob_wi_given_C - 1) * sum_probs_z_given_w_C[j] * window_normalization * center_word_E_grad;
+	context_E_grad = embed_get(input_embed, center_word_position + j) - (sparsity_weight/(j+1))*2*embed_get(context_embed, context_word_position + j);
+	center_word_E_grad = embed_get(context_embed, context_word_position + j) - (sparsity_weight/(j+1))*2*embed_get(input_embed, center_word_position + j);
+	gradient[k*local_embed_size_plus_one + j] += z_grad_weight * sum_probs_z_given_w_C[j] * window_normalization * context_E_grad;
+	gradient[input_word_position*local_embed_size_plus_one + j] += z_grad_weight * sum_probs_z_given_w_C[j] * window_normalization * center_word_E_grad;
       }
     }
 
     // CALC PREDICTION NORMALIZATION GRADIENT
+    // every term is linear in the window's context rows and in the negatives' rows, so per dimension
+    // their sums are formed once and applied to each word: O(z (K + neg)) instead of O(z K neg)
+    int num_contexts = pos_context_counter - 1;
     for (int j = 0; j < loop_bound; j++){
+      float two_sparsity = (sparsity_weight/(j+1))*2;
+      float context_sum = 0.0, neg_mass = 0.0, neg_weighted_sum = 0.0;
       for (int k = 0; k < pos_context_counter; k++){
 	if (k == input_word_position) continue;
-	context_word_position = pos_context_store[k] * embed_max_size;
-	// negative samples subgradient
-	for (d = 0; d < negative; d++){
-	  neg_center_word_position = negative_list[d] * embed_max_size;
-	  context_E_grad = input_embed[neg_center_word_position + j] - (sparsity_weight/(j+1))*2*context_embed[context_word_position + j];
-	  neg_center_word_E_grad = context_embed[context_word_position + j] - (sparsity_weight/(j+1))*2*input_embed[neg_center_word_position + j]; 
-	  gradient[k*local_embed_size_plus_one + j] += sum_prob_w_z_given_C[(d+1)*local_embed_size_plus_one + j] 
-              * window_normalization * context_E_grad;
-	  // add to gradient for negative example 
-	  check_value((sum_prob_w_z_given_C[(d+1)*local_embed_size_plus_one + j] * neg_center_word_E_grad), "neg center word gradient", j);
-	  neg_gradient[d*local_embed_size_plus_one + j] += sum_prob_w_z_given_C[(d+1)*local_embed_size_plus_one + j] * window_normalization * neg_center_word_E_grad;
-	}
-	// add subgradient for postive center word
-	center_word_E_grad = context_embed[context_word_position + j] - (sparsity_weight/(j+1))*2*input_embed[center_word_position + j];
-	context_E_grad = input_embed[center_word_position + j] - (sparsity_weight/(j+1))*2*context_embed[context_word_position + j]; 
-	// add to pos context gradient                              
-	gradient[k*local_embed_size_plus_one + j] += sum_prob_w_z_given_C[j] * window_normalization * context_E_grad;
-	// add to center word grad
-	gradient[input_word_position*local_embed_size_plus_one + j] += sum_prob_w_z_given_C[j] * window_normalization * center_word_E_grad;
+	context_sum += embed_get(context_embed, pos_context_store[k] * embed_max_size + j);
       }
+      // negative samples subgradient
+      for (d = 0; d < negative; d++){
+	float neg_prob = sum_prob_w_z_given_C[(d+1)*local_embed_size_plus_one + j];
+	float neg_center_word = embed_get(input_embed, negative_list[d] * embed_max_size + j);
+	neg_mass += neg_prob;
+	neg_weighted_sum += neg_prob * neg_center_word;
+	neg_center_word_E_grad = context_sum - two_sparsity * num_contexts * neg_center_word;
+	check_value(neg_prob * neg_center_word_E_grad, "neg center word gradient", j);
+	neg_gradient[d*local_embed_size_plus_one + j] += neg_prob * window_normalization * neg_center_word_E_grad;
+      }
+      // context gradients from the negatives and the postive center word
+      float center_word = embed_get(input_embed, center_word_position + j), pos_prob = sum_prob_w_z_given_C[j];
+      for (int k = 0; k < pos_context_counter; k++){
+	if (k == input_word_position) continue;
+	float context_word = embed_get(context_embed, pos_context_store[k] * embed_max_size + j);
+	gradient[k*local_embed_size_plus_one + j] += window_normalization * (neg_weighted_sum - two_sparsity * context_word * neg_mass
+	  + pos_prob * (center_word - two_sparsity * context_word));
+      }
+      // add subgradient for postive center word
+      center_word_E_grad = context_sum - two_sparsity * num_contexts * center_word;
+      gradient[input_word_position*local_embed_size_plus_one + j] += pos_prob * window_normalization * center_word_E_grad;
     }
 
     // MAKE FINAL GRAD UPDATES
@@ -860,14 +1080,14 @@ void *TrainModelThread(void *thread_id) {
 	context_word_position = pos_context_store[k] * embed_max_size;
 	check_value(gradient[k*local_embed_size_plus_one + j], "pos_context_gradient", j); //, buffer, debug_cntr, DEBUG);
 	if (k == input_word_position){
-	  input_embed[context_word_position + j] -= lr * gradient[k*local_embed_size_plus_one + j];
+	  hot_rows_add(hot_input_rows, input_embed, context_word_position + j, -lr * gradient[k*local_embed_size_plus_one + j]);
 	} else{
-	  context_embed[context_word_position + j] -= lr * gradient[k*local_embed_size_plus_one + j];
+	  hot_rows_add(hot_context_rows, context_embed, context_word_position + j, -lr * gradient[k*local_embed_size_plus_one + j]);
 	}
       }
       for (int d = 0; d < negative; d++) {
 	neg_center_word_position = negative_list[d] * embed_max_size; 
-	input_embed[neg_center_word_position + j] -= lr * neg_gradient[d*local_embed_size_plus_one + j];
+	hot_rows_add(hot_input_rows, input_embed, neg_center_word_position + j, -lr * neg_gradient[d*local_embed_size_plus_one + j]);
       }
     }
 
@@ -876,8 +1096,9 @@ void *TrainModelThread(void *thread_id) {
     free(sum_prob_w_z_given_C);
     free(gradient);
     free(neg_gradient);
+    telemetry_phase(telemetry, PHASE_UPDATE, &phase_mark);
 
-    train_log_probability -= log_prob_wi_given_C;
+    telemetry_add_loss(telemetry, -log_prob_wi_given_C, 1);
     sentence_position++; 
     if (sentence_position >= sentence_length) {
       sentence_length = 0;
@@ -885,12 +1106,19 @@ void *TrainModelThread(void *thread_id) {
     }
   }
 
-  fclose(fi);
+  if (deterministic) chunk_thread_ns[id] = telemetry_now_ns() - thread_start;
+  else {
+    hot_rows_merge(hot_input_rows, input_embed);
+    hot_rows_merge(hot_context_rows, context_embed);
+    hot_rows_free(hot_input_rows);
+    hot_rows_free(hot_context_rows);
+  }
   free(z_samples);   
   free(probs_z_given_w_C); 
   free(pos_context_store);
   free(sum_probs_z_given_w_C);
   free(negative_list); 
+  free(negatives_ahead);
   
   pthread_exit(NULL);
 }
@@ -902,30 +1130,116 @@ void TrainModel() {
   strftime(buff, 100, "%Y-%m-%d %H:%M:%S.000", localtime (&now));               
   printf ("Strart training: %s\n", buff); 
   pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
-  printf("Starting training using file %s\n", train_file);
+  pthread_t reader, *readers = NULL;
   starting_alpha = alpha;
-  if (read_vocab_file[0] != 0) ReadVocab(); else LearnVocabFromTrainFile();
-  if (save_vocab_file[0] != 0) SaveVocab();
+  if (stream) {
+    printf("Starting online training from stdin\n");
+    if (read_vocab_file[0] != 0) ReadVocab();
+    else {
+      InitVocab();
+      AddWordToVocab((char *)"</s>");
+    }
+    if (vocab_size > stream_vocab_size) {
+      printf("ERROR: vocabulary in %s is larger than -streamVocab\n", read_vocab_file);
+      exit(1);
+    }
+    // sized for the cap up front so the vocab array never moves under the publisher
+    vocab_max_size = stream_vocab_size + 3;
+    vocab = (struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
+    stream_published_size = vocab_size;
+  } else {
+    printf("Starting training using file %s\n", train_file);
+    if (read_vocab_file[0] != 0) ReadVocab(); else LearnVocabFromTrainFile();
+    if (save_vocab_file[0] != 0) SaveVocab();
+  }
   if (output_file[0] == 0) return;
+  if (init_input_file[0] != 0 || init_context_file[0] != 0) SetWarmStartSize();
   InitNet();
-  if (negative > 0) InitUnigramTable();
-  start = clock();
+  WarmStart();
+  if (stream) {
+    unigram_tables[0] = (int *)malloc(table_size * sizeof(int));
+    unigram_tables[1] = (int *)malloc(table_size * sizeof(int));
+    table = unigram_tables[0];
+    BuildUnigramTable(table);
+  }
+  else if (negative > 0) InitUnigramTable();
   // compute log of dim penalty
   log_dim_penalty = log(dim_penalty);
   // compute exp table
-  build_exp_table(); 
   
+  telemetry_start(num_threads, telemetry_output_file, report_interval, debug_mode > 1, stream ? 0 : iter * train_words,
+                  embed_max_size, &embed_current_size, current_alpha);
+  if (stream) {
+    stream_sketch = cms_new(stream_vocab_size * 64);
+    sentence_queue_init(&stream_queue, 16 * num_threads, MAX_SENTENCE_LENGTH);
+  } else {
+    train_queues = (SentenceQueue *) malloc(num_threads * sizeof(SentenceQueue));
+    for (long a = 0; a < num_threads; a++) sentence_queue_init(&train_queues[a], 16, MAX_SENTENCE_LENGTH);
+  }
+  if (deterministic) {
+    // a chunk step touches at most the window's rows and the negatives
+    long long capacity = (chunk_size + 1) * (2 * window + negative + 1);
+    chunk_input_rows = (HotRows **) malloc(num_threads * sizeof(HotRows *));
+    chunk_context_rows = (HotRows **) malloc(num_threads * sizeof(HotRows *));
+    for (long a = 0; a < num_threads; a++) {
+      chunk_input_rows[a] = hot_rows_new(vocab_size, embed_max_size, capacity);
+      chunk_context_rows[a] = hot_rows_new(vocab_size, embed_max_size, capacity);
+    }
+    chunk_sync_ns = (long long *) calloc(num_threads, sizeof(long long));
+    chunk_thread_ns = (long long *) calloc(num_threads, sizeof(long long));
+    chunk_running = num_threads;
+    pthread_barrier_init(&chunk_barrier, NULL, num_threads);
+  }
   for (long a = 0; a < num_threads; a++) {
     pthread_create(&pt[a], NULL, TrainModelThread, (void *)a);
   }
+  if (stream) {
+    pthread_create(&reader, NULL, StreamReaderThread, NULL);
+    while (stream_wait_publish(&stream_queue, publish_interval)) PublishVectors();
+    pthread_join(reader, NULL);
+  } else {
+    readers = (pthread_t *) malloc(num_readers * sizeof(pthread_t));
+    for (long a = 0; a < num_readers; a++) pthread_create(&readers[a], NULL, CorpusReaderThread, (void *)a);
+    for (long a = 0; a < num_readers; a++) pthread_join(readers[a], NULL);
+  }
   for (long a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  telemetry_stop();
+  if (deterministic) {
+    long long sync_ns = 0, thread_ns = 0;
+    for (long a = 0; a < num_threads; a++) {
+      sync_ns += chunk_sync_ns[a];
+      thread_ns += chunk_thread_ns[a];
+      hot_rows_free(chunk_input_rows[a]);
+      hot_rows_free(chunk_context_rows[a]);
+    }
+    // the throughput given up for determinism: waiting at the barriers and merging
+    printf("Deterministic mode: %.1f%% of training thread time at chunk barriers\n", thread_ns > 0 ? 100.0 * sync_ns / thread_ns : 0.0);
+    pthread_barrier_destroy(&chunk_barrier);
+    free(chunk_input_rows);
+    free(chunk_context_rows);
+    free(chunk_sync_ns);
+    free(chunk_thread_ns);
+  }
+  if (stream) {
+    if (save_vocab_file[0] != 0) SaveVocab();
+    cms_free(stream_sketch);
+    sentence_queue_free(&stream_queue);
+  } else {
+    for (long a = 0; a < num_threads; a++) sentence_queue_free(&train_queues[a]);
+    free(train_queues);
+    free(readers);
+  }
   printf("Writing input vectors to %s\n", output_file);
   save_vectors(output_file, vocab_size, embed_current_size, vocab, input_embed);
   printf("Writing context vectors to %s\n", context_output_file);
   if (strlen(context_output_file) > 0)  save_vectors(context_output_file, vocab_size, embed_current_size, vocab, context_embed);
+  if (strlen(ragged_output_file) > 0) {
+    long long values = save_ragged_vectors(ragged_output_file, vocab_size, embed_current_size, embed_max_size, vocab, input_embed,
+                                           context_embed, log_dim_penalty, sparsity_weight, ragged_mass, num_threads);
+    printf("Writing ragged input vectors to %s: %lld of %lld values kept\n", ragged_output_file, values, vocab_size * embed_current_size);
+  }
 
   // free globally used space
-  free(exp_table);
   free(alpha_count_adjustment);
   free(alpha_per_dim);
   free(input_embed);
@@ -951,19 +1265,13 @@ int ArgPos(char *str, int argc, char **argv) {
 
 // testing function for sampling from multinomial
 void multinom_unit_test(){
-  // set up random number generator                                                                                                                                                                    
-  const gsl_rng_type * T2;
-  gsl_rng * r2;
-  srand(time(NULL));
-  unsigned int Seed2 = rand();
-  gsl_rng_env_setup();
-  T2 = gsl_rng_default;
-  r2 = gsl_rng_alloc (T2);
-  gsl_rng_set (r2, Seed2);
+  // set up random number generator
+  Rng r2;
+  rng_seed(&r2, seed, 0, 0, 0);
   
   double x[] = {0.1, 0.1, 0.1, 0.1, 0.1, 0.1};
   for (int w=0; w<10; w++){
-    int y = sample_from_mult(x, 6, r2);
+    int y = sample_from_mult(x, 6, &r2);
     printf("Sampled idx: %i \n", y);
   }
 }
@@ -975,7 +1283,7 @@ int main(int argc, char **argv) {
     printf("Options:\n");
     printf("Parameters for training:\n");
     printf("\t-train <file>\n");
-    printf("\t\tUse text data from <file> to train the model\n");
+    printf("\t\tUse text data from <file> to train the model; plain text, gzip or zstd (built with -DUSE_ZSTD)\n");
     printf("\t-output <file>\n");
     printf("\t\tUse <file> to save the resulting *input* word vectors\n");
     printf("\t-contextOutput <file>\n");
@@ -990,8 +1298,22 @@ int main(int argc, char **argv) {
     printf("\t\tSet threshold for occurrence of words; Frequent ones will be downsampled.\n");
     printf("\t-negative <int>\n");
     printf("\t\tNumber of negative examples; default is 5, common values are 3 - 10 (0 = not used)\n");
+    printf("\t-exactZGrad <int>\n");
+    printf("\t\tTake the expectation over z of the gradient in closed form; the -numSamples draws then only decide growth; default is 0 (off)\n");
+    printf("\t-deterministic <int>\n");
+    printf("\t\tReproducible multi-threaded training: fixed chunks, updates merged and the model grown at chunk barriers; default is 0 (off)\n");
+    printf("\t-chunk <int>\n");
+    printf("\t\tCenter words each thread trains between -deterministic barriers; default is 64\n");
+    printf("\t-seed <int>\n");
+    printf("\t\tSeed of the random streams (window sizes, negatives, z samples, subsampling); default is 1\n");
     printf("\t-threads <int>\n");
     printf("\t\tUse <int> threads (default 12)\n");
+    printf("\t-readers <int>\n");
+    printf("\t\tThreads reading the corpus ahead of the training threads, at most one per training thread; default is 1\n");
+    printf("\t-hotRows <int>\n");
+    printf("\t\tUpdate the rows of the <int> most frequent words through per-thread delta buffers; default is 0 (off)\n");
+    printf("\t-hotMerge <int>\n");
+    printf("\t\tCorpus words a thread trains on between merges of its -hotRows buffers; default is 100\n");
     printf("\t-iter <int>\n");
     printf("\t\tRun more training iterations (default 5)\n");
     printf("\t-min-count <int>\n");
@@ -1006,22 +1328,49 @@ int main(int argc, char **argv) {
     printf("\t\tThe vocabulary will be saved to <file>\n");
     printf("\t-read-vocab <file>\n");
     printf("\t\tThe vocabulary will be read from <file>, not constructed from the training data\n");
+    printf("\t-init-input <file>\n");
+    printf("\t\tWarm start: initialize the input vectors of known words from <file> (as written by -output) and start at its dimensionality\n");
+    printf("\t-init-context <file>\n");
+    printf("\t\tWarm start: initialize the context vectors of known words from <file> (as written by -contextOutput)\n");
+    printf("\t-raggedOutput <file>\n");
+    printf("\t\tAlso save the input vectors as ragged rows, each truncated to the dims holding its p(z|w) mass\n");
+    printf("\t-raggedMass <float>\n");
+    printf("\t\tp(z|w) mass kept per word by -raggedOutput; default is 0.99\n");
     printf("\t-optimizeType <int>\n");
     printf("\t\tFlag that, if equal to zero, performs vanialla SGD; if one, uses per-dim learning rates and schedules; if two, uses Beta CDF sweep units; if three, uses linear sweeping.\n");
     printf("\t-beta <float>\n");
     printf("\t\tParameter of linear sweep: learning rate = alpha * beta^(d-M-1).\n");
+    printf("\t-stream <int>\n");
+    printf("\t\tTrain online on text piped to stdin instead of -train, until it is closed; default is 0 (off)\n");
+    printf("\t-streamVocab <int>\n");
+    printf("\t\tMaximum number of words -stream admits; rows for all of them are allocated up front; default is 100000\n");
+    printf("\t-admitCount <int>\n");
+    printf("\t\tOccurrences (count-min sketch estimate) before -stream admits a new word; default is 5\n");
+    printf("\t-publishInterval <float>\n");
+    printf("\t\tSeconds between -stream publications of the output vectors; default is 600\n");
+    printf("\t-telemetry <file>\n");
+    printf("\t\tWrite JSON lines with tokens/sec, loss, dimensionality, growth events and per-phase timings to <file>\n");
+    printf("\t-reportInterval <float>\n");
+    printf("\t\tSeconds of wall-clock time between progress reports; default is 1.0\n");
     printf("\nExamples:\n");
     printf("./iCBOW -train data.txt -output w_vec.txt -contextOutput c_vec.txt -initSize 10 -maxSize 750 -window 6 -negative 5 -numSamples 5 -iter 1 -sparsityWeight 0.000001 -dimPenalty 1.075 -alpha 0.05 -optimizeType 1\n\n");
     return 0;
   }
   output_file[0] = 0;
   save_vocab_file[0] = 0;
+  init_input_file[0] = 0;
+  init_context_file[0] = 0;
   read_vocab_file[0] = 0;
+  telemetry_output_file[0] = 0;
   if ((i = ArgPos((char *)"-initSize", argc, argv)) > 0) embed_current_size = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-maxSize", argc, argv)) > 0) embed_max_size = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-train", argc, argv)) > 0) strcpy(train_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-save-vocab", argc, argv)) > 0) strcpy(save_vocab_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-read-vocab", argc, argv)) > 0) strcpy(read_vocab_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-init-input", argc, argv)) > 0) strcpy(init_input_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-init-context", argc, argv)) > 0) strcpy(init_context_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-raggedOutput", argc, argv)) > 0) strcpy(ragged_output_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-raggedMass", argc, argv)) > 0) ragged_mass = atof(argv[i + 1]);
   if ((i = ArgPos((char *)"-debug", argc, argv)) > 0) debug_mode = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-alpha", argc, argv)) > 0) alpha = atof(argv[i + 1]);
   if ((i = ArgPos((char *)"-dimPenalty", argc, argv)) > 0) dim_penalty = atof(argv[i+1]);
@@ -1032,13 +1381,31 @@ int main(int argc, char **argv) {
   if ((i = ArgPos((char *)"-sample", argc, argv)) > 0) sample = atof(argv[i + 1]);
   if ((i = ArgPos((char *)"-negative", argc, argv)) > 0) negative = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-deterministic", argc, argv)) > 0) deterministic = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-chunk", argc, argv)) > 0) chunk_size = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-seed", argc, argv)) > 0) seed = strtoull(argv[i + 1], NULL, 10);
+  if ((i = ArgPos((char *)"-readers", argc, argv)) > 0) num_readers = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-hotRows", argc, argv)) > 0) hot_rows = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-hotMerge", argc, argv)) > 0) hot_merge = atoll(argv[i + 1]);
   if ((i = ArgPos((char *)"-iter", argc, argv)) > 0) iter = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-min-count", argc, argv)) > 0) min_count = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-numSamples", argc, argv)) >0 ) num_z_samples = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-exactZGrad", argc, argv)) > 0) exact_z_grad = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-optimizeType", argc, argv)) >0 ) learning_rate_flag = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-beta", argc, argv)) > 0) beta = atof(argv[i+1]);
-  vocab = (struct vocab_word *)calloc(vocab_max_size, sizeof(struct vocab_word));
-  vocab_hash = (int *)calloc(vocab_hash_size, sizeof(int));
+  if ((i = ArgPos((char *)"-telemetry", argc, argv)) > 0) strcpy(telemetry_output_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-reportInterval", argc, argv)) > 0) report_interval = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-stream", argc, argv)) > 0) stream = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-streamVocab", argc, argv)) > 0) stream_vocab_size = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-admitCount", argc, argv)) > 0) admit_count = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-publishInterval", argc, argv)) > 0) publish_interval = atof(argv[i + 1]);
+  if (deterministic && (stream || hot_rows > 0)) {
+    printf("ERROR: -deterministic cannot be used with -stream or -hotRows\n");
+    exit(1);
+  }
+  // every reader serves at least one training thread
+  if (num_readers < 1) num_readers = 1;
+  if (num_readers > num_threads) num_readers = num_threads;
   print_args();
   TrainModel();
   return 0;
@@ -5,21 +5,31 @@
 #include <string.h>
 #include <math.h>
 #include <pthread.h>
-#include <gsl/gsl_randist.h>
+#include <signal.h>
+#include <sys/wait.h>
 #include <gsl/gsl_cdf.h>
+#include "telemetry.h"
+#include "corpus.h"
+#include "stream.h"
+#include "precision.h"
+#include "fastmath.h"
+#include "rng.h"
 //#include "Evaluation/eval_lib.h"
 
 // Global Variables
 #define MAX_STRING 100
 #define MAX_SENTENCE_LENGTH 1000
+#define MAX_CODE_LENGTH 40
+#define MAX_SWEEP 256
 
-const int vocab_hash_size = 30000000;  // Maximum 30 * 0.7 = 21M words in the vocabulary
 typedef float real;                    // Precision of float numbers
 
-struct vocab_word {
-  long long cn;
-  char *word;
-};
+#define VOCAB_WORD_EXTRA int *point; char *code, codelen;
+#include "vocab.h"
+#include "ragged.h"
+#include "hotrows.h"
+#include "cluster.h"
+#include "shards.h"
 
 // pthread only allows passing of one argument
 typedef struct {
@@ -27,20 +37,68 @@ typedef struct {
 } ThreadArg;
 
 char train_file[MAX_STRING], output_file[MAX_STRING], context_output_file[MAX_STRING];
-char save_vocab_file[MAX_STRING], read_vocab_file[MAX_STRING];
-struct vocab_word *vocab;
+char save_vocab_file[MAX_STRING], read_vocab_file[MAX_STRING], telemetry_output_file[MAX_STRING];
+char init_input_file[MAX_STRING], init_context_file[MAX_STRING], ragged_output_file[MAX_STRING];
 int debug_mode = 2, window = 5, min_count = 1, num_threads = 1, min_reduce = 1;
 real dim_penalty = 1.1;
-float global_train_loss = 0.0;
+float ragged_mass = 0.99; // -raggedOutput: p(z|w) mass kept per word
+float report_interval = 1.0; // seconds of wall-clock time between progress reports
 float log_dim_penalty; //we'll compute this in the training function
-int *vocab_hash;
-long long vocab_max_size = 1000, vocab_size = 0, embed_max_size = 750, embed_current_size = 5, global_loss_diff = 0;
+long long embed_max_size = 750, embed_current_size = 5;
 long long train_words = 0, word_count_actual = 0, iter = 5, file_size = 0, *alpha_count_adjustment;
+CorpusIndex *corpus;
 real alpha = 0.05, starting_alpha, sample = 1e-3, sparsity_weight = 0.001;
-real *input_embed, *context_embed, *alpha_per_dim;
-clock_t start;
-int negative = 5;
+embed_t *input_embed, *context_embed; // fp16/bf16 when built with -DEMBED_FP16/-DEMBED_BF16
+real *node_embed, *alpha_per_dim;
+int hs = 0, negative = 5;
+int shared_negatives = 0; // draw one negative set per center word instead of per positive context
+int batch_size = 1; // number of center words trained together by the minibatch engine
+real *sparsity_per_dim; // sparsity_weight/(j+1), precomputed for the minibatch kernels
+int stream = 0; // train online on text piped to stdin
+long long stream_vocab_size = 100000; // -stream: maximum number of words (rows) in the model
+int admit_count = 5; // -stream: occurrences before a new word is admitted
+float publish_interval = 600; // -stream: seconds between publications of the vectors
+long long stream_published_size = 0; // -stream: words whose rows are initialized
+SentenceQueue stream_queue;
+int num_readers = 1; // threads reading the corpus into the training threads' sentence queues
+SentenceQueue *train_queues; // one per training thread
+unsigned long long seed = 1; // key of every random stream, see rng.h
+long long hot_rows = 0; // rows of the most frequent words updated through per-thread delta buffers
+long long hot_merge = 100; // corpus words between merges of the delta buffers
+__thread HotRows *hot_input_rows, *hot_context_rows; // this thread's -hotRows or -deterministic buffers, NULL when off
+int deterministic = 0; // train in fixed chunks whose updates are merged, and the model grown, at barriers
+long long chunk_size = 64; // -deterministic: center words a thread trains between barriers
+pthread_barrier_t chunk_barrier;
+HotRows **chunk_input_rows, **chunk_context_rows; // -deterministic: every thread's buffers
+int chunk_grow = 0; // -deterministic: 1 + a thread that sampled the new dimension during the chunk
+int chunk_running, chunk_any_running; // -deterministic: threads with sentences left, at the last barrier
+long long *chunk_sync_ns, *chunk_thread_ns; // -deterministic: per thread, time at barriers and in total
+int num_nodes = 1, node_rank = 0; // -nodes: trainer processes and this one's rank; rank 0 coordinates
+char coordinator_address[MAX_STRING] = "127.0.0.1:7070"; // -nodes: host:port of rank 0
+long long sync_words = 1000000; // -nodes: local corpus words between synchronizations
+ClusterLink *cluster;
+embed_t *sync_input_base, *sync_context_base; // -nodes: the model as of the last synchronization
+unsigned char *sync_touched; // -nodes: per word, trained on since the last synchronization
+long long sync_remote_words = 0; // -nodes: the other processes' words, counted into word_count_actual
+long long sync_rounds = 0, sync_time_ns = 0; // -nodes: synchronizations and the time they took
+int sync_training_done = 0;
+int shard_vocab = 0; // -nodes: split the rows among the processes instead of replicating them
+char peer_list[4096]; // -shardVocab: host:port of every rank, comma separated
+char **peer_addresses;
+long long shard_cache = 16384; // -shardVocab: rows of other shards each thread caches
+int shard_flush_batches = 8; // -shardVocab: minibatches between pushes of the deltas of other shards' rows
+long long *shard_peer_words; // -shardVocab: the latest word count heard from each rank
+ShardServer shard_server;
+ShardClient **shard_clients; // one per training thread
+__thread ShardClient *shard_client; // this thread's, NULL unless -shardVocab
+char sweep_file[MAX_STRING]; // -sweep: one "dimPenalty sparsityWeight alpha" configuration per line
+int sweep_size = 1; // -sweep: configurations, each trained by a forked process on -threads / sweep_size threads
+int sweep_index = -1; // -sweep: this process's configuration, -1 in the parent
+real sweep_dim_penalty[MAX_SWEEP], sweep_sparsity_weight[MAX_SWEEP], sweep_alpha[MAX_SWEEP];
+CountMinSketch *stream_sketch;
+int *unigram_tables[2];
 int num_z_samples = 5;
+int exact_z_grad = 0; // take the expectation over z of the prediction gradient in closed form instead of from num_z_samples draws
 float temperature = 1.0;
 
 // learning rate variables
@@ -58,62 +116,17 @@ const int table_size = 1e8;
 const double epsilon = 1e-8;
 int *table;
 
-const int EXP_LEN = 87;
-float *exp_table; 
 
-/*
-  Build table which precompute exp function for certain integer
-  values
-*/
-void build_exp_table() {
-  exp_table = (float *) calloc(EXP_LEN * 2 + 1, sizeof(float));
-  for (int i = -EXP_LEN; i <= EXP_LEN; i++) {
-    exp_table[i + EXP_LEN] = exp(i);
-  }
-}
-
-/*
-  Exp approximate function from 
-  http://stackoverflow.com/questions/10552280/fast-exp-calculation-possible-to-improve-accuracy-without-losing-too-much-perfo/14143184#14143184
-  Error in input range [-1,1] is 0.36%
-*/
-float exp_approx(float x) { 
-  return (24+x*(24+x*(12+x*(4+x))))*0.041666666f;
-}
-
-/*
-  Separate into integer and decimal components and use table and 
-  approximate exp function to compute each part, respectively
-*/
-float exp_fast(float x) {
-  int x_int = (int)x;
-  float x_dec = x - x_int;
-
-  float exp_table_val = 0.0;
-  if (x_int < -EXP_LEN) {
-    exp_table_val = exp_table[0];
-  } 
-  else if (x_int > EXP_LEN) {
-    exp_table_val = exp_table[2*EXP_LEN];
-  }
-  else {
-    exp_table_val = exp_table[x_int + EXP_LEN];
-  }
- 
-  return exp_table_val * exp_approx(x_dec);   
-}
-
-// Build table from which to rand. sample words
-void InitUnigramTable() {
+// Fill dest with the table from which to rand. sample words
+void BuildUnigramTable(int *dest) {
   int a, i;
   double train_words_pow = 0;
   double d1, power = 0.75;
-  table = (int *)malloc(table_size * sizeof(int));
   for (a = 0; a < vocab_size; a++) train_words_pow += pow(vocab[a].cn, power);
   i = 0;
   d1 = pow(vocab[i].cn, power) / train_words_pow;
   for (a = 0; a < table_size; a++) {
-    table[a] = i;
+    dest[a] = i;
     if (a / (double)table_size > d1) {
       i++;
       d1 += pow(vocab[i].cn, power) / train_words_pow;
@@ -122,6 +135,11 @@ void InitUnigramTable() {
   }
 }
 
+void InitUnigramTable() {
+  table = (int *)malloc(table_size * sizeof(int));
+  BuildUnigramTable(table);
+}
+
 // Reads a single word from a file, assuming space + tab + EOL to be word boundaries
 void ReadWord(char *word, FILE *fin) {
   int a = 0, ch;
@@ -145,118 +163,98 @@ void ReadWord(char *word, FILE *fin) {
   word[a] = 0;
 }
 
-// Returns hash value of a word
-int GetWordHash(char *word) {
-  unsigned long long a, hash = 0;
-  for (a = 0; a < strlen(word); a++) hash = hash * 257 + word[a];
-  hash = hash % vocab_hash_size;
-  return hash;
-}
-
-// Returns position of a word in the vocabulary; if the word is not found, returns -1
-int SearchVocab(char *word) {
-  unsigned int hash = GetWordHash(word);
-  while (1) {
-    if (vocab_hash[hash] == -1) return -1;
-    if (!strcmp(word, vocab[vocab_hash[hash]].word)) return vocab_hash[hash];
-    hash = (hash + 1) % vocab_hash_size;
-  }
-  return -1;
-}
-
 // Reads a word and returns its index in the vocabulary
-int ReadWordIndex(FILE *fin) {
+int ReadWordIndex(CorpusFile *fin) {
   char word[MAX_STRING];
-  ReadWord(word, fin);
-  if (feof(fin)) return -1;
+  corpus_read_word(word, MAX_STRING, fin);
+  if (corpus_eof(fin)) return -1;
   return SearchVocab(word);
 }
 
-// Adds a word to the vocabulary
-int AddWordToVocab(char *word) {
-  unsigned int hash, length = strlen(word) + 1;
-  if (length > MAX_STRING) length = MAX_STRING;
-  vocab[vocab_size].word = (char *)calloc(length, sizeof(char));
-  strcpy(vocab[vocab_size].word, word);
-  vocab[vocab_size].cn = 0;
-  vocab_size++;
-  // Reallocate memory if needed
-  if (vocab_size + 2 >= vocab_max_size) {
-    vocab_max_size += 1000;
-    vocab = (struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
-  }
-  hash = GetWordHash(word);
-  while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-  vocab_hash[hash] = vocab_size - 1;
-  return vocab_size - 1;
-}
-
-// Used later for sorting by word counts
-int VocabCompare(const void *a, const void *b) {
-  return ((struct vocab_word *)b)->cn - ((struct vocab_word *)a)->cn;
-}
-
-// Sorts the vocabulary by frequency using word counts
-void SortVocab() {
-  int a, size;
-  unsigned int hash;
-  // Sort the vocabulary and keep </s> at the first position
-  qsort(&vocab[1], vocab_size - 1, sizeof(struct vocab_word), VocabCompare);
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  size = vocab_size;
-  train_words = 0;
-  for (a = 0; a < size; a++) {
-    // Words occuring less than min_count times will be discarded from the vocab
-    if ((vocab[a].cn < min_count) && (a != 0)) {
-      vocab_size--;
-      free(vocab[a].word);
+// Create binary Huffman tree using the word counts
+// Frequent words will have short uniqe binary codes
+void CreateBinaryTree() {
+  long long a, b, i, min1i, min2i, pos1, pos2, point[MAX_CODE_LENGTH];
+  char code[MAX_CODE_LENGTH];
+  long long *count = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
+  long long *binary = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
+  long long *parent_node = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
+  for (a = 0; a < vocab_size; a++) count[a] = vocab[a].cn;
+  for (a = vocab_size; a < vocab_size * 2; a++) count[a] = 1e15;
+  pos1 = vocab_size - 1;
+  pos2 = vocab_size;
+  // Following algorithm constructs the Huffman tree by adding one node at a time
+  for (a = 0; a < vocab_size - 1; a++) {
+    // First, find two smallest nodes 'min1, min2'
+    if (pos1 >= 0) {
+      if (count[pos1] < count[pos2]) {
+        min1i = pos1;
+        pos1--;
+      } else {
+        min1i = pos2;
+        pos2++;
+      }
+    } else {
+      min1i = pos2;
+      pos2++;
+    }
+    if (pos1 >= 0) {
+      if (count[pos1] < count[pos2]) {
+        min2i = pos1;
+        pos1--;
+      } else {
+        min2i = pos2;
+        pos2++;
+      }
     } else {
-      // Hash will be re-computed, as after the sorting it is not actual
-      hash=GetWordHash(vocab[a].word);
-      while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-      vocab_hash[hash] = a;
-      train_words += vocab[a].cn;
-    }
-  }
-  vocab = (struct vocab_word *)realloc(vocab, (vocab_size + 1) * sizeof(struct vocab_word));
-}
-
-// Reduces the vocabulary by removing infrequent tokens
-void ReduceVocab() {
-  int a, b = 0;
-  unsigned int hash;
-  for (a = 0; a < vocab_size; a++) if (vocab[a].cn > min_reduce) {
-      vocab[b].cn = vocab[a].cn;
-      vocab[b].word = vocab[a].word;
-      b++;
-    } else free(vocab[a].word);
-  vocab_size = b;
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
+      min2i = pos2;
+      pos2++;
+    }
+    count[vocab_size + a] = count[min1i] + count[min2i];
+    parent_node[min1i] = vocab_size + a;
+    parent_node[min2i] = vocab_size + a;
+    binary[min2i] = 1;
+  }
+  // Now assign binary code to each vocabulary word
   for (a = 0; a < vocab_size; a++) {
-    // Hash will be re-computed, as it is not actual
-    hash = GetWordHash(vocab[a].word);
-    while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-    vocab_hash[hash] = a;
+    vocab[a].code = (char *)calloc(MAX_CODE_LENGTH, sizeof(char));
+    vocab[a].point = (int *)calloc(MAX_CODE_LENGTH, sizeof(int));
+    b = a;
+    i = 0;
+    while (1) {
+      code[i] = binary[b];
+      point[i] = b;
+      i++;
+      b = parent_node[b];
+      if (b == vocab_size * 2 - 2) break;
+    }
+    vocab[a].codelen = i;
+    vocab[a].point[0] = vocab_size - 2;
+    for (b = 0; b < i; b++) {
+      vocab[a].code[i - b - 1] = code[b];
+      vocab[a].point[i - b] = point[b] - vocab_size;
+    }
   }
-  fflush(stdout);
-  min_reduce++;
+  free(count);
+  free(binary);
+  free(parent_node);
 }
 
 void LearnVocabFromTrainFile() {
   char word[MAX_STRING];
-  FILE *fin;
+  CorpusFile *fin;
   long long a, i;
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  fin = fopen(train_file, "rb");
-  if (fin == NULL) {
+  corpus = corpus_index_new(train_file);
+  if (corpus == NULL) {
     printf("ERROR: training data file not found!\n");
     exit(1);
   }
-  vocab_size = 0;
+  fin = corpus_open(corpus, 0);
+  InitVocab();
   AddWordToVocab((char *)"</s>");
   while (1) {
-    ReadWord(word, fin);
-    if (feof(fin)) break;
+    corpus_read_word(word, MAX_STRING, fin);
+    if (corpus_eof(fin)) break;
     train_words++;
     if ((debug_mode > 1) && (train_words % 100000 == 0)) {
       printf("%lldK%c", train_words / 1000, 13);
@@ -267,15 +265,17 @@ void LearnVocabFromTrainFile() {
       a = AddWordToVocab(word);
       vocab[a].cn = 1;
     } else vocab[i].cn++;
-    if (vocab_size > vocab_hash_size * 0.7) ReduceVocab();
+    if (vocab_size > vocab_max_words) ReduceVocab(min_reduce++);
   }
-  SortVocab();
+  train_words = SortVocab(min_count);
   if (debug_mode > 0) {
     printf("Vocab size: %lld\n", vocab_size);
     printf("Words in train file: %lld\n", train_words);
   }
-  file_size = ftell(fin);
-  fclose(fin);
+  corpus_close(fin);
+  file_size = corpus->text_size;
+  if (debug_mode > 0 && corpus->format != CORPUS_PLAIN)
+    printf("Corpus is %s, %lld restart points\n", corpus_format_names[corpus->format], corpus->num_points);
 }
 
 void SaveVocab() {
@@ -294,8 +294,7 @@ void ReadVocab() {
     printf("Vocabulary file not found\n");
     exit(1);
   }
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  vocab_size = 0;
+  InitVocab();
   while (1) {
     ReadWord(word, fin);
     if (feof(fin)) break;
@@ -303,43 +302,68 @@ void ReadVocab() {
     fscanf(fin, "%lld%c", &vocab[a].cn, &c);
     i++;
   }
-  SortVocab();
+  train_words = SortVocab(min_count);
   if (debug_mode > 0) {
     printf("Vocab size: %lld\n", vocab_size);
     printf("Words in train file: %lld\n", train_words);
   }
-  fin = fopen(train_file, "rb");
-  if (fin == NULL) {
+  if (stream) return;
+  corpus = corpus_index_new(train_file);
+  if (corpus == NULL) {
     printf("ERROR: training data file not found!\n");
     exit(1);
   }
-  fseek(fin, 0, SEEK_END);
-  file_size = ftell(fin);
-  fclose(fin);
+  corpus_scan(corpus);
+  file_size = corpus->text_size;
+}
+
+// row of word a in this process's tables; -shardVocab: -1 unless this process owns it
+long long LocalRow(long long a) {
+  if (!shard_vocab) return a;
+  return shard_owner(a, num_nodes) == node_rank ? a / num_nodes : -1;
 }
 
 void InitNet() {
   long long a, b;
-  unsigned long long next_random = 1;
-  // initialize context embeddings
-  a = posix_memalign((void **)&context_embed, 128, (long long)vocab_size * embed_max_size * sizeof(real));
-  if (context_embed == NULL) {printf("Memory allocation failed\n"); exit(1);}
-  for (a = 0; a < vocab_size; a++) for (b = 0; b < embed_max_size; b++) {
-      // random (instead of zero) to avoid multi-threaded problems
-      next_random = next_random * (unsigned long long)25214903917 + 11;
-      context_embed[a * embed_max_size + b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / embed_current_size; 
+  unsigned long long next_random = seed;
+  // -stream allocates rows for every word it may admit later
+  long long rows = stream ? stream_vocab_size : vocab_size;
+  // -shardVocab: only the owned rows; every process draws the whole sequence so a row starts the same on any of them
+  if (shard_vocab) rows = (vocab_size + num_nodes - 1) / num_nodes;
+  if (hs) {
+    // inner node vectors of the Huffman tree take the place of the context embeddings
+    a = posix_memalign((void **)&node_embed, 128, (long long)vocab_size * embed_max_size * sizeof(real));
+    if (node_embed == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    for (a = 0; a < vocab_size; a++) for (b = 0; b < embed_max_size; b++)
+      node_embed[a * embed_max_size + b] = 0;
+  } else {
+    // initialize context embeddings
+    a = posix_memalign((void **)&context_embed, 128, rows * embed_max_size * sizeof(embed_t));
+    if (context_embed == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    for (a = 0; a < vocab_size; a++) {
+      long long row = LocalRow(a);
+      for (b = 0; b < embed_max_size; b++) {
+	// random (instead of zero) to avoid multi-threaded problems
+	next_random = next_random * (unsigned long long)25214903917 + 11;
+	if (row >= 0) embed_set(context_embed, row * embed_max_size + b, (((next_random & 0xFFFF) / (real)65536) - 0.5) / embed_current_size); 
+      }
+    }
   }
   // initialize input embeddings
-  a = posix_memalign((void **)&input_embed, 128, (long long)vocab_size * embed_max_size * sizeof(real));
-  for (a = 0; a < vocab_size; a++) for (b = 0; b < embed_max_size; b++) {
+  a = posix_memalign((void **)&input_embed, 128, rows * embed_max_size * sizeof(embed_t));
+  if (input_embed == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < vocab_size; a++) {
+    long long row = LocalRow(a);
+    for (b = 0; b < embed_max_size; b++) {
       // only initialize first few dims so we can tell the true vector length
       if (b < embed_current_size){
 	next_random = next_random * (unsigned long long)25214903917 + 11;
-	input_embed[a * embed_max_size + b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / embed_current_size;
+	if (row >= 0) embed_set(input_embed, row * embed_max_size + b, (((next_random & 0xFFFF) / (real)65536) - 0.5) / embed_current_size);
       }
-      else{
-	input_embed[a * embed_max_size + b] = 0.0;
+      else if (row >= 0) {
+	embed_set(input_embed, row * embed_max_size + b, 0.0);
       }
+    }
   }
 
   // initialize per dimension learning rate array
@@ -347,15 +371,250 @@ void InitNet() {
   for (b = 0; b < embed_max_size; b++) alpha_per_dim[b] = alpha;
   alpha_count_adjustment = (long long *) calloc(embed_max_size, sizeof(long long));
   if (learning_rate_flag == 3) {
-    input_grad_moment1 = calloc(vocab_size * embed_max_size, sizeof(float)); 
-    context_grad_moment1 = calloc(vocab_size * embed_max_size, sizeof(float));
-    input_grad_moment2 = calloc(vocab_size * embed_max_size, sizeof(float)); 
-    context_grad_moment2 = calloc(vocab_size * embed_max_size, sizeof(float));
-    input_adam_update_counter = calloc(vocab_size * embed_max_size, sizeof(float));
-    context_adam_update_counter = calloc(vocab_size * embed_max_size, sizeof(float));
+    input_grad_moment1 = calloc(rows * embed_max_size, sizeof(float)); 
+    context_grad_moment1 = calloc(rows * embed_max_size, sizeof(float));
+    input_grad_moment2 = calloc(rows * embed_max_size, sizeof(float)); 
+    context_grad_moment2 = calloc(rows * embed_max_size, sizeof(float));
+    input_adam_update_counter = calloc(rows * embed_max_size, sizeof(float));
+    context_adam_update_counter = calloc(rows * embed_max_size, sizeof(float));
   }
 }
 
+// Returns the dimensionality in the header of a vector file written by save_vectors
+long long ReadVectorsDim(char *path) {
+  long long words, dims;
+  FILE *fin = fopen(path, "rb");
+  if (fin == NULL) {
+    printf("ERROR: vector file %s not found\n", path);
+    exit(1);
+  }
+  if (fscanf(fin, "%lld %lld", &words, &dims) != 2) {
+    printf("ERROR: %s is not a vector file\n", path);
+    exit(1);
+  }
+  fclose(fin);
+  return dims;
+}
+
+/*
+  Warm start: overwrites the rows of words that are in the vocabulary with
+  their saved vectors; rows of words the file does not have keep their
+  InitNet values.  Returns the number of rows loaded.
+*/
+long long LoadVectors(char *path, embed_t *embed) {
+  long long words, dims, a, b, i, found = 0;
+  char word[MAX_STRING];
+  float value;
+  FILE *fin = fopen(path, "rb");
+  if (fscanf(fin, "%lld %lld", &words, &dims) != 2) return 0;
+  for (a = 0; a < words; a++) {
+    if (fscanf(fin, "%99s", word) != 1) break;
+    i = SearchVocab(word);
+    for (b = 0; b < dims; b++) {
+      if (fscanf(fin, "%f", &value) != 1) {
+        printf("ERROR: %s is truncated at word %lld\n", path, a);
+        exit(1);
+      }
+      if (i != -1) embed_set(embed, i * embed_max_size + b, value);
+    }
+    if (i != -1) found++;
+  }
+  fclose(fin);
+  return found;
+}
+
+// Starts from the dimensionality of the warm start files, so new words get that many random dims too
+void SetWarmStartSize() {
+  long long dims = -1;
+  if (init_input_file[0] != 0) dims = ReadVectorsDim(init_input_file);
+  if (init_context_file[0] != 0) {
+    long long context_dims = ReadVectorsDim(init_context_file);
+    if (dims != -1 && dims != context_dims) {
+      printf("ERROR: %s has %lld dims but %s has %lld\n", init_input_file, dims, init_context_file, context_dims);
+      exit(1);
+    }
+    dims = context_dims;
+  }
+  if (dims >= embed_max_size) {
+    printf("ERROR: -maxSize must be larger than the %lld dims of the warm start vectors\n", dims);
+    exit(1);
+  }
+  if (dims > 0) {
+    embed_current_size = dims;
+    printf("Warm start: initial dimensionality is %lld\n", dims);
+  }
+}
+
+void WarmStart() {
+  if (init_input_file[0] != 0) printf("Warm start: %lld of %lld input vectors loaded from %s\n",
+                                      LoadVectors(init_input_file, input_embed), vocab_size, init_input_file);
+  if (init_context_file[0] != 0) printf("Warm start: %lld of %lld context vectors loaded from %s\n",
+                                        LoadVectors(init_context_file, context_embed), vocab_size, init_context_file);
+}
+
+// -stream: initialize the rows of a newly admitted word the way InitNet does
+void InitWordRows(long long a, unsigned long long *next_random) {
+  long long b, curr_size = embed_current_size;
+  for (b = 0; b < embed_max_size; b++) {
+    *next_random = *next_random * (unsigned long long)25214903917 + 11;
+    embed_set(context_embed, a * embed_max_size + b, (((*next_random & 0xFFFF) / (real)65536) - 0.5) / curr_size);
+  }
+  for (b = 0; b < embed_max_size; b++) {
+    if (b < curr_size) {
+      *next_random = *next_random * (unsigned long long)25214903917 + 11;
+      embed_set(input_embed, a * embed_max_size + b, (((*next_random & 0xFFFF) / (real)65536) - 0.5) / curr_size);
+    }
+    else embed_set(input_embed, a * embed_max_size + b, 0.0);
+  }
+}
+
+/*
+  -stream: reads stdin, counts words, admits new ones through the count-min
+  sketch and pushes subsampled id sentences to the training threads.  The
+  negative sampling table is rebuilt from the running counts into the spare
+  buffer and swapped in, at doubling intervals up to every 10M words, and
+  whenever the vocabulary has doubled since the last build, so the first
+  admissions get a table instead of the </s>-only one the stream starts with.
+*/
+void *StreamReaderThread(void *unused) {
+  char word[MAX_STRING];
+  long long sen[MAX_SENTENCE_LENGTH], sentence_length = 0, sentence_words = 0, i;
+  long long next_table_words = 10000, table_step_max = 10000000, table_vocab_size = vocab_size;
+  unsigned long long next_random = seed;
+  Rng rng;
+  rng_seed(&rng, seed, RNG_READER_STREAM, 0, 0);
+  while (1) {
+    ReadWord(word, stdin);
+    if (feof(stdin)) break;
+    sentence_words++;
+    i = SearchVocab(word);
+    if (i == -1) {
+      if (vocab_size >= stream_vocab_size) continue;
+      unsigned int seen = cms_add(stream_sketch, word);
+      if (seen < admit_count) continue;
+      i = AddWordToVocab(word);
+      vocab[i].cn = seen - 1;
+      InitWordRows(i, &next_random);
+      __atomic_store_n(&stream_published_size, vocab_size, __ATOMIC_RELEASE);
+    }
+    vocab[i].cn++;
+    train_words++;
+    if (train_words >= next_table_words || vocab_size >= 2 * table_vocab_size) {
+      int *spare = (table == unigram_tables[0]) ? unigram_tables[1] : unigram_tables[0];
+      BuildUnigramTable(spare);
+      __atomic_store_n(&table, spare, __ATOMIC_RELEASE);
+      if (train_words >= next_table_words) next_table_words = train_words + ((train_words < table_step_max) ? train_words : table_step_max);
+      table_vocab_size = vocab_size;
+    }
+    if (i != 0) {
+      // The subsampling randomly discards frequent words while keeping the ranking the same
+      if (sample > 0) {
+        real ran = (sqrt(vocab[i].cn / (sample * train_words)) + 1) * (sample * train_words) / vocab[i].cn;
+        if (ran < rng_uniform(&rng)) continue;
+      }
+      sen[sentence_length] = i;
+      sentence_length++;
+      if (sentence_length < MAX_SENTENCE_LENGTH) continue;
+    }
+    if (sentence_length == 0) continue;
+    sentence_queue_push(&stream_queue, sen, sentence_length, sentence_words);
+    sentence_length = 0;
+    sentence_words = 0;
+  }
+  if (sentence_length > 0) sentence_queue_push(&stream_queue, sen, sentence_length, sentence_words);
+  sentence_queue_close(&stream_queue);
+  return NULL;
+}
+
+// a training thread's shard of the corpus, as read by a CorpusReaderThread
+typedef struct {
+  CorpusFile *fi;
+  long long word_count, pending_words, local_iter;
+  Rng rng;  // subsampling; the stream of (shard, epoch)
+} ReaderShard;
+
+// text offset of training thread t's shard; with -nodes the file is split among all processes' threads
+long long ShardOffset(long long t) {
+  return file_size / ((long long)num_threads * num_nodes) * (node_rank * num_threads + t);
+}
+
+// random stream of training thread t (or of its shard's reader); with -nodes each process's threads get their own
+unsigned int ThreadStream(long long t) {
+  return (unsigned int)(node_rank * num_threads + t);
+}
+
+/*
+  Reads the shards of the training threads id, id + num_readers, ... for
+  iter passes each and pushes their subsampled id sentences to the threads'
+  queues, the one with the fewest sentences waiting first.  A queue is
+  closed after its shard's last pass.
+*/
+void *CorpusReaderThread(void *reader_id) {
+  long id = (long) reader_id;
+  int num_shards = (num_threads - id + num_readers - 1) / num_readers, open = num_shards;
+  long long sen[MAX_SENTENCE_LENGTH], sentence_length, sentence_words, word;
+  ReaderShard *shards = (ReaderShard *) calloc(num_shards, sizeof(ReaderShard));
+  for (int s = 0; s < num_shards; s++) {
+    long long t = id + s * num_readers;
+    shards[s].fi = corpus_open(corpus, ShardOffset(t));
+    shards[s].local_iter = iter;
+    rng_seed(&shards[s].rng, seed, RNG_READER_STREAM | ThreadStream(t), 0, 0);
+  }
+  while (open > 0) {
+    int s = -1, waiting = 0;
+    for (int k = 0; k < num_shards; k++) {
+      if (shards[k].fi == NULL) continue;
+      int count = sentence_queue_count(train_queues + id + k * num_readers);
+      if (s == -1 || count < waiting) {
+        s = k;
+        waiting = count;
+      }
+    }
+    ReaderShard *shard = shards + s;
+    SentenceQueue *queue = train_queues + id + s * num_readers;
+    sentence_length = sentence_words = 0;
+    while (1) {
+      word = ReadWordIndex(shard->fi);
+      if (corpus_eof(shard->fi)) break;
+      if (word == -1) continue;
+      sentence_words++;
+      if (word == 0) break;
+      // The subsampling randomly discards frequent words while keeping the ranking the same
+      if (sample > 0) {
+        real ran = (sqrt(vocab[word].cn / (sample * train_words)) + 1) * (sample * train_words) / vocab[word].cn;
+        if (ran < rng_uniform(&shard->rng)) continue;
+      }
+      sen[sentence_length] = word;
+      sentence_length++;
+      if (sentence_length >= MAX_SENTENCE_LENGTH) break;
+    }
+    shard->word_count += sentence_words;
+    // words of sentences that subsampling emptied are counted with the next one
+    shard->pending_words += sentence_words;
+    if (sentence_length > 0) {
+      // -sweep: the same sentence for every configuration's thread of this shard
+      for (int k = 0; k < sweep_size; k++) sentence_queue_push(queue + k * num_threads, sen, sentence_length, shard->pending_words);
+      shard->pending_words = 0;
+    }
+    // if EOF, reset to beginning
+    if (corpus_eof(shard->fi) || (shard->word_count > train_words / num_threads / num_nodes)) {
+      shard->local_iter--;
+      if (shard->local_iter == 0) {
+        for (int k = 0; k < sweep_size; k++) sentence_queue_close(queue + k * num_threads);
+        corpus_close(shard->fi);
+        shard->fi = NULL;
+        open--;
+        continue;
+      }
+      shard->word_count = 0;
+      rng_seed(&shard->rng, seed, RNG_READER_STREAM | ThreadStream(id + s * num_readers), iter - shard->local_iter, 0);
+      corpus_seek(shard->fi, ShardOffset(id + s * num_readers));
+    }
+  }
+  free(shards);
+  return NULL;
+}
+
 /*
   Compute e^(-E(w,c,z)) for z=1,...,curr_z,curr_z+1  
   -> dist: float array to fill; should be of size curr_z+1 
@@ -366,9 +625,9 @@ void InitNet() {
 float compute_z_dist(float *dist, long long w_idx, long long c_idx, int curr_z) { 
   float max_value = 0.0;
   for (int a = 0; a < curr_z; a++) {
-    float val = -input_embed[w_idx + a]*context_embed[c_idx + a] 
-      +log_dim_penalty + sparsity_weight/(a+1) * input_embed[w_idx + a]*input_embed[w_idx + a] 
-      + sparsity_weight/(a+1) * context_embed[c_idx + a]*context_embed[c_idx+a];
+    float val = -embed_get(input_embed, w_idx + a)*embed_get(context_embed, c_idx + a) 
+      +log_dim_penalty + sparsity_weight/(a+1) * embed_get(input_embed, w_idx + a)*embed_get(input_embed, w_idx + a) 
+      + sparsity_weight/(a+1) * embed_get(context_embed, c_idx + a)*embed_get(context_embed, c_idx+a);
     for (int b = a; b <= curr_z; b++) {
       dist[b] += val;
     }
@@ -379,25 +638,17 @@ float compute_z_dist(float *dist, long long w_idx, long long c_idx, int curr_z)
   return max_value;
 }
 
-void compute_p_z_given_w_c(float *prob_z_given_w_c, float *sum_prob_z_given_w_c, long long w_idx,
-  long long c_idx, int curr_z) {
-  float max_value = compute_z_dist(prob_z_given_w_c, w_idx, c_idx, curr_z);
-  float norm = 0.0;
-  
-  // iterate to exponeniate and compute norm
-  for (int i = 0; i < curr_z; i++) {
-    prob_z_given_w_c[i] = exp_fast((-prob_z_given_w_c[i] - max_value)/temperature);
-    norm += prob_z_given_w_c[i];
-  }  
-  prob_z_given_w_c[curr_z] = (dim_penalty / (dim_penalty - 1.0)) * exp_fast((-prob_z_given_w_c[curr_z] - max_value)/temperature);
-  norm += prob_z_given_w_c[curr_z];
-
-  // pre-calculate sums
-  float sum = 0.0;
-  for (int i = curr_z; i >= 0; i--) {
-    prob_z_given_w_c[i] = prob_z_given_w_c[i]/norm;
-    sum += prob_z_given_w_c[i];
-    sum_prob_z_given_w_c[i] = sum;
+/*
+  p(z|w,c) of a positive pair is its row of p(c,z|w) renormalized by the
+  row's mass, so the pair's energies are only computed once
+  -> row, row_sums: the pair's row of prob_c_z_given_w and sum_prob_c_z_given_w
+*/
+void compute_p_z_given_w_c(float *prob_z_given_w_c, float *sum_prob_z_given_w_c, float *row, float *row_sums,
+  int curr_z_plus_one) {
+  float inv_mass = 1.0 / row_sums[0];
+  for (int z = 0; z < curr_z_plus_one; z++) {
+    prob_z_given_w_c[z] = row[z] * inv_mass;
+    sum_prob_z_given_w_c[z] = row_sums[z] * inv_mass;
   }
 }
 
@@ -417,15 +668,11 @@ void compute_p_c_z_given_w(long long word, long long *context, float *prob_c_z_g
     }
   }
  
-  // iterate to exponentiate and compute norm 
+  // exponentiate the whole (context x z) block in one pass, then weight each row's infinite tail
+  norm = exp_affine(prob_c_z_given_w, (long long)context_size * curr_z_plus_one, -1.0/temperature, -max_value/temperature);
   for (int s = 0; s < context_size; s++) {
-    for (int z = 0; z < curr_z_plus_one-1; z++) {
-      prob_c_z_given_w[s*curr_z_plus_one + z] = exp_fast((-prob_c_z_given_w[s*curr_z_plus_one + z] - max_value)/temperature);
-      norm += prob_c_z_given_w[s*curr_z_plus_one + z];
-    }
-    prob_c_z_given_w[s*curr_z_plus_one + curr_z_plus_one-1] = (dim_penalty / (dim_penalty - 1.0))
-     * exp_fast((-prob_c_z_given_w[s*curr_z_plus_one + curr_z_plus_one-1] - max_value)/temperature);
-    norm += prob_c_z_given_w[s*curr_z_plus_one + curr_z_plus_one-1];
+    norm += (dim_penalty / (dim_penalty - 1.0) - 1.0) * prob_c_z_given_w[s*curr_z_plus_one + curr_z_plus_one-1];
+    prob_c_z_given_w[s*curr_z_plus_one + curr_z_plus_one-1] *= dim_penalty / (dim_penalty - 1.0);
   }
 
   // compute prob and pre-calculate sums 
@@ -439,15 +686,60 @@ void compute_p_c_z_given_w(long long word, long long *context, float *prob_c_z_g
   }
 }
 
-// function to sample value of z_hat -- modified but essentially coppied from StackOverflow 
-// http://stackoverflow.com/questions/25363450/generating-a-multinomial-distribution
-int sample_from_mult(double probs[], int k, const gsl_rng* r){ // always sample 1 value
-  unsigned int mult_op[k];
-  gsl_ran_multinomial(r, k, 1, probs, mult_op);
-  for (int idx=1; idx<=k; idx++){
-    if (mult_op[idx-1]==1) return idx;
+/*
+  Hierarchical softmax factorization p(c,z|w) = p(z|w) p(c|w,z), where p(z|w) uses the
+  word's own energy terms and p(c|w,z) is the product of the binary decisions along
+  c's Huffman path, each made with the first z dimensions.  Both factors are
+  normalized, so the returned log p(c|w) is exact.
+  -> log_p_z_given_w: filled with log p(z|w) for z=1,...,curr_z_plus_one
+  -> path_logits: codelen * curr_z_plus_one; filled with signed prefix logits of each path node
+  -> prob_z_given_w_c: filled with the posterior p(z|w,c)
+*/
+float compute_p_c_z_given_w_hs(long long word, long long context, float *log_p_z_given_w, float *path_logits,
+  float *prob_z_given_w_c, int curr_z_plus_one) {
+  long long w_idx = word * embed_max_size;
+  float energy = 0.0, norm = 0.0;
+
+  // prior over z; the infinite tail at curr_z+1 is a/(a-1) times the energy through curr_z, as in compute_z_dist
+  for (int z = 0; z < curr_z_plus_one - 1; z++) {
+    energy += log_dim_penalty + sparsity_weight/(z+1) * embed_get(input_embed, w_idx + z)*embed_get(input_embed, w_idx + z);
+    log_p_z_given_w[z] = -energy/temperature;
   }
-  return 0;
+  log_p_z_given_w[curr_z_plus_one-1] = -energy/temperature + log_fast(dim_penalty / (dim_penalty - 1.0));
+  norm = log_sum_exp(log_p_z_given_w, curr_z_plus_one);
+  for (int z = 0; z < curr_z_plus_one; z++) {
+    log_p_z_given_w[z] -= norm;
+    prob_z_given_w_c[z] = log_p_z_given_w[z];
+  }
+
+  // add log p(c|w,z) node by node; prefix sums give every z in one pass
+  for (int d = 0; d < vocab[context].codelen; d++) {
+    long long n_idx = vocab[context].point[d] * embed_max_size;
+    float sign = 1 - 2 * vocab[context].code[d];
+    float dot = 0.0;
+    for (int z = 0; z < curr_z_plus_one; z++) {
+      dot += embed_get(input_embed, w_idx + z) * node_embed[n_idx + z];
+      path_logits[d * curr_z_plus_one + z] = sign * dot / temperature;
+      prob_z_given_w_c[z] += log_sigmoid_fast(path_logits[d * curr_z_plus_one + z]);
+    }
+  }
+
+  // normalize the joint into p(z|w,c); the normalizer is p(c|w)
+  float log_prob_c_given_w = log_sum_exp(prob_z_given_w_c, curr_z_plus_one);
+  exp_affine(prob_z_given_w_c, curr_z_plus_one, 1.0, -log_prob_c_given_w);
+  return log_prob_c_given_w;
+}
+
+// samples one value of z_hat from the (unnormalized) probabilities
+int sample_from_mult(double probs[], int k, Rng *r) {
+  double total = 0.0, cdf = 0.0;
+  for (int idx = 0; idx < k; idx++) total += probs[idx];
+  double u = rng_uniform(r) * total;
+  for (int idx = 1; idx <= k; idx++) {
+    cdf += probs[idx-1];
+    if (u < cdf) return idx;
+  }
+  return k;
 }
 
 // Samples N values of z_hat and returns in vals list and returns the max of samples 
@@ -455,32 +747,27 @@ int sample_from_mult(double probs[], int k, const gsl_rng* r){ // always sample
 // probs -- unnormalized probabilities
 // k -- l+1 (size of current embedding + 1)
 // N -- number of samples to draw
-// vals -- N-size array containing the sampled values
+// vals -- N-size array containing the sampled values, in increasing order
 // r -- random number generator 
-int sample_from_mult_list(float float_probs[], int k, int vals[], int N, 
-  const gsl_rng* r) {
-  unsigned int mult_op[k];
-  // copy over to double array
-  double probs[k];
-  for (int i = 0; i < k; i++) {
-    probs[i] = float_probs[i];
+// The N uniforms are sorted, so one pass over the cdf places all of them
+int sample_from_mult_list(float probs[], int k, int vals[], int N, Rng *r) {
+  float u[N], total = 0.0, cdf = 0.0;
+  int last = 1, m = 0;
+  for (int idx = 0; idx < k; idx++) total += probs[idx];
+  for (int n = 0; n < N; n++) {
+    float value = rng_uniform(r) * total;
+    int pos = n;
+    for (; pos > 0 && u[pos-1] > value; pos--) u[pos] = u[pos-1];
+    u[pos] = value;
   }
-
-  gsl_ran_multinomial(r, k, N, probs, mult_op); // returns array of size N with amount of each value sampled 
-  int cnt = 0;
-  // add sampled values to list 
-  int max_idx = -1;
-  for (int idx=1; idx<=k; idx++) {  
-    if (mult_op[idx-1] > 0) { // get max so far
-      max_idx = idx;
-    }
-    // We know amount of this value, so add this many to list
-    for (int num=0; num<mult_op[idx-1]; num++) {
-      vals[cnt] = idx;
-      cnt++;
-    }
+  for (int idx = 1; idx <= k && m < N; idx++) {
+    cdf += probs[idx-1];
+    if (probs[idx-1] > 0) last = idx;
+    while (m < N && u[m] < cdf) vals[m++] = idx;
   }
-  return max_idx;
+  // rounding can leave the cdf short of total
+  while (m < N) vals[m++] = last;
+  return N > 0 ? vals[N-1] : -1;
 }
 
 void check_value(float val, char *name, int idx) {
@@ -510,11 +797,27 @@ void print_args() {
   printf("Train Corpus: %s\n", train_file);
   printf("Output file: %s\n", output_file);
   printf("Num. of threads: %d\n", num_threads);
+  printf("Random seed: %llu\n", seed);
+  if (deterministic) printf("Deterministic: chunks of %lld center words per thread\n", chunk_size);
+  if (!stream) printf("Corpus reader threads: %d\n", num_readers);
+  if (sweep_file[0] != 0) {
+    printf("Sweep: %d configurations from %s, %d threads each\n", sweep_size, sweep_file, num_threads);
+    for (int k = 0; k < sweep_size; k++) printf("\tConfiguration %d: dimPenalty %f, sparsityWeight %f, alpha %f\n", k,
+                                                sweep_dim_penalty[k], sweep_sparsity_weight[k], sweep_alpha[k]);
+  }
+  if (shard_vocab) printf("Node %d of %d, rows split among the nodes, %lld cached rows per thread, pushes every %d minibatches\n",
+                          node_rank, num_nodes, shard_cache, shard_flush_batches);
+  else if (num_nodes > 1) printf("Node %d of %d, coordinator %s, synchronizing every %lld words\n", node_rank, num_nodes, coordinator_address, sync_words);
+  if (hot_rows > 0) printf("Hot rows: %lld, merged every %lld words\n", hot_rows, hot_merge);
   printf("Initial dimensionality: %lld\n", embed_current_size);
   printf("Max dimensionality: %lld\n", embed_max_size); 
   printf("Context window size: %d\n", window); 
-  printf("Num. of negative samples: %d\n", negative); 
+  if (hs) printf("Objective: hierarchical softmax\n");
+  else printf("Num. of negative samples: %d%s\n", negative, batch_size > 1 ? " (shared across each minibatch)" : shared_negatives ? " (shared across each window)" : ""); 
+  if (batch_size > 1 && !hs) printf("Minibatch size: %d center words\n", batch_size);
   printf("Training iterations (epochs): %lld\n", iter);
+  if (exact_z_grad) printf("Z gradient: exact expectation (%d samples decide growth)\n", num_z_samples);
+  else printf("Z gradient: average over %d samples\n", num_z_samples);
   if (learning_rate_flag == 1) printf("\tOptimization type: per-dimension learning rate\n");
   else if (learning_rate_flag == 2) printf("\tOptimization type: Beta CDF sweeping.\n");
   else if (learning_rate_flag == 3) printf("\tOptimization type: AdaM.\n");
@@ -523,11 +826,12 @@ void print_args() {
   printf("Dimension penalty: %f\n", (float)dim_penalty); 
   printf("Sparsity weight: %f\n", (float)sparsity_weight);
   printf("Temperature: %f\n", temperature);
+  printf("Embedding storage: %s\n", EMBED_PRECISION);
   printf("#####################\n");
   fflush(stdout);
 }
 
-void save_vectors(char *output_file, long long int vocab_size, long long int embed_current_size, struct vocab_word *vocab, real *input_embed) {
+void save_vectors(char *output_file, long long int vocab_size, long long int embed_current_size, struct vocab_word *vocab, embed_t *input_embed) {
   FILE *fo;
   fo = fopen(output_file, "wb");
   // Save the word vectors
@@ -536,39 +840,572 @@ void save_vectors(char *output_file, long long int vocab_size, long long int emb
   for (a = 0; a < vocab_size; a++) {
     fprintf(fo, "%s ", vocab[a].word);
     // only print the non-zero dimensions
-    for (b = 0; b < embed_current_size; b++) fprintf(fo, "%f ", input_embed[a * embed_max_size + b]);
+    for (b = 0; b < embed_current_size; b++) fprintf(fo, "%f ", embed_get(input_embed, a * embed_max_size + b));
     fprintf(fo, "\n");
   }
   fclose(fo);
 }
 
+// SGD step, or AdaM step when learning_rate_flag == 3, on param[idx] with gradient g
+void update_param(embed_t *param, float *moment1, float *moment2, float *update_counter, long long idx, float lr, float g) {
+  if (learning_rate_flag != 3) {
+    hot_rows_add(param == input_embed ? hot_input_rows : hot_context_rows, param, idx, -lr * g);
+    return;
+  }
+  update_counter[idx] += 1;
+  float m_t = (b1_adam * moment1[idx]) + (1 - b1_adam) * g;
+  float v_t = (b2_adam * moment2[idx]) + (1 - b2_adam) * g*g;
+  float m_t_hat = m_t / (1. - pow(b1_adam, update_counter[idx]));
+  float v_t_hat = v_t / (1. - pow(b2_adam, update_counter[idx]));
+  embed_add(param, idx, -alpha_adam * m_t_hat / (sqrt(v_t_hat) + epsilon_adam));
+  moment1[idx] = m_t;
+  moment2[idx] = v_t;
+}
+
+// grow the model by one dimension unless another thread already did since locked_size was read
+void expand_embedding(long id, long long locked_size) {
+  long long expected_size = locked_size;
+  // -deterministic grows at the next chunk barrier
+  if (deterministic) {
+    __atomic_store_n(&chunk_grow, id + 1, __ATOMIC_RELAXED);
+    return;
+  }
+  if (__atomic_compare_exchange_n(&embed_current_size, &expected_size, expected_size + 1, false,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    alpha_count_adjustment[expected_size] = word_count_actual;
+    telemetry_dim_growth(id, expected_size + 1, word_count_actual);
+  }
+}
+
+/*
+  Minibatch engine (-batch): B center words, their positive contexts and one
+  block of negatives shared by the whole batch are gathered into packed
+  blocks that hold only the active l+1 prefix of every row.  Energies and
+  gradients are computed on the packed blocks, then the updates are
+  scattered back to the shared tables Hogwild-style.  Rows of center b are
+  its positives [row_start[b], row_start[b+1]); every center is scored
+  against all num_negatives negatives, except a negative that is the center
+  word itself.  The negatives are kept transposed (dims x num_negatives) so
+  that the center-by-negative kernels run across the negatives innermost.
+*/
+#define BATCH_TILE 4 // centers whose negative energies are accumulated together
+
+typedef struct {
+  int num_centers, num_rows, num_negatives, dims;
+  long long *center_words, *row_words, *negative_words;
+  int *row_start, *num_positives, *center_bound, *row_bound, negative_bound;
+  float *center_block, *center_grad; // num_centers x dims
+  float *center_prefix;              // num_centers x dims: prefix sums of the center's own energy terms
+  float *row_block, *row_grad;       // num_rows x dims
+  float *probs, *sums;               // num_rows x dims: e^(-E) and their suffix sums
+  float *negative_rows;              // num_negatives x dims, as gathered
+  float *negative_block, *negative_grad, *negative_prefix; // dims x num_negatives
+  float *negative_probs, *negative_sums; // num_centers x dims x num_negatives
+  long long *keys;                   // -shardVocab: the centers', the rows' then the negatives' keys, see shards.h
+  float **dest;                      // -shardVocab: and their packed rows
+} MiniBatch;
+
+MiniBatch *batch_alloc(int max_centers) {
+  MiniBatch *mb = (MiniBatch *) calloc(1, sizeof(MiniBatch));
+  long long max_rows = (long long)max_centers * 2 * window, N = negative > 0 ? negative : 1;
+  mb->center_words = (long long *) calloc(max_centers, sizeof(long long));
+  mb->row_words = (long long *) calloc(max_rows, sizeof(long long));
+  mb->negative_words = (long long *) calloc(N, sizeof(long long));
+  mb->row_start = (int *) calloc(max_centers + 1, sizeof(int));
+  mb->num_positives = (int *) calloc(max_centers, sizeof(int));
+  mb->center_bound = (int *) calloc(max_centers, sizeof(int));
+  mb->row_bound = (int *) calloc(max_rows, sizeof(int));
+  mb->keys = (long long *) calloc(max_centers + max_rows + N, sizeof(long long));
+  mb->dest = (float **) calloc(max_centers + max_rows + N, sizeof(float *));
+  if (posix_memalign((void **)&mb->center_block, 64, 3 * max_centers * embed_max_size * sizeof(float)) ||
+      posix_memalign((void **)&mb->row_block, 64, 4 * max_rows * embed_max_size * sizeof(float)) ||
+      posix_memalign((void **)&mb->negative_rows, 64, (4 + 2 * max_centers) * N * embed_max_size * sizeof(float))) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  mb->center_grad = mb->center_block + max_centers * embed_max_size;
+  mb->center_prefix = mb->center_grad + max_centers * embed_max_size;
+  mb->row_grad = mb->row_block + max_rows * embed_max_size;
+  mb->probs = mb->row_grad + max_rows * embed_max_size;
+  mb->sums = mb->probs + max_rows * embed_max_size;
+  mb->negative_block = mb->negative_rows + N * embed_max_size;
+  mb->negative_grad = mb->negative_block + N * embed_max_size;
+  mb->negative_prefix = mb->negative_grad + N * embed_max_size;
+  mb->negative_probs = mb->negative_prefix + N * embed_max_size;
+  mb->negative_sums = mb->negative_probs + max_centers * N * embed_max_size;
+  return mb;
+}
+
+void batch_free(MiniBatch *mb) {
+  free(mb->center_words);
+  free(mb->row_words);
+  free(mb->negative_words);
+  free(mb->row_start);
+  free(mb->num_positives);
+  free(mb->center_bound);
+  free(mb->row_bound);
+  free(mb->keys);
+  free(mb->dest);
+  free(mb->center_block);
+  free(mb->row_block);
+  free(mb->negative_rows);
+  free(mb);
+}
+
+// copy the active prefix of every center, context and negative row into the packed blocks
+void batch_gather(MiniBatch *mb) {
+  int K = mb->dims, N = mb->num_negatives;
+  if (shard_client != NULL) {
+    // -shardVocab: the rows come from this process, the thread's cache or their owners
+    long long n = 0;
+    for (int b = 0; b < mb->num_centers; b++) {
+      mb->keys[n] = mb->center_words[b];
+      mb->dest[n++] = mb->center_block + b * K;
+    }
+    for (int r = 0; r < mb->num_rows; r++) {
+      mb->keys[n] = vocab_size + mb->row_words[r];
+      mb->dest[n++] = mb->row_block + r * K;
+    }
+    for (int d = 0; d < N; d++) {
+      mb->keys[n] = vocab_size + mb->negative_words[d];
+      mb->dest[n++] = mb->negative_rows + d * K;
+    }
+    shard_gather(shard_client, mb->keys, mb->dest, n, K);
+    memset(mb->center_grad, 0, mb->num_centers * K * sizeof(float));
+    memset(mb->row_grad, 0, mb->num_rows * K * sizeof(float));
+  } else {
+    for (int b = 0; b < mb->num_centers; b++) {
+      embed_load_row(mb->center_block + b * K, input_embed + mb->center_words[b] * embed_max_size, K);
+      memset(mb->center_grad + b * K, 0, K * sizeof(float));
+    }
+    for (int r = 0; r < mb->num_rows; r++) {
+      embed_load_row(mb->row_block + r * K, context_embed + mb->row_words[r] * embed_max_size, K);
+      memset(mb->row_grad + r * K, 0, K * sizeof(float));
+    }
+    for (int d = 0; d < N; d++) embed_load_row(mb->negative_rows + d * K, context_embed + mb->negative_words[d] * embed_max_size, K);
+  }
+  for (int d = 0; d < N; d++) for (int k = 0; k < K; k++) mb->negative_block[k * N + d] = mb->negative_rows[d * K + k];
+  memset(mb->negative_grad, 0, K * N * sizeof(float));
+}
+
+/*
+  e^(-E(w,c,z)) with suffix sums over z for every pair, normalized per
+  center by the caller.  Each positive pair is scored once, row by row.
+  The negatives are scored against all centers as E = W + C - D: W and C
+  are the prefix sums of the center's and the negative's own terms, D the
+  prefix dot products, accumulated for BATCH_TILE centers at a time so each
+  dimension of the negative block is loaded once per tile.
+*/
+void batch_energies(MiniBatch *mb) {
+  int K = mb->dims, N = mb->num_negatives, B = mb->num_centers;
+  float tail_factor = dim_penalty / (dim_penalty - 1.0);
+  float *negative_prefix = mb->negative_prefix;
+  for (int k = 0; k < K - 1; k++) {
+    float *c = mb->negative_block + k * N, *prefix = negative_prefix + k * N;
+    for (int d = 0; d < N; d++) prefix[d] = (k > 0 ? prefix[d - N] : 0) + log_dim_penalty + sparsity_per_dim[k] * c[d]*c[d];
+  }
+  for (int b = 0; b < B; b++) {
+    float *w = mb->center_block + b * K, *prefix = mb->center_prefix + b * K;
+    float energy = 0.0;
+    for (int k = 0; k < K - 1; k++) {
+      energy += sparsity_per_dim[k] * w[k]*w[k];
+      prefix[k] = energy;
+    }
+  }
+  for (int b0 = 0; b0 < B; b0 += BATCH_TILE) {
+    int tile = B - b0 < BATCH_TILE ? B - b0 : BATCH_TILE;
+    float dot[BATCH_TILE * N + 1];
+    memset(dot, 0, sizeof(dot));
+    for (int k = 0; k < K - 1; k++) {
+      float *c = mb->negative_block + k * N, *c_prefix = negative_prefix + k * N;
+      for (int t = 0; t < tile; t++) {
+        float wk = mb->center_block[(b0 + t) * K + k], w_prefix = mb->center_prefix[(b0 + t) * K + k];
+        float *acc = dot + t * N, *dist = mb->negative_probs + ((long long)(b0 + t) * K + k) * N;
+        for (int d = 0; d < N; d++) {
+          acc[d] += wk * c[d];
+          dist[d] = w_prefix + c_prefix[d] - acc[d];
+        }
+      }
+    }
+  }
+
+  for (int b = 0; b < B; b++) {
+    float *w = mb->center_block + b * K, *dist = mb->negative_probs + (long long)b * K * N;
+    float max_value = 0.0;
+    // the tail at l+1 has the energy through l
+    for (int d = 0; d < N; d++) dist[(K-1) * N + d] = K > 1 ? dist[(K-2) * N + d] : 0.0;
+    for (long long i = 0; i < (long long)K * N; i++) if (-dist[i] > max_value) max_value = -dist[i];
+    for (int r = mb->row_start[b]; r < mb->row_start[b+1]; r++) {
+      float *c = mb->row_block + r * K, *row = mb->probs + r * K;
+      float energy = 0.0;
+      for (int k = 0; k < K - 1; k++) {
+        energy += -w[k]*c[k] + log_dim_penalty + sparsity_per_dim[k] * (w[k]*w[k] + c[k]*c[k]);
+        row[k] = energy;
+      }
+      row[K-1] = energy;
+      for (int k = 0; k < K; k++) if (-row[k] > max_value) max_value = -row[k];
+    }
+    for (int r = mb->row_start[b]; r < mb->row_start[b+1]; r++) {
+      float *row = mb->probs + r * K, *sums = mb->sums + r * K;
+      float sum = 0.0;
+      exp_affine(row, K, -1.0/temperature, -max_value/temperature);
+      row[K-1] *= tail_factor;
+      for (int k = K - 1; k >= 0; k--) {
+        sum += row[k];
+        sums[k] = sum;
+      }
+    }
+    float *sums = mb->negative_sums + (long long)b * K * N;
+    exp_affine(dist, (long long)K * N, -1.0/temperature, -max_value/temperature);
+    for (int d = 0; d < N; d++) {
+      dist[(K-1) * N + d] *= tail_factor;
+      sums[(K-1) * N + d] = dist[(K-1) * N + d];
+    }
+    // a center is not its own negative
+    for (int d = 0; d < N; d++) if (mb->negative_words[d] == mb->center_words[b]) {
+      for (int k = 0; k < K; k++) dist[k * N + d] = 0.0;
+      sums[(K-1) * N + d] = 0.0;
+    }
+    for (int k = K - 2; k >= 0; k--) for (int d = 0; d < N; d++) sums[k * N + d] = sums[(k+1) * N + d] + dist[k * N + d];
+  }
+}
+
+/*
+  Gradients of every center, row and negative into the packed gradient
+  blocks; same estimator as -sharedNegatives, with the negatives shared by
+  the whole batch.  Samples z per positive and grows the model as needed.
+  Returns the summed -log p(c|w) over the batch's positives.
+*/
+float batch_gradients(MiniBatch *mb, long id, int *z_samples, float *prob_z_given_w_c, float *sum_prob_z_given_w_c,
+  Rng *rng) {
+  int K = mb->dims, N = mb->num_negatives;
+  float loss = 0.0;
+  mb->negative_bound = 0;
+  for (int b = 0; b < mb->num_centers; b++) {
+    float *w = mb->center_block + b * K, *w_grad = mb->center_grad + b * K;
+    float *negative_sums = mb->negative_sums + (long long)b * K * N;
+    int first = mb->row_start[b], last = mb->row_start[b+1];
+    float negative_mass = 0.0, inv_norm_sum = 0.0, inv_norm_sum_grown = 0.0;
+    for (int d = 0; d < N; d++) negative_mass += negative_sums[d];
+    mb->center_bound[b] = K - 1;
+
+    for (int p = first; p < last; p++) {
+      float *c = mb->row_block + p * K, *c_grad = mb->row_grad + p * K;
+      float row_mass = mb->sums[p * K];
+      float inv_norm = 1.0 / (row_mass + negative_mass);
+      for (int z = 0; z < K; z++) {
+        prob_z_given_w_c[z] = mb->probs[p * K + z] / row_mass;
+        sum_prob_z_given_w_c[z] = mb->sums[p * K + z] / row_mass;
+      }
+      int z_max = sample_from_mult_list(prob_z_given_w_c, K, z_samples, num_z_samples, rng);
+      if (z_max == K && z_max < embed_max_size) expand_embedding(id, K - 1);
+      mb->row_bound[p] = (z_max == K) ? K : K - 1;
+      if (mb->row_bound[p] > mb->center_bound[b]) mb->center_bound[b] = mb->row_bound[p];
+      inv_norm_sum += inv_norm;
+      if (z_max == K) inv_norm_sum_grown += inv_norm;
+
+      float log_prob_ck_given_w = log_fast(row_mass * inv_norm + epsilon);
+      // -exactZGrad: E_z[1(j < z)] = P(z > j), so the sampled term folds into the dimension term's weight
+      float z_grad_weight = exact_z_grad ? -1.0 : log_prob_ck_given_w - 1;
+      // SUM OVER THE SAMPLED Z's
+      if (!exact_z_grad) for (int m = 0; m < num_z_samples; m++) {
+        for (int j = 0; j < z_samples[m]; j++) {
+          c_grad[j] += (1.0/num_z_samples) * -log_prob_ck_given_w * (w[j] - sparsity_per_dim[j] * 2*c[j]);
+          w_grad[j] += (1.0/num_z_samples) * -log_prob_ck_given_w * (c[j] - sparsity_per_dim[j] * 2*w[j]);
+        }
+      }
+      // DIMENSION GRADIENT AND POSITIVE PART OF THE NORMALIZATION GRADIENT
+      for (int j = 0; j < mb->row_bound[p]; j++) {
+        float coef = z_grad_weight * sum_prob_z_given_w_c[j] + mb->sums[p * K + j] * inv_norm;
+        c_grad[j] += coef * (w[j] - sparsity_per_dim[j] * 2*c[j]);
+        w_grad[j] += coef * (c[j] - sparsity_per_dim[j] * 2*w[j]);
+      }
+      loss += -log_prob_ck_given_w;
+    }
+
+    // NEGATIVES: each positive's normalizer rescales the same suffix sums; across the negatives innermost
+    for (int j = 0; j < mb->center_bound[b]; j++) {
+      float scale = (j < K - 1) ? inv_norm_sum : inv_norm_sum_grown, two_sparsity = 2 * sparsity_per_dim[j];
+      float *c = mb->negative_block + j * N, *c_grad = mb->negative_grad + j * N, *weights = negative_sums + j * N;
+      float w_term = 0.0, total = 0.0;
+      for (int d = 0; d < N; d++) {
+        float weight = weights[d] * scale;
+        c_grad[d] += weight * (w[j] - two_sparsity * c[d]);
+        w_term += weight * c[d];
+        total += weight;
+      }
+      w_grad[j] += w_term - two_sparsity * w[j] * total;
+    }
+    if (mb->center_bound[b] > mb->negative_bound) mb->negative_bound = mb->center_bound[b];
+  }
+  return loss;
+}
+
+// apply the packed gradients to the shared tables
+void batch_scatter(MiniBatch *mb, float *lr_per_dim) {
+  int K = mb->dims, N = mb->num_negatives;
+  if (shard_client != NULL) {
+    // -shardVocab: SGD steps, to this process's rows or the pending deltas of other shards' rows
+    float *delta = mb->probs;  // free once the gradients are computed
+    for (int b = 0; b < mb->num_centers; b++) {
+      for (int j = 0; j < mb->center_bound[b]; j++) delta[j] = -lr_per_dim[j] / temperature * mb->center_grad[b * K + j];
+      shard_add(shard_client, mb->center_words[b], delta, mb->center_bound[b]);
+    }
+    for (int r = 0; r < mb->num_rows; r++) {
+      for (int j = 0; j < mb->row_bound[r]; j++) delta[j] = -lr_per_dim[j] / temperature * mb->row_grad[r * K + j];
+      shard_add(shard_client, vocab_size + mb->row_words[r], delta, mb->row_bound[r]);
+    }
+    for (int d = 0; d < N; d++) {
+      for (int j = 0; j < mb->negative_bound; j++) delta[j] = -lr_per_dim[j] / temperature * mb->negative_grad[j * N + d];
+      shard_add(shard_client, vocab_size + mb->negative_words[d], delta, mb->negative_bound);
+    }
+    return;
+  }
+  for (int b = 0; b < mb->num_centers; b++) {
+    long long w_idx = mb->center_words[b] * embed_max_size;
+    for (int j = 0; j < mb->center_bound[b]; j++) {
+      check_value(mb->center_grad[b * K + j], "input_gradient", j);
+      update_param(input_embed, input_grad_moment1, input_grad_moment2, input_adam_update_counter, w_idx + j,
+        lr_per_dim[j], (1.0/temperature) * mb->center_grad[b * K + j]);
+    }
+  }
+  for (int r = 0; r < mb->num_rows; r++) {
+    long long c_idx = mb->row_words[r] * embed_max_size;
+    for (int j = 0; j < mb->row_bound[r]; j++) {
+      check_value(mb->row_grad[r * K + j], "context_gradient", j);
+      update_param(context_embed, context_grad_moment1, context_grad_moment2, context_adam_update_counter, c_idx + j,
+        lr_per_dim[j], (1.0/temperature) * mb->row_grad[r * K + j]);
+    }
+  }
+  for (int d = 0; d < N; d++) {
+    long long c_idx = mb->negative_words[d] * embed_max_size;
+    for (int j = 0; j < mb->negative_bound; j++) {
+      check_value(mb->negative_grad[j * N + d], "context_gradient", j);
+      update_param(context_embed, context_grad_moment1, context_grad_moment2, context_adam_update_counter, c_idx + j,
+        lr_per_dim[j], (1.0/temperature) * mb->negative_grad[j * N + d]);
+    }
+  }
+}
+
+// -stream: replace the output files with the current vectors, via a rename so readers never see a partial file
+void PublishVectors() {
+  char tmp_file[MAX_STRING + 8];
+  long long rows = __atomic_load_n(&stream_published_size, __ATOMIC_ACQUIRE);
+  sprintf(tmp_file, "%s.tmp", output_file);
+  save_vectors(tmp_file, rows, embed_current_size, vocab, input_embed);
+  rename(tmp_file, output_file);
+  if (strlen(context_output_file) > 0) {
+    sprintf(tmp_file, "%s.tmp", context_output_file);
+    save_vectors(tmp_file, rows, embed_current_size, vocab, context_embed);
+    rename(tmp_file, context_output_file);
+  }
+  if (debug_mode > 0) printf("Published %lld words, %lld dims to %s\n", rows, embed_current_size, output_file);
+}
+
+/*
+  one negative word from the unigram table, given 32 random bits; -1 (none)
+  while -stream has published no word besides </s>, since the fallback may
+  only pick rows that are initialized
+*/
+long long negative_from_bits(unsigned int bits, Rng *rng) {
+  long long negative_word = __atomic_load_n(&table, __ATOMIC_ACQUIRE)[rng_scale(bits, table_size)];
+  if (negative_word == 0) {
+    long long rows = stream ? __atomic_load_n(&stream_published_size, __ATOMIC_ACQUIRE) : vocab_size;
+    if (rows < 2) return -1;
+    negative_word = rng_below(rng, rows - 1) + 1;
+  }
+  return negative_word;
+}
+
+/*
+  Negatives are drawn one step ahead: dest gets the count words drawn for
+  this step into ahead (redrawn if one is the positive word or none), then
+  the next step's are drawn, as one batch of random bits, and the first
+  dims values of their rows prefetched, so those rows arrive while this
+  step computes
+*/
+void next_negatives(long long *dest, long long *ahead, int count, long long word, embed_t *rows, int dims, Rng *rng) {
+  unsigned int bits[count];
+  rng_fill(rng, bits, count);
+  for (int d = 0; d < count; d++) {
+    dest[d] = ahead[d];
+    while (dest[d] == word || dest[d] < 0) dest[d] = negative_from_bits(rng_next(rng), rng);
+    ahead[d] = negative_from_bits(bits[d], rng);
+    if (rows != NULL && ahead[d] >= 0) embed_prefetch_row(rows + ahead[d] * embed_max_size, dims);
+    if (sync_touched != NULL && !sync_touched[dest[d]]) sync_touched[dest[d]] = 1;
+  }
+}
+
+// per-dimension learning rates and the Beta CDF sweep position for the words trained so far
+void UpdateLearningRates() {
+  // -stream has no end to anneal towards: learning rates stay at their starting values
+  if (stream) return;
+  if (learning_rate_flag == 1) {
+    for (long long c = 0; c < embed_current_size; c++) {
+      alpha_per_dim[c] = starting_alpha * (1 - (word_count_actual - alpha_count_adjustment[c]) / (real)(iter * train_words - alpha_count_adjustment[c] + 1));
+      if (alpha_per_dim[c] < starting_alpha * 0.0001) alpha_per_dim[c] = starting_alpha * 0.0001;
+    }
+  }
+  else if (learning_rate_flag == 2) M = (int)((word_count_actual / (real)(iter * train_words + 1)) * embed_current_size);
+}
+
+/*
+  -deterministic: the barrier that ends every chunk.  While the threads
+  train a chunk nothing writes the shared tables; here each thread merges
+  the rows it owns from all threads' buffers, in thread order, then thread
+  0 grows the model if any thread sampled the new dimension and updates
+  the learning rates.  words: the thread's corpus words since its last
+  barrier; done: it is out of sentences.  Returns 0 once every thread is.
+*/
+int ChunkBarrier(long id, long long words, int done) {
+  long long start = telemetry_now_ns();
+  __atomic_add_fetch(&word_count_actual, words, __ATOMIC_RELAXED);
+  if (done) __atomic_sub_fetch(&chunk_running, 1, __ATOMIC_RELAXED);
+  pthread_barrier_wait(&chunk_barrier);
+  hot_rows_merge_owned(chunk_input_rows, num_threads, input_embed, id, num_threads);
+  hot_rows_merge_owned(chunk_context_rows, num_threads, context_embed, id, num_threads);
+  pthread_barrier_wait(&chunk_barrier);
+  hot_rows_clear(chunk_input_rows[id]);
+  hot_rows_clear(chunk_context_rows[id]);
+  if (id == 0) {
+    if (chunk_grow) {
+      alpha_count_adjustment[embed_current_size] = word_count_actual;
+      embed_current_size++;
+      telemetry_dim_growth(chunk_grow - 1, embed_current_size, word_count_actual);
+      chunk_grow = 0;
+    }
+    UpdateLearningRates();
+    chunk_any_running = chunk_running > 0;
+  }
+  pthread_barrier_wait(&chunk_barrier);
+  chunk_sync_ns[id] += telemetry_now_ns() - start;
+  return chunk_any_running;
+}
+
+// -nodes: grows to the dimensionality another process reached
+void AdoptEmbedSize(long long embed_size) {
+  long long size = embed_current_size;
+  while (size < embed_size) {
+    if (__atomic_compare_exchange_n(&embed_current_size, &size, size + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      alpha_count_adjustment[size++] = word_count_actual;
+      telemetry_dim_growth(TELEMETRY_REMOTE, size, word_count_actual);
+    }
+  }
+}
+
+/*
+  -nodes: the rows that moved away from the base since the last
+  synchronization, as deltas, into mine.  Only the touched words are
+  looked at unless full is set, as it is once training has stopped, so
+  updates that raced with an earlier clearing of a flag go out too.
+*/
+void ClusterCollect(ClusterDelta *mine, int full) {
+  long long width = embed_current_size + 1 < embed_max_size ? embed_current_size + 1 : embed_max_size;
+  float *diff = (float *) malloc(width * sizeof(float));
+  cluster_delta_reset(mine, width);
+  for (long long a = 0; a < vocab_size; a++) {
+    if (!full && !sync_touched[a]) continue;
+    sync_touched[a] = 0;
+    for (int t = 0; t < 2; t++) {
+      embed_t *live = t == 0 ? input_embed : context_embed, *base = t == 0 ? sync_input_base : sync_context_base;
+      int moved = 0;
+      for (long long i = 0; i < width; i++) {
+        diff[i] = embed_get(live, a * embed_max_size + i) - embed_get(base, a * embed_max_size + i);
+        moved |= diff[i] != 0;
+      }
+      if (!moved) continue;
+      memcpy(cluster_delta_row(mine, t * vocab_size + a), diff, width * sizeof(float));
+      mine->senders[mine->num_rows - 1] = 1;
+    }
+  }
+  free(diff);
+}
+
+// -nodes: live += merged - mine and base += merged, row by row; the threads keep training meanwhile
+void ClusterApply(ClusterDelta *mine, ClusterDelta *merged) {
+  for (long long s = 0; s < merged->num_rows; s++) {
+    long long id = merged->row[s], a = id % vocab_size, own = mine->slot[id];
+    embed_t *live = id < vocab_size ? input_embed : context_embed, *base = id < vocab_size ? sync_input_base : sync_context_base;
+    for (long long i = 0; i < merged->width; i++) {
+      float delta = merged->value[s * merged->width + i];
+      float sent = own >= 0 && i < mine->width ? mine->value[own * mine->width + i] : 0;
+      embed_add(live, a * embed_max_size + i, delta - sent);
+      embed_add(base, a * embed_max_size + i, delta);
+    }
+  }
+}
+
+/*
+  -nodes: synchronizes with the other processes every sync_words local
+  corpus words, and keeps doing so after the threads have finished until
+  every process has
+*/
+void *ClusterSyncThread(void *unused) {
+  ClusterDelta *mine = cluster_delta_new(2 * vocab_size), *merged = cluster_delta_new(2 * vocab_size);
+  long long last_words = 0;
+  while (1) {
+    struct timespec pause = {0, 10000000};
+    while (!__atomic_load_n(&sync_training_done, __ATOMIC_ACQUIRE) &&
+           word_count_actual - sync_remote_words - last_words < sync_words) nanosleep(&pause, NULL);
+    long long start = telemetry_now_ns();
+    int done = __atomic_load_n(&sync_training_done, __ATOMIC_ACQUIRE);
+    ClusterHeader h = {word_count_actual - sync_remote_words, embed_current_size, done, 0, 0};
+    last_words = h.words;
+    ClusterCollect(mine, done);
+    cluster_exchange(cluster, &h, mine, merged);
+    ClusterApply(mine, merged);
+    AdoptEmbedSize(h.embed_size);
+    __atomic_add_fetch(&word_count_actual, h.words - last_words - sync_remote_words, __ATOMIC_RELAXED);
+    sync_remote_words = h.words - last_words;
+    sync_rounds++;
+    sync_time_ns += telemetry_now_ns() - start;
+    if (h.done) {
+      // nothing trains any more: live and base differ by rounding only, and the bases are the same everywhere
+      memcpy(input_embed, sync_input_base, vocab_size * embed_max_size * sizeof(embed_t));
+      memcpy(context_embed, sync_context_base, vocab_size * embed_max_size * sizeof(embed_t));
+      break;
+    }
+  }
+  cluster_delta_free(mine);
+  cluster_delta_free(merged);
+  return NULL;
+}
+
+// learning rate shown in progress reports
+float current_alpha() {
+  float lr = alpha;
+  if (learning_rate_flag == 1) lr = alpha_per_dim[embed_current_size-1];
+  else if (learning_rate_flag == 2) lr = alpha * gsl_cdf_beta_P(1.0/(embed_current_size+1.0), (M+0.01)/embed_current_size, (embed_current_size - M + 0.01)/embed_current_size);
+  return lr;
+}
+
 void *TrainModelThread(void *thread_id) {
   // get thread arguments
   long id = (long) thread_id;
 
-  long long a, b, d, word, last_word, negative_word, sentence_length = 0, sentence_position = 0;
+  long long a, b, d, word, last_word, sentence_length = 0, sentence_position = 0;
   long long word_count = 0, last_word_count = 0, sen[MAX_SENTENCE_LENGTH + 1];
-  long long input_word_position, context_word_position, z_max, c, local_iter = iter;
+  long long input_word_position, context_word_position, z_max, c;
   float log_prob_per_word = 0;
-  unsigned long long next_random = (long long)id;
-  clock_t now;
+  // stochastic rounding bits of -DEMBED_FP16/-DEMBED_BF16 updates, keyed by -seed like the other streams
+  Rng round_rng;
+  rng_seed(&round_rng, seed, RNG_ROUND_STREAM | ThreadStream(id), 0, 0);
+  embed_round_seed(rng_next(&round_rng));
 
-  // open corpus file and seek to thread's position in it
-  FILE *fi = fopen(train_file, "rb");
-  fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
+  // -stream threads share one queue, file training gives every thread its own
+  SentenceQueue *queue = stream ? &stream_queue : train_queues + id;
   
-  // set up random number generator
-  const gsl_rng_type * T2;
-  gsl_rng * r2;
-  srand(time(NULL));
-  unsigned int Seed2 = rand();
-  gsl_rng_env_setup();
-  T2 = gsl_rng_default;
-  r2 = gsl_rng_alloc (T2);
-  gsl_rng_set (r2, Seed2);
+  // random number generator: window sizes, negatives and z samples of the thread's n-th sentence come
+  // from stream (seed, id, 0, n); the negatives drawn ahead of the first from chunk 0
+  Rng rng;
+  long long sentence_count = 0;
+  rng_seed(&rng, seed, ThreadStream(id), 0, 0);
 
   int *z_samples = (int *) calloc(num_z_samples, sizeof(int)); // M-sized array of sampled z values
   long long *context_list = (long long *) calloc(negative + 1, sizeof(long long));
+  // the next step's negatives, see next_negatives
+  long long *negatives_ahead = (long long *) calloc(negative, sizeof(long long));
+  if (!hs) for (d = 0; d < negative; d++) negatives_ahead[d] = negative_from_bits(rng_next(&rng), &rng);
   // terms needed for p(z|w,c)
   float *prob_z_given_w_c = (float *) calloc(embed_max_size, sizeof(float));
   float *sum_prob_z_given_w_c = (float *) calloc(embed_max_size, sizeof(float));
@@ -576,75 +1413,271 @@ void *TrainModelThread(void *thread_id) {
   float *input_gradient_accumulator = (float *) calloc(embed_max_size, sizeof(float)); // stores input (w_i) gradient across z samples
   float *input_gradient = (float *) calloc(embed_max_size, sizeof(float)); // stores the d log p(z | w) / d w gradient
   float *pos_context_gradient = (float *) calloc(embed_max_size, sizeof(float)); // stores positive context gradients across z samples
+  float *lr_per_dim = (float *) calloc(embed_max_size, sizeof(float));
+  // terms needed for the hierarchical softmax objective
+  float *log_p_z_given_w = NULL, *path_logits = NULL;
+  if (hs) {
+    log_p_z_given_w = (float *) calloc(embed_max_size, sizeof(float));
+    path_logits = (float *) calloc(MAX_CODE_LENGTH * embed_max_size, sizeof(float));
+  }
+  // terms needed for shared negatives: rows are the window's positives followed by the negatives
+  long long *window_rows = NULL;
+  float *window_probs = NULL, *window_sums = NULL;
+  if (shared_negatives) {
+    window_rows = (long long *) calloc(2 * window + negative, sizeof(long long));
+    window_probs = (float *) calloc((2 * window + negative) * embed_max_size, sizeof(float));
+    window_sums = (float *) calloc((2 * window + negative) * embed_max_size, sizeof(float));
+  }
+  MiniBatch *batch = NULL;
+  if (batch_size > 1 && !hs) batch = batch_alloc(batch_size);
+  long long last_merge_count = 0, chunk_steps = 0, thread_start = telemetry_now_ns(), shard_batches = 0;
+  shard_client = shard_vocab ? shard_clients[id] : NULL;
+  if (deterministic) {
+    hot_input_rows = chunk_input_rows[id];
+    hot_context_rows = chunk_context_rows[id];
+  } else if (hot_rows > 0) {
+    long long rows = stream ? stream_vocab_size : vocab_size;
+    if (hot_rows < rows) rows = hot_rows;
+    hot_input_rows = hot_rows_new(rows, embed_max_size, rows);
+    if (!hs) hot_context_rows = hot_rows_new(rows, embed_max_size, rows);
+  }
 
-  float train_log_probability = 0.0;  // track if model is learning 
+  ThreadTelemetry *telemetry = telemetry_threads + id;
+  long long phase_mark = 0;
   while (1) {
     // track training progress
-    if (word_count - last_word_count > 20000) { // TODO: lowered for debugging
-      long long diff = word_count - last_word_count;
-      word_count_actual += word_count - last_word_count;
+    // -deterministic does this at the chunk barriers
+    if (!deterministic && word_count - last_word_count > 20000) { // TODO: lowered for debugging
+      __atomic_add_fetch(&word_count_actual, word_count - last_word_count, __ATOMIC_RELAXED);
       last_word_count = word_count;
-      if (learning_rate_flag == 1){
-        for (c = 0; c < embed_current_size; c++){
-          alpha_per_dim[c] = starting_alpha * (1 - (word_count_actual - alpha_count_adjustment[c]) / (real)(iter * train_words - alpha_count_adjustment[c] + 1));
-          if (alpha_per_dim[c] < starting_alpha * 0.0001) alpha_per_dim[c] = starting_alpha * 0.0001;
-        }
-      }
-      else if (learning_rate_flag == 2) M = (int)((word_count_actual / (real)(iter * train_words + 1)) * embed_current_size);
-      if ((debug_mode > 1)) {
-        now=clock();
-	float lr = alpha;
-	if (learning_rate_flag == 1) lr = alpha_per_dim[embed_current_size-1];
-	else if (learning_rate_flag == 2) lr = alpha * gsl_cdf_beta_P(1.0/(embed_current_size+1.0), (M+0.01)/embed_current_size, (embed_current_size - M + 0.01)/embed_current_size);
-        printf("%cAlpha: %f  Progress: %.2f%%  Words/thread/sec: %.2fk  ", 13, lr,
-	       word_count_actual / (real)(iter * train_words + 1) * 100,
-	       word_count_actual / ((real)(now - start + 1) / (real)CLOCKS_PER_SEC * 1000));
-	global_loss_diff += diff;
-	global_train_loss += train_log_probability;
-        printf("loss: %f  ", global_train_loss / global_loss_diff);
-	printf("curr dim: %lld\n", embed_current_size);	
-        fflush(stdout);
-        train_log_probability = 0.0;
-      }
+      UpdateLearningRates();
+    }
+    if (deterministic && chunk_steps >= chunk_size) {
+      telemetry_mark(&phase_mark);
+      ChunkBarrier(id, word_count - last_word_count, 0);
+      last_word_count = word_count;
+      chunk_steps = 0;
+      telemetry_phase(telemetry, PHASE_SYNC, &phase_mark);
     }
     // read a new sentence / line
     if (sentence_length == 0) {
-      while (1) {
-        word = ReadWordIndex(fi);
-        if (feof(fi)) break;
-        if (word == -1) continue;
-        word_count++;
-        if (word == 0) break;
-        // The subsampling randomly discards frequent words while keeping the ranking the same
-        if (sample > 0) {
-          real ran = (sqrt(vocab[word].cn / (sample * train_words)) + 1) * (sample * train_words) / vocab[word].cn;
-          next_random = next_random * (unsigned long long)25214903917 + 11;
-          if (ran < (next_random & 0xFFFF) / (real)65536) continue;
-        }
-        sen[sentence_length] = word;
-        sentence_length++;
-        if (sentence_length >= MAX_SENTENCE_LENGTH) break;
+      long long sentence_start_count = word_count;
+      telemetry_mark(&phase_mark);
+      long long sentence_words;
+      if (!sentence_queue_pop(queue, sen, &sentence_length, &sentence_words)) {
+        if (deterministic) {
+          // keep meeting the other threads at the barriers until they are out of sentences too
+          if (ChunkBarrier(id, word_count - last_word_count, 1)) while (ChunkBarrier(id, 0, 0));
+          telemetry_phase(telemetry, PHASE_SYNC, &phase_mark);
+        } else __atomic_add_fetch(&word_count_actual, word_count - last_word_count, __ATOMIC_RELAXED);
+        break;
       }
+      word_count += sentence_words;
       sentence_position = 0;
+      rng_seed(&rng, seed, ThreadStream(id), 0, ++sentence_count);
+      if (sync_touched != NULL) for (a = 0; a < sentence_length; a++) if (!sync_touched[sen[a]]) sync_touched[sen[a]] = 1;
+      if (!deterministic && word_count - last_merge_count >= hot_merge) {
+        hot_rows_merge(hot_input_rows, input_embed);
+        hot_rows_merge(hot_context_rows, context_embed);
+        last_merge_count = word_count;
+      }
+      telemetry_add_words(telemetry, word_count - sentence_start_count);
+      telemetry_phase(telemetry, PHASE_READ, &phase_mark);
     }
-    // if EOF, reset to beginning
-    if (feof(fi) || (word_count > train_words / num_threads)) {
-      word_count_actual += word_count - last_word_count;
-      local_iter--;
-      if (local_iter == 0) break;
-      word_count = 0;
-      last_word_count = 0;
-      sentence_length = 0;
-      fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
+    
+    if (batch != NULL) {
+      // MINIBATCH: the next batch_size center words of this sentence
+      telemetry_mark(&phase_mark);
+      batch->dims = embed_current_size + 1;
+      batch->num_centers = batch->num_rows = 0;
+      while (batch->num_centers < batch_size && sentence_position < sentence_length) {
+	word = sen[sentence_position];
+	sentence_position++;
+	b = rng_below(&rng, window);
+	int first_row = batch->num_rows;
+	for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
+	  c = sentence_position - 1 - window + a;
+	  if (c < 0) continue;
+	  if (c >= sentence_length) break;
+	  if (sen[c] == -1) continue;
+	  batch->row_words[batch->num_rows++] = sen[c];
+	}
+	if (batch->num_rows == first_row) continue;
+	batch->num_positives[batch->num_centers] = batch->num_rows - first_row;
+	batch->center_words[batch->num_centers] = word;
+	batch->row_start[batch->num_centers] = first_row;
+	batch->num_centers++;
+	batch->row_start[batch->num_centers] = batch->num_rows;
+      }
+      if (batch->num_centers == 0) {
+        sentence_length = 0;
+        continue;
+      }
+      // one negative block for the whole batch; batch_energies skips a center's own word
+      next_negatives(batch->negative_words, negatives_ahead, negative, -1, shard_vocab ? NULL : context_embed, batch->dims, &rng);
+      batch->num_negatives = negative;
+      chunk_steps += batch->num_centers;
+      for (c = 0; c < batch->dims; c++) {
+	lr_per_dim[c] = alpha;
+	if (learning_rate_flag == 1) lr_per_dim[c] = alpha_per_dim[c];
+	else if (learning_rate_flag == 2) lr_per_dim[c] = alpha * gsl_cdf_beta_P((c+1.0)/(embed_current_size+1), (M+0.01)/embed_current_size, (embed_current_size - M + 0.01)/embed_current_size);
+      }
+      batch_gather(batch);
+      if (shard_client != NULL) telemetry_phase(telemetry, PHASE_SYNC, &phase_mark);
+      batch_energies(batch);
+      telemetry_phase(telemetry, PHASE_PREDICTION, &phase_mark);
+      float batch_loss = batch_gradients(batch, id, z_samples, prob_z_given_w_c, sum_prob_z_given_w_c, &rng);
+      batch_scatter(batch, lr_per_dim);
+      telemetry_add_loss(telemetry, batch_loss, batch->num_rows);
+      telemetry_phase(telemetry, PHASE_UPDATE, &phase_mark);
+      if (shard_client != NULL && ++shard_batches % shard_flush_batches == 0) {
+        shard_flush(shard_client);
+        telemetry_phase(telemetry, PHASE_SYNC, &phase_mark);
+      }
+      if (sentence_position >= sentence_length) sentence_length = 0;
       continue;
     }
-    
+
     // start of training, get current word (w)
+    chunk_steps++;
     word = sen[sentence_position];
     input_word_position = word * embed_max_size;
+    // the next position's center row and the context row entering its window
+    if (sentence_position + 1 < sentence_length && sen[sentence_position + 1] >= 0)
+      embed_prefetch_row(input_embed + sen[sentence_position + 1] * embed_max_size, embed_current_size + 1);
+    if (!hs && sentence_position + window + 1 < sentence_length && sen[sentence_position + window + 1] >= 0)
+      embed_prefetch_row(context_embed + sen[sentence_position + window + 1] * embed_max_size, embed_current_size + 1);
     
-    next_random = next_random * (unsigned long long)25214903917 + 11;
-    b = next_random % window; // Samples(!) window size 
+    b = rng_below(&rng, window); // Samples(!) window size 
+
+    if (shared_negatives && !hs) {
+      // SHARED NEGATIVES: one negative set for the center word, scored against every positive in the window
+      int local_embed_size_plus_one = embed_current_size + 1;
+      int num_positives = 0;
+      for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
+	c = sentence_position - window + a;
+	if (c < 0) continue;
+	if (c >= sentence_length) break;
+	if (sen[c] == -1) continue;
+	window_rows[num_positives] = sen[c];
+	num_positives++;
+      }
+      if (num_positives > 0) {
+	telemetry_mark(&phase_mark);
+	next_negatives(window_rows + num_positives, negatives_ahead, negative, word, context_embed, local_embed_size_plus_one, &rng);
+	int num_rows = num_positives + negative;
+
+	// energies of every (w, row) pair as one (num_rows x l+1) block
+	for (c = 0; c < num_rows * local_embed_size_plus_one; c++) window_probs[c] = 0.0;
+	float max_value = 0.0;
+	for (int r = 0; r < num_rows; r++) {
+	  float temp_value = compute_z_dist(window_probs + r * local_embed_size_plus_one, input_word_position,
+	    window_rows[r] * embed_max_size, local_embed_size_plus_one - 1);
+	  if (r == 0 || temp_value > max_value) max_value = temp_value;
+	}
+	// exponentiate and keep suffix sums per row; window_sums[r * (l+1)] is then the row's mass
+	for (int r = 0; r < num_rows; r++) {
+	  float *row = window_probs + r * local_embed_size_plus_one;
+	  float sum = 0.0;
+	  exp_affine(row, local_embed_size_plus_one, -1.0/temperature, -max_value/temperature);
+	  row[local_embed_size_plus_one-1] *= dim_penalty / (dim_penalty - 1.0);
+	  for (int z = local_embed_size_plus_one - 1; z >= 0; z--) {
+	    sum += row[z];
+	    window_sums[r * local_embed_size_plus_one + z] = sum;
+	  }
+	}
+	float negative_mass = 0.0;
+	for (int r = num_positives; r < num_rows; r++) negative_mass += window_sums[r * local_embed_size_plus_one];
+	telemetry_phase(telemetry, PHASE_PREDICTION, &phase_mark);
+
+	for (c = 0; c < local_embed_size_plus_one; c++) {
+	  input_gradient[c] = 0.0;
+	  lr_per_dim[c] = alpha;
+	  if (learning_rate_flag == 1) lr_per_dim[c] = alpha_per_dim[c];
+	  else if (learning_rate_flag == 2) lr_per_dim[c] = alpha * gsl_cdf_beta_P((c+1.0)/(embed_current_size+1), (M+0.01)/embed_current_size, (embed_current_size - M + 0.01)/embed_current_size);
+	}
+	// sum of 1/normalizer over positives; the second only over positives that sampled the new dimension
+	float inv_norm_sum = 0.0, inv_norm_sum_grown = 0.0;
+	int window_bound = local_embed_size_plus_one - 1;
+	log_prob_per_word = 0.0;
+	for (int p = 0; p < num_positives; p++) {
+	  last_word = window_rows[p];
+	  context_word_position = last_word * embed_max_size;
+	  float row_mass = window_sums[p * local_embed_size_plus_one];
+	  float inv_norm = 1.0 / (row_mass + negative_mass);
+
+	  // p(z|w,c) is the positive's own row renormalized
+	  for (int z = 0; z < local_embed_size_plus_one; z++) {
+	    prob_z_given_w_c[z] = window_probs[p * local_embed_size_plus_one + z] / row_mass;
+	    sum_prob_z_given_w_c[z] = window_sums[p * local_embed_size_plus_one + z] / row_mass;
+	    pos_context_gradient[z] = 0.0;
+	  }
+	  z_max = sample_from_mult_list(prob_z_given_w_c, local_embed_size_plus_one, z_samples, num_z_samples, &rng);
+	  if (z_max == local_embed_size_plus_one && z_max < embed_max_size) expand_embedding(id, local_embed_size_plus_one - 1);
+	  int loop_bound = local_embed_size_plus_one - 1;
+	  if (z_max == local_embed_size_plus_one) loop_bound = local_embed_size_plus_one;
+	  if (loop_bound > window_bound) window_bound = loop_bound;
+	  inv_norm_sum += inv_norm;
+	  if (loop_bound == local_embed_size_plus_one) inv_norm_sum_grown += inv_norm;
+
+	  float log_prob_ck_given_w = log_fast(row_mass * inv_norm + epsilon);
+	  float context_E_grad = 0.0;
+	  float input_word_E_grad = 0.0;
+	  // -exactZGrad: E_z[1(j < z)] = P(z > j), so the sampled term folds into the dimension term's weight
+	  float z_grad_weight = exact_z_grad ? -1.0 : log_prob_ck_given_w - 1;
+	  // SUM OVER THE SAMPLED Z's
+	  if (!exact_z_grad) for (int m = 0; m < num_z_samples; m++) {
+	    for (int j = 0; j < z_samples[m]; j++){
+	      context_E_grad = embed_get(input_embed, input_word_position + j) - sparsity_weight/(j+1) * 2*embed_get(context_embed, context_word_position + j);
+	      input_word_E_grad = embed_get(context_embed, context_word_position + j) - sparsity_weight/(j+1) * 2*embed_get(input_embed, input_word_position + j);
+	      pos_context_gradient[j] += (1.0/num_z_samples) * -log_prob_ck_given_w * context_E_grad;
+	      input_gradient[j] += (1.0/num_z_samples) * ( -log_prob_ck_given_w ) * input_word_E_grad;
+	    }
+	  }
+	  // DIMENSION GRADIENT AND POSITIVE PART OF THE NORMALIZATION GRADIENT
+	  for (int j = 0; j < loop_bound; j++){
+	    context_E_grad = embed_get(input_embed, input_word_position + j) - sparsity_weight/(j+1) * 2*embed_get(context_embed, context_word_position + j);
+	    input_word_E_grad = embed_get(context_embed, context_word_position + j) - sparsity_weight/(j+1) * 2*embed_get(input_embed, input_word_position + j);
+	    float sum_prob_c_z_given_w = window_sums[p * local_embed_size_plus_one + j] * inv_norm;
+	    input_gradient[j] += (z_grad_weight * sum_prob_z_given_w_c[j] + sum_prob_c_z_given_w) * input_word_E_grad;
+	    pos_context_gradient[j] += (z_grad_weight * sum_prob_z_given_w_c[j] + sum_prob_c_z_given_w) * context_E_grad;
+	  }
+	  for (int j = 0; j < loop_bound; j++){
+	    check_value(pos_context_gradient[j], "pos_context_gradient", j);
+	    update_param(context_embed, context_grad_moment1, context_grad_moment2, context_adam_update_counter, context_word_position + j,
+	      lr_per_dim[j], (1.0/temperature) * pos_context_gradient[j]);
+	  }
+	  log_prob_per_word += -log_prob_ck_given_w;
+	}
+
+	// NEGATIVES: each positive's normalizer rescales the same suffix sums, so one pass covers all of them
+	for (d = 0; d < negative; d++) {
+	  long long context_idx = window_rows[num_positives + d] * embed_max_size;
+	  for (int j = 0; j < window_bound; j++){
+	    float weight = window_sums[(num_positives + d) * local_embed_size_plus_one + j];
+	    weight *= (j < local_embed_size_plus_one - 1) ? inv_norm_sum : inv_norm_sum_grown;
+	    float context_E_grad = embed_get(input_embed, input_word_position + j) - sparsity_weight/(j+1) * 2*embed_get(context_embed, context_idx + j);
+	    float input_word_E_grad = embed_get(context_embed, context_idx + j) - sparsity_weight/(j+1) * 2*embed_get(input_embed, input_word_position + j);
+	    input_gradient[j] += weight * input_word_E_grad;
+	    check_value(weight * context_E_grad, "neg context gradient", j);
+	    update_param(context_embed, context_grad_moment1, context_grad_moment2, context_adam_update_counter, context_idx + j,
+	      lr_per_dim[j], (1.0/temperature) * weight * context_E_grad);
+	  }
+	}
+
+	// one update of the center word for the whole window
+	for (int j = 0; j < window_bound; j++){
+	  check_value(input_gradient[j], "input_gradient", j);
+	  update_param(input_embed, input_grad_moment1, input_grad_moment2, input_adam_update_counter, input_word_position + j,
+	    lr_per_dim[j], (1.0/temperature) * input_gradient[j]);
+	}
+	telemetry_add_loss(telemetry, log_prob_per_word, num_positives);
+	telemetry_phase(telemetry, PHASE_UPDATE, &phase_mark);
+      }
+      sentence_position++;
+      if (sentence_position >= sentence_length) sentence_length = 0;
+      continue;
+    }
  
     // MAIN LOOP THROUGH POSITIVE CONTEXT
     log_prob_per_word = 0.0;
@@ -660,10 +1693,6 @@ void *TrainModelThread(void *thread_id) {
       
       // lock-in value of embed_current_size for thread since its shared globally                                                    
       int local_embed_size_plus_one = embed_current_size + 1;
-      // terms needed for p(c,z|w)
-      // NOTE: intializing here because assumption is each context has local_embed_size_plus_one dims
-      float *prob_c_z_given_w = (float *) calloc(local_embed_size_plus_one * (negative + 1), sizeof(float));
-      float *sum_prob_c_z_given_w = (float *) calloc(local_embed_size_plus_one * (negative + 1), sizeof(float)); 
       // only need to initialize dimensions less than current_size + 1 since that's all it can grow                                                          
       // we'd like to do this after the last gradient update but local_embed_size_plus_one may have grew, leaving old values 
       for (c = 0; c < local_embed_size_plus_one; c++) {
@@ -673,51 +1702,94 @@ void *TrainModelThread(void *thread_id) {
 	prob_z_given_w_c[c] = 0.0;
       }
 
-      // compute p(z|w,c)
-      compute_p_z_given_w_c(prob_z_given_w_c, sum_prob_z_given_w_c, input_word_position,
-        context_word_position, local_embed_size_plus_one - 1); 
+      if (hs) {
+	// HIERARCHICAL SOFTMAX: exact expectation over z of the gradient of -log p(c|w)
+	telemetry_mark(&phase_mark);
+	float log_prob_c_given_w = compute_p_c_z_given_w_hs(word, last_word, log_p_z_given_w, path_logits,
+	  prob_z_given_w_c, local_embed_size_plus_one);
+	z_max = sample_from_mult_list(prob_z_given_w_c, local_embed_size_plus_one, z_samples, num_z_samples, &rng);
+	if (z_max == local_embed_size_plus_one && z_max < embed_max_size) expand_embedding(id, local_embed_size_plus_one - 1);
+	telemetry_phase(telemetry, PHASE_PREDICTION, &phase_mark);
+
+	int loop_bound = local_embed_size_plus_one - 1;
+	if (z_max == local_embed_size_plus_one) loop_bound = local_embed_size_plus_one;
+	for (int j = 0; j < loop_bound; j++) {
+	  lr_per_dim[j] = alpha;
+	  if (learning_rate_flag == 1) lr_per_dim[j] = alpha_per_dim[j];
+	  else if (learning_rate_flag == 2) lr_per_dim[j] = alpha * gsl_cdf_beta_P((j+1.0)/(embed_current_size+1), (M+0.01)/embed_current_size, (embed_current_size - M + 0.01)/embed_current_size);
+	}
 
-      // sample z: z_hat ~ p(z|w,c) and expand if necessary
-      // no need to normalize, function does it for us
-      z_max = sample_from_mult_list(prob_z_given_w_c, 
-                  local_embed_size_plus_one, z_samples, num_z_samples, r2);
-      if (z_max == local_embed_size_plus_one 
-              && embed_current_size < local_embed_size_plus_one 
-              && z_max < embed_max_size) {
-	alpha_count_adjustment[embed_current_size] = word_count_actual;
-	embed_current_size++;
+	// prior term: E_q[d -log p(z|w) / dw_j] = 2 lambda_j w_j (P_q(z>j) - P_prior(z>j)) / T
+	float q_tail = 0.0, prior_tail = 0.0;
+	for (int j = local_embed_size_plus_one - 1; j >= 0; j--) {
+	  q_tail += prob_z_given_w_c[j];
+	  prior_tail += exp_fast(log_p_z_given_w[j]);
+	  if (j < loop_bound) input_gradient[j] = (1.0/temperature) * sparsity_weight/(j+1) * 2*embed_get(input_embed, input_word_position + j) * (q_tail - prior_tail);
+	}
+
+	// path term: node d at dim j collects G_d(j) = sum_{z>j} q(z) d log p(c|w,z) / ds_d(z)
+	for (d = 0; d < vocab[last_word].codelen; d++) {
+	  long long node_idx = vocab[last_word].point[d] * embed_max_size;
+	  float sign = 1 - 2 * vocab[last_word].code[d];
+	  float tail_grad = 0.0;
+	  for (int j = local_embed_size_plus_one - 1; j >= 0; j--) {
+	    float y = path_logits[d * local_embed_size_plus_one + j];
+	    tail_grad += prob_z_given_w_c[j] * sign / (1.0 + exp_fast(y)) / temperature;
+	    if (j >= loop_bound) continue;
+	    input_gradient[j] -= tail_grad * node_embed[node_idx + j];
+	    node_embed[node_idx + j] += lr_per_dim[j] * tail_grad * embed_get(input_embed, input_word_position + j);
+	  }
+	}
+	for (int j = 0; j < loop_bound; j++) {
+	  check_value(input_gradient[j], "input_gradient", j);
+	  hot_rows_add(hot_input_rows, input_embed, input_word_position + j, -lr_per_dim[j] * input_gradient[j]);
+	}
+	log_prob_per_word += -log_prob_c_given_w;
+	telemetry_phase(telemetry, PHASE_UPDATE, &phase_mark);
+	continue;
       }
 
+      // terms needed for p(c,z|w)
+      // NOTE: intializing here because assumption is each context has local_embed_size_plus_one dims
+      float *prob_c_z_given_w = (float *) calloc(local_embed_size_plus_one * (negative + 1), sizeof(float));
+      float *sum_prob_c_z_given_w = (float *) calloc(local_embed_size_plus_one * (negative + 1), sizeof(float)); 
+
       // NEGATIVE SAMPLING CONTEXT WORDS
-      d = negative;
+      telemetry_mark(&phase_mark);
       context_list[0] = last_word;
-      while (d>0) {
-	context_list[d] = 0; // clear old contexts
-	next_random = next_random * (unsigned long long)25214903917 + 11;
-	negative_word = table[(next_random >> 16) % table_size];
-	if (negative_word == 0) negative_word = next_random % (vocab_size - 1) + 1;
-	if (negative_word == word || negative_word <= 0) continue; 
-	context_list[d] = negative_word;
-        d--;
-      }
+      next_negatives(context_list + 1, negatives_ahead, negative, word, context_embed, local_embed_size_plus_one, &rng);
 
       // compute p(c,z|w)
       compute_p_c_z_given_w(word, context_list, prob_c_z_given_w, sum_prob_c_z_given_w, negative+1, local_embed_size_plus_one);
+      telemetry_phase(telemetry, PHASE_PREDICTION, &phase_mark);
+
+      // compute p(z|w,c) from the positive context's row, the first one
+      compute_p_z_given_w_c(prob_z_given_w_c, sum_prob_z_given_w_c, prob_c_z_given_w, sum_prob_c_z_given_w,
+        local_embed_size_plus_one);
+
+      // sample z: z_hat ~ p(z|w,c) and expand if necessary
+      // no need to normalize, function does it for us
+      z_max = sample_from_mult_list(prob_z_given_w_c, 
+                  local_embed_size_plus_one, z_samples, num_z_samples, &rng);
+      if (z_max == local_embed_size_plus_one && z_max < embed_max_size) expand_embedding(id, local_embed_size_plus_one - 1);
+      telemetry_phase(telemetry, PHASE_POSTERIOR, &phase_mark);
  
       // compute p(c|w) 
       float log_prob_ck_given_w = 0.0;
       // NOTE: since the positive context word is in the first position of prob_c_z_given_w[idx], just used the idx
       log_prob_ck_given_w = sum_prob_c_z_given_w[0];
-      log_prob_ck_given_w = log(log_prob_ck_given_w + epsilon);
+      log_prob_ck_given_w = log_fast(log_prob_ck_given_w + epsilon);
 
       float context_E_grad = 0.0;
       float input_word_E_grad = 0.0;
+      // -exactZGrad: E_z[1(j < z)] = P(z > j), so the sampled term folds into the dimension term's weight
+      float z_grad_weight = exact_z_grad ? -1.0 : log_prob_ck_given_w - 1;
       // SUM OVER THE SAMPLED Z's
       // ONLY NEED TO CALC FOR PREDICTION PART OF GRAD
-      for (int m = 0; m < num_z_samples; m++) { 
+      if (!exact_z_grad) for (int m = 0; m < num_z_samples; m++) { 
 	for (int j = 0; j < z_samples[m]; j++){
-	  context_E_grad = input_embed[input_word_position + j] - sparsity_weight/(j+1) * 2*context_embed[context_word_position + j];
-	  input_word_E_grad = context_embed[context_word_position + j] - sparsity_weight/(j+1) * 2*input_embed[input_word_position + j];
+	  context_E_grad = embed_get(input_embed, input_word_position + j) - sparsity_weight/(j+1) * 2*embed_get(context_embed, context_word_position + j);
+	  input_word_E_grad = embed_get(context_embed, context_word_position + j) - sparsity_weight/(j+1) * 2*embed_get(input_embed, input_word_position + j);
 	  pos_context_gradient[j] += (1.0/num_z_samples) * -log_prob_ck_given_w * context_E_grad;
 	  input_gradient[j] += (1.0/num_z_samples) * ( -log_prob_ck_given_w ) * input_word_E_grad;
 	}
@@ -731,19 +1803,19 @@ void *TrainModelThread(void *thread_id) {
 
       // CALC DIMENSION GRADIENT TERM FOR POS & INPUT
       for (int j = 0; j < loop_bound; j++){
-	context_E_grad = input_embed[input_word_position + j] - sparsity_weight/(j+1) * 2*context_embed[context_word_position + j];
-	input_word_E_grad = context_embed[context_word_position + j] - sparsity_weight/(j+1) * 2*input_embed[input_word_position + j];
+	context_E_grad = embed_get(input_embed, input_word_position + j) - sparsity_weight/(j+1) * 2*embed_get(context_embed, context_word_position + j);
+	input_word_E_grad = embed_get(context_embed, context_word_position + j) - sparsity_weight/(j+1) * 2*embed_get(input_embed, input_word_position + j);
 	
-        input_gradient[j] += (log_prob_ck_given_w - 1) * sum_prob_z_given_w_c[j] * input_word_E_grad;
-	pos_context_gradient[j] += (log_prob_ck_given_w - 1) * sum_prob_z_given_w_c[j] * context_E_grad;
+        input_gradient[j] += z_grad_weight * sum_prob_z_given_w_c[j] * input_word_E_grad;
+	pos_context_gradient[j] += z_grad_weight * sum_prob_z_given_w_c[j] * context_E_grad;
       }
 
       // CALC PREDICTION NORMALIZATION GRADIENT
       for (int j = 0; j < loop_bound; j++){
 	for (d = 0; d < negative + 1; d++){
 	  long long context_idx = context_list[d]*embed_max_size;
-	  context_E_grad = input_embed[input_word_position + j] - sparsity_weight/(j+1) * 2*context_embed[context_idx + j];
-	  input_word_E_grad = context_embed[context_idx + j] - sparsity_weight/(j+1) * 2*input_embed[input_word_position + j];
+	  context_E_grad = embed_get(input_embed, input_word_position + j) - sparsity_weight/(j+1) * 2*embed_get(context_embed, context_idx + j);
+	  input_word_E_grad = embed_get(context_embed, context_idx + j) - sparsity_weight/(j+1) * 2*embed_get(input_embed, input_word_position + j);
 	  
           if (d == 0){
 	    pos_context_gradient[j] += sum_prob_c_z_given_w[d*local_embed_size_plus_one + j] * context_E_grad;
@@ -753,19 +1825,8 @@ void *TrainModelThread(void *thread_id) {
 	    if (learning_rate_flag == 1) lr = alpha_per_dim[j];
 	    else if (learning_rate_flag == 2) lr = alpha * gsl_cdf_beta_P((j+1.0)/(embed_current_size+1), (M+0.01)/embed_current_size, (embed_current_size - M + 0.01)/embed_current_size);
 	    check_value((sum_prob_c_z_given_w[d*local_embed_size_plus_one + j] * context_E_grad), "neg context gradient", j);
-	    if (learning_rate_flag != 3){
-	      context_embed[context_idx + j] -= lr * (1.0/temperature) * (sum_prob_c_z_given_w[d*local_embed_size_plus_one + j] * context_E_grad);
-	    } else {
-	      float g_t = (1.0/temperature) * (sum_prob_c_z_given_w[d*local_embed_size_plus_one + j] * context_E_grad);
-	      context_adam_update_counter[context_idx + j] += 1;
-	      float m_t = (b1_adam * context_grad_moment1[context_idx + j]) + (1 - b1_adam) * g_t;
-	      float v_t = (b2_adam * context_grad_moment2[context_idx + j]) + (1 - b2_adam) * g_t*g_t;
-	      float m_t_hat = m_t / (1. - pow(b1_adam, context_adam_update_counter[context_idx + j]));
-	      float v_t_hat = v_t / (1. - pow(b2_adam, context_adam_update_counter[context_idx + j]));
-	      context_embed[context_idx + j] -= alpha_adam * m_t_hat / (sqrt(v_t_hat) + epsilon_adam);
-	      context_grad_moment1[context_idx + j] = m_t;
-	      context_grad_moment2[context_idx + j] = v_t;
-	    }
+	    update_param(context_embed, context_grad_moment1, context_grad_moment2, context_adam_update_counter, context_idx + j,
+	      lr, (1.0/temperature) * (sum_prob_c_z_given_w[d*local_embed_size_plus_one + j] * context_E_grad));
 	  }
 	  // input_grad_accum just has the normalization grad in it
 	  input_gradient_accumulator[j] += sum_prob_c_z_given_w[d*local_embed_size_plus_one + j] * input_word_E_grad;
@@ -780,40 +1841,20 @@ void *TrainModelThread(void *thread_id) {
 	check_value(input_gradient[j], "input_gradient", j);
 	check_value(pos_context_gradient[j], "pos_context_gradient", j);
         input_gradient[j] += input_gradient_accumulator[j]; 
-	if (learning_rate_flag != 3){
-	  input_embed[input_word_position + j] -= lr * (1.0/temperature) * input_gradient[j];
-	  context_embed[context_word_position + j] -= lr * (1.0/temperature) * pos_context_gradient[j];
-	} else {
-	  // update input embedding
-	  float g_t = (1.0/temperature) * input_gradient[j];
-	  input_adam_update_counter[input_word_position + j] += 1;
-	  float m_t = (b1_adam * input_grad_moment1[input_word_position + j]) + (1 - b1_adam) * g_t;
-	  float v_t = (b2_adam * input_grad_moment2[input_word_position + j]) + (1 - b2_adam) * g_t*g_t;
-	  float m_t_hat = m_t / (1. - pow(b1_adam, input_adam_update_counter[input_word_position + j]));
-	  float v_t_hat = v_t / (1. - pow(b2_adam, input_adam_update_counter[input_word_position + j]));
-	  input_embed[input_word_position + j] -= alpha_adam * m_t_hat / (sqrt(v_t_hat) + epsilon_adam);
-	  input_grad_moment1[input_word_position + j] = m_t;
-	  input_grad_moment2[input_word_position + j] = v_t;
-	  // update context embedding
-	  g_t = (1.0/temperature) * pos_context_gradient[j];
-	  context_adam_update_counter[context_word_position + j] += 1;
-	  m_t = (b1_adam * context_grad_moment1[context_word_position + j]) + (1 - b1_adam) * g_t;
-	  v_t = (b2_adam * context_grad_moment2[context_word_position + j]) + (1 - b2_adam) * g_t*g_t;
-	  m_t_hat = m_t / (1. - pow(b1_adam, context_adam_update_counter[context_word_position + j]));
-	  v_t_hat = v_t / (1. - pow(b2_adam, context_adam_update_counter[context_word_position + j]));
-	  context_embed[context_word_position + j] -= alpha_adam * m_t_hat / (sqrt(v_t_hat) + epsilon_adam);
-	  context_grad_moment1[context_word_position + j] = m_t;
-	  context_grad_moment2[context_word_position + j] = v_t;
-	}
+	update_param(input_embed, input_grad_moment1, input_grad_moment2, input_adam_update_counter, input_word_position + j,
+	  lr, (1.0/temperature) * input_gradient[j]);
+	update_param(context_embed, context_grad_moment1, context_grad_moment2, context_adam_update_counter, context_word_position + j,
+	  lr, (1.0/temperature) * pos_context_gradient[j]);
       }
 
       // track training progress
       log_prob_per_word += -log_prob_ck_given_w;
       free(prob_c_z_given_w);
       free(sum_prob_c_z_given_w);
+      telemetry_phase(telemetry, PHASE_UPDATE, &phase_mark);
     }
     // end loop over context (indexed by a)
-    train_log_probability += (log_prob_per_word)/(pos_context_counter * num_z_samples);
+    telemetry_add_loss(telemetry, log_prob_per_word, pos_context_counter);
     sentence_position++; 
     if (sentence_position >= sentence_length) {
       sentence_length = 0;
@@ -821,17 +1862,291 @@ void *TrainModelThread(void *thread_id) {
     }
   }
 
-  fclose(fi);
+  if (shard_client != NULL) shard_flush(shard_client);
+  if (deterministic) chunk_thread_ns[id] = telemetry_now_ns() - thread_start;
+  else {
+    hot_rows_merge(hot_input_rows, input_embed);
+    hot_rows_merge(hot_context_rows, context_embed);
+    hot_rows_free(hot_input_rows);
+    hot_rows_free(hot_context_rows);
+  }
   free(z_samples);   
   free(prob_z_given_w_c); 
   free(context_list); 
+  free(negatives_ahead);
   free(input_gradient);
   free(input_gradient_accumulator);
   free(pos_context_gradient);
+  free(log_p_z_given_w);
+  free(path_logits);
+  free(lr_per_dim);
+  free(window_rows);
+  free(window_probs);
+  free(window_sums);
+  if (batch != NULL) batch_free(batch);
   
   pthread_exit(NULL);
 }
 
+// -nodes: hash of what the processes must agree on: the vocabulary, the sizes and the threads
+unsigned long long ModelFingerprint() {
+  unsigned long long fingerprint = 1469598103934665603ULL;
+  long long sizes[5] = {vocab_size, embed_max_size, embed_current_size, num_threads, shard_vocab};
+  for (long long a = 0; a < vocab_size; a++) {
+    for (const unsigned char *p = (const unsigned char *)vocab[a].word; *p; p++) fingerprint = (fingerprint ^ *p) * 1099511628211ULL;
+    fingerprint = (fingerprint ^ (unsigned long long)vocab[a].cn) * 1099511628211ULL;
+  }
+  for (int a = 0; a < 5; a++) fingerprint = (fingerprint ^ (unsigned long long)sizes[a]) * 1099511628211ULL;
+  return fingerprint;
+}
+
+/*
+  -nodes: connects to the other processes and takes the base copy of the
+  freshly initialized model, which is the same on all of them
+*/
+void OpenCluster() {
+  unsigned long long fingerprint = ModelFingerprint();
+  printf("Node %d of %d: %s %s\n", node_rank, num_nodes, node_rank == 0 ? "coordinating on" : "connecting to", coordinator_address);
+  fflush(stdout);
+  cluster = cluster_open(coordinator_address, node_rank, num_nodes, fingerprint);
+  long long bytes = vocab_size * embed_max_size * sizeof(embed_t);
+  if (posix_memalign((void **)&sync_input_base, 128, bytes) || posix_memalign((void **)&sync_context_base, 128, bytes)) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  memcpy(sync_input_base, input_embed, bytes);
+  memcpy(sync_context_base, context_embed, bytes);
+  sync_touched = (unsigned char *) calloc(vocab_size, 1);
+}
+
+// -shardVocab: this process's corpus words, for the other processes' learning rate schedules
+long long ShardLocalWords() {
+  return word_count_actual - sync_remote_words;
+}
+
+// -shardVocab: every message from another process carries its word count and embed size
+void ShardObserve(int rank, long long embed_size, long long words) {
+  long long known = __atomic_load_n(&shard_peer_words[rank], __ATOMIC_RELAXED);
+  while (words > known) {
+    if (__atomic_compare_exchange_n(&shard_peer_words[rank], &known, words, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      __atomic_add_fetch(&sync_remote_words, words - known, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&word_count_actual, words - known, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  if (embed_size > embed_current_size) AdoptEmbedSize(embed_size);
+}
+
+/*
+  -shardVocab: listens for the other processes and connects every training
+  thread to each of them; rank r is at the r-th -peers address, or by
+  default at the -coordinator host, port + r
+*/
+void OpenShards() {
+  char host[256], port[32];
+  peer_addresses = (char **) calloc(num_nodes, sizeof(char *));
+  cluster_parse_address(coordinator_address, host, port);
+  char *list = peer_list, *next;
+  for (int r = 0; r < num_nodes; r++) {
+    peer_addresses[r] = (char *) calloc(300, 1);
+    if (peer_list[0] == 0) snprintf(peer_addresses[r], 300, "%s:%d", host, atoi(port) + r);
+    else {
+      if (list == NULL) {
+        printf("ERROR: -peers must list the address of each of the %d nodes\n", num_nodes);
+        exit(1);
+      }
+      next = strchr(list, ',');
+      snprintf(peer_addresses[r], 300, "%.*s", next == NULL ? (int)strlen(list) : (int)(next - list), list);
+      list = next == NULL ? NULL : next + 1;
+    }
+  }
+  shard_server.tables[0] = input_embed;
+  shard_server.tables[1] = context_embed;
+  shard_server.vocab_size = vocab_size;
+  shard_server.stride = embed_max_size;
+  shard_server.rank = node_rank;
+  shard_server.num_shards = num_nodes;
+  shard_server.num_threads = num_threads;
+  shard_server.embed_size = &embed_current_size;
+  shard_server.local_words = ShardLocalWords;
+  shard_server.observe = ShardObserve;
+  shard_server.fingerprint = ModelFingerprint();
+  shard_peer_words = (long long *) calloc(num_nodes, sizeof(long long));
+  printf("Node %d of %d: %lld of %lld rows, listening on %s\n", node_rank, num_nodes, (vocab_size - node_rank + num_nodes - 1) / num_nodes,
+         vocab_size, peer_addresses[node_rank]);
+  fflush(stdout);
+  shard_server_start(&shard_server, peer_addresses[node_rank]);
+  shard_clients = (ShardClient **) malloc(num_threads * sizeof(ShardClient *));
+  for (long a = 0; a < num_threads; a++)
+    shard_clients[a] = shard_client_new(&shard_server, peer_addresses, batch_size * (1 + 2 * window + negative), shard_cache);
+}
+
+/*
+  -shardVocab, once the threads are done: closes their connections, and on
+  rank 0 waits for the other processes to finish, keeping thread 0's
+  connections for reading their rows into the output
+*/
+void FinishShards() {
+  long long hits = 0, misses = 0, fetched = 0, pushed = 0;
+  for (long a = 0; a < num_threads; a++) {
+    hits += shard_clients[a]->hits;
+    misses += shard_clients[a]->misses;
+    fetched += shard_clients[a]->bytes_fetched;
+    pushed += shard_clients[a]->bytes_pushed;
+    if (node_rank != 0 || a > 0) shard_client_close(shard_clients[a]);
+  }
+  printf("Node %d: %.1f%% of other shards' rows read from the cache, %.1f MB fetched, %.1f MB pushed\n", node_rank,
+         hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0, fetched / 1e6, pushed / 1e6);
+  if (node_rank != 0) return;
+  shard_server_wait(&shard_server, 0);
+  // an empty FINAL request to everybody brings in the final embed sizes
+  shard_fetch(shard_clients[0], SHARD_FINAL, NULL, NULL, 0, 1);
+}
+
+// -shardVocab, rank 0: writes table 0 (input) or 1 (context) like save_vectors, reading the other shards' rows
+void SaveShardVectors(char *output_file, int table) {
+  ShardClient *c = shard_clients[0];
+  long long block = c->max_keys, width = embed_current_size;
+  float *rows = (float *) malloc(block * width * sizeof(float));
+  FILE *fo = fopen(output_file, "wb");
+  fprintf(fo, "%lld %lld\n", vocab_size, embed_current_size);
+  for (long long start = 0; start < vocab_size; start += block) {
+    long long n = vocab_size - start < block ? vocab_size - start : block;
+    for (long long a = 0; a < n; a++) {
+      c->keys[a] = table * vocab_size + start + a;
+      c->dest[a] = rows + a * width;
+    }
+    shard_fetch(c, SHARD_FINAL, c->keys, c->dest, n, width);
+    for (long long a = 0; a < n; a++) {
+      fprintf(fo, "%s ", vocab[start + a].word);
+      for (long long b = 0; b < width; b++) fprintf(fo, "%f ", rows[a * width + b]);
+      fprintf(fo, "\n");
+    }
+  }
+  fclose(fo);
+  free(rows);
+}
+
+// -shardVocab: the last connections go and the serving threads end once every process is done
+void CloseShards() {
+  for (long a = 0; a < num_threads; a++) shard_client_free(shard_clients[a]);
+  shard_server_stop(&shard_server);
+  for (int r = 0; r < num_nodes; r++) free(peer_addresses[r]);
+  free(peer_addresses);
+  free(shard_clients);
+  free(shard_peer_words);
+}
+
+// -sweep: one "dimPenalty sparsityWeight alpha" per line; blank lines and lines starting with # are skipped
+void ReadSweepFile() {
+  char line[1000];
+  FILE *fin = fopen(sweep_file, "rb");
+  if (fin == NULL) {
+    printf("ERROR: sweep file %s not found\n", sweep_file);
+    exit(1);
+  }
+  sweep_size = 0;
+  for (int number = 1; fgets(line, sizeof(line), fin) != NULL; number++) {
+    char *p = line;
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0) continue;
+    if (sweep_size == MAX_SWEEP) {
+      printf("ERROR: %s has more than %d configurations\n", sweep_file, MAX_SWEEP);
+      exit(1);
+    }
+    if (sscanf(p, "%f %f %f", &sweep_dim_penalty[sweep_size], &sweep_sparsity_weight[sweep_size], &sweep_alpha[sweep_size]) != 3) {
+      printf("ERROR: line %d of %s is not \"dimPenalty sparsityWeight alpha\"\n", number, sweep_file);
+      exit(1);
+    }
+    sweep_size++;
+  }
+  fclose(fin);
+  if (sweep_size == 0) {
+    printf("ERROR: %s has no configurations\n", sweep_file);
+    exit(1);
+  }
+}
+
+// -sweep: configuration k writes <name>.k
+void SweepName(char *name, int k) {
+  if (name[0] == 0) return;
+  char suffix[16];
+  sprintf(suffix, ".%d", k);
+  if (strlen(name) + strlen(suffix) >= MAX_STRING) {
+    printf("ERROR: %s is too long for a -sweep output name\n", name);
+    exit(1);
+  }
+  strcat(name, suffix);
+}
+
+/*
+  -sweep: forks a trainer per configuration once the vocabulary, Huffman tree
+  and unigram table are built, so the children share them copy-on-write
+  instead of rebuilding them, and feeds every child from this process's
+  corpus readers, which read and subsample the corpus once for all of them.
+  Returns 0 in a child, with its configuration installed and train_queues
+  pointing at its queues, and 1 in the parent once all children are done
+*/
+int RunSweep() {
+  long long num_queues = (long long)sweep_size * num_threads;
+  // deeper than the usual 16: the readers wait for the slowest configuration
+  SentenceQueue *queues = (SentenceQueue *) shared_calloc(num_queues * sizeof(SentenceQueue));
+  for (long long a = 0; a < num_queues; a++) sentence_queue_init_shared(&queues[a], 64, MAX_SENTENCE_LENGTH);
+  pid_t *children = (pid_t *) malloc(sweep_size * sizeof(pid_t));
+  long long start = telemetry_now_ns();
+  fflush(stdout);
+  for (int k = 0; k < sweep_size; k++) {
+    children[k] = fork();
+    if (children[k] < 0) {
+      printf("ERROR: cannot fork the trainer of sweep configuration %d\n", k);
+      exit(1);
+    }
+    if (children[k] == 0) {
+      free(children);
+      sweep_index = k;
+      train_queues = queues + k * num_threads;
+      dim_penalty = sweep_dim_penalty[k];
+      sparsity_weight = sweep_sparsity_weight[k];
+      alpha = starting_alpha = sweep_alpha[k];
+      SweepName(output_file, k);
+      SweepName(context_output_file, k);
+      SweepName(ragged_output_file, k);
+      SweepName(telemetry_output_file, k);
+      // only the first configuration reports progress on the console
+      if (k > 0 && debug_mode > 1) debug_mode = 1;
+      return 0;
+    }
+  }
+  train_queues = queues;
+  pthread_t *readers = (pthread_t *) malloc(num_readers * sizeof(pthread_t));
+  for (long a = 0; a < num_readers; a++) pthread_create(&readers[a], NULL, CorpusReaderThread, (void *)a);
+  // a child that dies would stop the readers at its full queues: give up on the whole sweep
+  for (int done = 0; done < sweep_size; done++) {
+    int status, k = sweep_size;
+    while (k == sweep_size) {
+      pid_t child = wait(&status);
+      if (child < 0) {
+        printf("ERROR: lost track of the sweep trainers\n");
+        exit(1);
+      }
+      for (k = 0; k < sweep_size && children[k] != child; k++);
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      printf("ERROR: the trainer of sweep configuration %d failed\n", k);
+      for (int j = 0; j < sweep_size; j++) if (j != k) kill(children[j], SIGTERM);
+      exit(1);
+    }
+  }
+  for (long a = 0; a < num_readers; a++) pthread_join(readers[a], NULL);
+  printf("Sweep: %d configurations trained in %.1f s, the corpus read once for all of them\n", sweep_size,
+         (telemetry_now_ns() - start) / 1e9);
+  for (long long a = 0; a < num_queues; a++) sentence_queue_free(&queues[a]);
+  munmap(queues, num_queues * sizeof(SentenceQueue));
+  free(readers);
+  free(children);
+  return 1;
+}
+
 void TrainModel() {
   // Print start time
   char buff[100];                                                               
@@ -840,37 +2155,163 @@ void TrainModel() {
   printf ("Strart training: %s\n", buff); 
 
   pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
-  printf("Starting training using file %s\n", train_file);
+  pthread_t reader, *readers = NULL, sync_thread;
   starting_alpha = alpha;
-  if (read_vocab_file[0] != 0) ReadVocab(); else LearnVocabFromTrainFile();
-  if (save_vocab_file[0] != 0) SaveVocab();
+  if (stream) {
+    printf("Starting online training from stdin\n");
+    if (read_vocab_file[0] != 0) ReadVocab();
+    else {
+      InitVocab();
+      AddWordToVocab((char *)"</s>");
+    }
+    if (vocab_size > stream_vocab_size) {
+      printf("ERROR: vocabulary in %s is larger than -streamVocab\n", read_vocab_file);
+      exit(1);
+    }
+    // sized for the cap up front so the vocab array never moves under the publisher
+    vocab_max_size = stream_vocab_size + 3;
+    vocab = (struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
+    stream_published_size = vocab_size;
+  } else {
+    printf("Starting training using file %s\n", train_file);
+    if (read_vocab_file[0] != 0) ReadVocab(); else LearnVocabFromTrainFile();
+    if (save_vocab_file[0] != 0) SaveVocab();
+  }
   if (output_file[0] == 0) return;
+  if (hs) CreateBinaryTree();
+  if (stream) {
+    unigram_tables[0] = (int *)malloc(table_size * sizeof(int));
+    unigram_tables[1] = (int *)malloc(table_size * sizeof(int));
+    table = unigram_tables[0];
+    BuildUnigramTable(table);
+  }
+  else if (negative > 0 && !hs) InitUnigramTable();
+  if (sweep_file[0] != 0 && RunSweep()) {
+    free(table);
+    free(pt);
+    return;
+  }
+  if (init_input_file[0] != 0 || init_context_file[0] != 0) SetWarmStartSize();
   InitNet();
-  if (negative > 0) InitUnigramTable();
-  start = clock();
+  WarmStart();
+  if (num_nodes > 1 && !shard_vocab) OpenCluster();
+  if (shard_vocab) OpenShards();
   // compute log of dim penalty
   log_dim_penalty = log(dim_penalty);
+  sparsity_per_dim = (real *) calloc(embed_max_size, sizeof(real));
+  for (long long j = 0; j < embed_max_size; j++) sparsity_per_dim[j] = sparsity_weight/(j+1);
   // compute exp table
-  build_exp_table(); 
  
   // expanded-dim training for desired epochs
-  printf("Training expanded dim model for %lld iters \n", iter);
+  if (!stream) printf("Training expanded dim model for %lld iters \n", iter);
   
+  telemetry_start(num_threads, telemetry_output_file, report_interval, debug_mode > 1, stream ? 0 : iter * train_words / num_nodes,
+                  embed_max_size, &embed_current_size, current_alpha);
+  if (stream) {
+    stream_sketch = cms_new(stream_vocab_size * 64);
+    sentence_queue_init(&stream_queue, 16 * num_threads, MAX_SENTENCE_LENGTH);
+  } else if (sweep_index < 0) {
+    train_queues = (SentenceQueue *) malloc(num_threads * sizeof(SentenceQueue));
+    for (long a = 0; a < num_threads; a++) sentence_queue_init(&train_queues[a], 16, MAX_SENTENCE_LENGTH);
+  }
+  if (deterministic) {
+    // a chunk step touches at most the center row, 2 window contexts and their negatives; -batch may overshoot by a batch
+    long long capacity = (chunk_size + batch_size) * (2 * window * (negative + 1) + 1);
+    chunk_input_rows = (HotRows **) malloc(num_threads * sizeof(HotRows *));
+    chunk_context_rows = (HotRows **) malloc(num_threads * sizeof(HotRows *));
+    for (long a = 0; a < num_threads; a++) {
+      chunk_input_rows[a] = hot_rows_new(vocab_size, embed_max_size, capacity);
+      chunk_context_rows[a] = hot_rows_new(vocab_size, embed_max_size, capacity);
+    }
+    chunk_sync_ns = (long long *) calloc(num_threads, sizeof(long long));
+    chunk_thread_ns = (long long *) calloc(num_threads, sizeof(long long));
+    chunk_running = num_threads;
+    pthread_barrier_init(&chunk_barrier, NULL, num_threads);
+  }
   for (long a = 0; a < num_threads; a++) {
     pthread_create(&pt[a], NULL, TrainModelThread, (void *)a);
   }
+  if (num_nodes > 1 && !shard_vocab) pthread_create(&sync_thread, NULL, ClusterSyncThread, NULL);
+  if (stream) {
+    pthread_create(&reader, NULL, StreamReaderThread, NULL);
+    while (stream_wait_publish(&stream_queue, publish_interval)) PublishVectors();
+    pthread_join(reader, NULL);
+  } else if (sweep_index < 0) {
+    readers = (pthread_t *) malloc(num_readers * sizeof(pthread_t));
+    for (long a = 0; a < num_readers; a++) pthread_create(&readers[a], NULL, CorpusReaderThread, (void *)a);
+    for (long a = 0; a < num_readers; a++) pthread_join(readers[a], NULL);
+  }
   for (long a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
-  printf("Writing input vectors to %s\n", output_file);
-  save_vectors(output_file, vocab_size, embed_current_size, vocab, input_embed);
-  printf("Writing context vectors to %s\n", context_output_file);
-  if (strlen(context_output_file) > 0)  save_vectors(context_output_file, vocab_size, embed_current_size, vocab, context_embed);
+  if (shard_vocab) FinishShards();
+  else if (num_nodes > 1) {
+    long long start = telemetry_now_ns();
+    __atomic_store_n(&sync_training_done, 1, __ATOMIC_RELEASE);
+    pthread_join(sync_thread, NULL);
+    printf("Node %d: %lld synchronizations in %.2f s, %.1f MB sent, %.2f s waiting for the other nodes at the end\n", node_rank,
+           sync_rounds, sync_time_ns / 1e9, cluster->bytes_sent / 1e6, (telemetry_now_ns() - start) / 1e9);
+    cluster_close(cluster);
+    free(sync_input_base);
+    free(sync_context_base);
+    free(sync_touched);
+  }
+  telemetry_stop();
+  if (deterministic) {
+    long long sync_ns = 0, thread_ns = 0;
+    for (long a = 0; a < num_threads; a++) {
+      sync_ns += chunk_sync_ns[a];
+      thread_ns += chunk_thread_ns[a];
+      hot_rows_free(chunk_input_rows[a]);
+      hot_rows_free(chunk_context_rows[a]);
+    }
+    // the throughput given up for determinism: waiting at the barriers and merging
+    printf("Deterministic mode: %.1f%% of training thread time at chunk barriers\n", thread_ns > 0 ? 100.0 * sync_ns / thread_ns : 0.0);
+    pthread_barrier_destroy(&chunk_barrier);
+    free(chunk_input_rows);
+    free(chunk_context_rows);
+    free(chunk_sync_ns);
+    free(chunk_thread_ns);
+  }
+  if (stream) {
+    if (save_vocab_file[0] != 0) SaveVocab();
+    cms_free(stream_sketch);
+    sentence_queue_free(&stream_queue);
+  } else if (sweep_index < 0) {
+    for (long a = 0; a < num_threads; a++) sentence_queue_free(&train_queues[a]);
+    free(train_queues);
+    free(readers);
+  }
+  // -nodes: the processes end with the same model, rank 0 writes it
+  if (node_rank != 0) printf("Node %d: the vectors are written by rank 0\n", node_rank);
+  else if (shard_vocab) {
+    printf("Writing input vectors to %s\n", output_file);
+    SaveShardVectors(output_file, 0);
+    printf("Writing context vectors to %s\n", context_output_file);
+    if (strlen(context_output_file) > 0) SaveShardVectors(context_output_file, 1);
+  } else {
+    printf("Writing input vectors to %s\n", output_file);
+    save_vectors(output_file, vocab_size, embed_current_size, vocab, input_embed);
+    if (hs) {
+      if (strlen(context_output_file) > 0) printf("Not writing context vectors: -hs trains Huffman node vectors instead\n");
+    } else {
+      printf("Writing context vectors to %s\n", context_output_file);
+      if (strlen(context_output_file) > 0)  save_vectors(context_output_file, vocab_size, embed_current_size, vocab, context_embed);
+    }
+    if (strlen(ragged_output_file) > 0) {
+      long long values = save_ragged_vectors(ragged_output_file, vocab_size, embed_current_size, embed_max_size, vocab, input_embed,
+                                             hs ? NULL : context_embed, log_dim_penalty, sparsity_weight, ragged_mass, num_threads);
+      printf("Writing ragged input vectors to %s: %lld of %lld values kept\n", ragged_output_file, values, vocab_size * embed_current_size);
+    }
+  }
+
+  if (shard_vocab) CloseShards();
 
   // free globally used space
-  free(exp_table);
   free(alpha_count_adjustment);
   free(alpha_per_dim);
+  free(sparsity_per_dim);
   free(input_embed);
   free(context_embed);
+  free(node_embed);
   free(input_grad_moment1);
   free(context_grad_moment1);
   free(input_grad_moment2);
@@ -898,19 +2339,13 @@ int ArgPos(char *str, int argc, char **argv) {
 
 // testing function for sampling from multinomial
 void multinom_unit_test(){
-  // set up random number generator                                                                                                                                                                    
-  const gsl_rng_type * T2;
-  gsl_rng * r2;
-  srand(time(NULL));
-  unsigned int Seed2 = rand();
-  gsl_rng_env_setup();
-  T2 = gsl_rng_default;
-  r2 = gsl_rng_alloc (T2);
-  gsl_rng_set (r2, Seed2);
+  // set up random number generator
+  Rng r2;
+  rng_seed(&r2, seed, 0, 0, 0);
   
   double x[] = {0.1, 0.1, 0.1, 0.1, 0.1, 0.1};
   for (int w=0; w<10; w++){
-    int y = sample_from_mult(x, 6, r2);
+    int y = sample_from_mult(x, 6, &r2);
     printf("Sampled idx: %i \n", y);
   }
 }
@@ -922,7 +2357,7 @@ int main(int argc, char **argv) {
     printf("Options:\n");
     printf("Parameters for training:\n");
     printf("\t-train <file>\n");
-    printf("\t\tUse text data from <file> to train the model\n");
+    printf("\t\tUse text data from <file> to train the model; plain text, gzip or zstd (built with -DUSE_ZSTD)\n");
     printf("\t-output <file>\n");
     printf("\t\tUse <file> to save the resulting *input* word vectors\n");
     printf("\t-contextOutput <file>\n");
@@ -937,8 +2372,44 @@ int main(int argc, char **argv) {
     printf("\t\tSet threshold for occurrence of words; Frequent ones will be downsampled.\n");
     printf("\t-negative <int>\n");
     printf("\t\tNumber of negative examples; default is 5, common values are 3 - 10 (0 = not used)\n");
+    printf("\t-exactZGrad <int>\n");
+    printf("\t\tTake the expectation over z of the gradient in closed form; the -numSamples draws then only decide growth; default is 0 (off)\n");
+    printf("\t-sharedNegatives <int>\n");
+    printf("\t\tDraw one set of negatives per center word and score all its positive contexts against it; default is 0 (off)\n");
+    printf("\t-batch <int>\n");
+    printf("\t\tTrain <int> center words at a time on packed blocks (one negative set shared by the batch's center words); default is 1 (off)\n");
+    printf("\t-hs <int>\n");
+    printf("\t\tUse Hierarchical Softmax instead of negative sampling; default is 0 (not used)\n");
+    printf("\t-deterministic <int>\n");
+    printf("\t\tReproducible multi-threaded training: fixed chunks, updates merged and the model grown at chunk barriers; default is 0 (off)\n");
+    printf("\t-chunk <int>\n");
+    printf("\t\tCenter words each thread trains between -deterministic barriers; default is 64\n");
+    printf("\t-seed <int>\n");
+    printf("\t\tSeed of the random streams (window sizes, negatives, z samples, subsampling); default is 1\n");
     printf("\t-threads <int>\n");
     printf("\t\tUse <int> threads (default 12)\n");
+    printf("\t-readers <int>\n");
+    printf("\t\tThreads reading the corpus ahead of the training threads, at most one per training thread; default is 1\n");
+    printf("\t-nodes <int>\n");
+    printf("\t\tTrain with <int> processes, each on its shard of the corpus, synchronized over TCP; default is 1\n");
+    printf("\t-rank <int>\n");
+    printf("\t\tThis process's rank among the -nodes; rank 0 coordinates and writes the vectors; default is 0\n");
+    printf("\t-coordinator <host:port>\n");
+    printf("\t\tAddress rank 0 listens on and the other ranks connect to; default is 127.0.0.1:7070\n");
+    printf("\t-shardVocab <int>\n");
+    printf("\t\tSplit the rows among the -nodes instead of replicating them (requires -batch); default is 0 (off)\n");
+    printf("\t-peers <list>\n");
+    printf("\t\tComma separated host:port of every rank for -shardVocab; default is the -coordinator host, port + rank\n");
+    printf("\t-shardCache <int>\n");
+    printf("\t\tRows of other shards each thread caches; default is 16384\n");
+    printf("\t-shardFlush <int>\n");
+    printf("\t\tMinibatches between pushes of the updates of other shards' rows, which also empty the cache; default is 8\n");
+    printf("\t-syncWords <int>\n");
+    printf("\t\tLocal corpus words between -nodes synchronizations; default is 1000000\n");
+    printf("\t-hotRows <int>\n");
+    printf("\t\tUpdate the rows of the <int> most frequent words through per-thread delta buffers (not AdaM steps); default is 0 (off)\n");
+    printf("\t-hotMerge <int>\n");
+    printf("\t\tCorpus words a thread trains on between merges of its -hotRows buffers; default is 100\n");
     printf("\t-iter <int>\n");
     printf("\t\tRun more training iterations (default 5)\n");
     printf("\t-min-count <int>\n");
@@ -949,44 +2420,150 @@ int main(int argc, char **argv) {
     printf("\t\tPenalty incurred for using each embedding dimension.  Must be in (1, infinity) to guarantee convergent Z. default=5.\n");
     printf("\t-sparsityWeight <float>\n");
     printf("\t\tWeight placed on L-2 sparsity penalty.  default = 0.001.\n");
+    printf("\t-sweep <file>\n");
+    printf("\t\tTrain every \"dimPenalty sparsityWeight alpha\" line of <file> in one run, sharing the vocab, unigram table and corpus reading,\n");
+    printf("\t\teach on -threads / configurations threads; configuration k writes <output>.k, <contextOutput>.k and <telemetry>.k\n");
     printf("\t-save-vocab <file>\n");
     printf("\t\tThe vocabulary will be saved to <file>\n");
     printf("\t-read-vocab <file>\n");
     printf("\t\tThe vocabulary will be read from <file>, not constructed from the training data\n");
+    printf("\t-init-input <file>\n");
+    printf("\t\tWarm start: initialize the input vectors of known words from <file> (as written by -output) and start at its dimensionality\n");
+    printf("\t-init-context <file>\n");
+    printf("\t\tWarm start: initialize the context vectors of known words from <file> (as written by -contextOutput)\n");
+    printf("\t-raggedOutput <file>\n");
+    printf("\t\tAlso save the input vectors as ragged rows, each truncated to the dims holding its p(z|w) mass\n");
+    printf("\t-raggedMass <float>\n");
+    printf("\t\tp(z|w) mass kept per word by -raggedOutput; default is 0.99\n");
     printf("\t-temperature <float>\n");
     printf("\t\tTemperature of the softmax used to calculate probabilities.  Default: 1.0 \n");
     printf("\t-optimizeType <int>\n");
     printf("\t\tFlag that, if equal to zero, performs vanialla SGD; if one, uses per-dim learning rates and schedules; if two, uses Beta CDF sweeps.\n");
+    printf("\t-stream <int>\n");
+    printf("\t\tTrain online on text piped to stdin instead of -train, until it is closed; default is 0 (off)\n");
+    printf("\t-streamVocab <int>\n");
+    printf("\t\tMaximum number of words -stream admits; rows for all of them are allocated up front; default is 100000\n");
+    printf("\t-admitCount <int>\n");
+    printf("\t\tOccurrences (count-min sketch estimate) before -stream admits a new word; default is 5\n");
+    printf("\t-publishInterval <float>\n");
+    printf("\t\tSeconds between -stream publications of the output vectors; default is 600\n");
+    printf("\t-telemetry <file>\n");
+    printf("\t\tWrite JSON lines with tokens/sec, loss, dimensionality, growth events and per-phase timings to <file>\n");
+    printf("\t-reportInterval <float>\n");
+    printf("\t\tSeconds of wall-clock time between progress reports; default is 1.0\n");
     printf("\nExamples:\n");
     printf("./iW2V -train data.txt -output w_vec.txt -contextOutput c_vec.txt -initSize 5 -maxSize 750 -window 5 -sample 1e-4 -negative 5 -iter 3\n\n");
     return 0;
   }
   output_file[0] = 0;
   save_vocab_file[0] = 0;
+  init_input_file[0] = 0;
+  init_context_file[0] = 0;
   read_vocab_file[0] = 0;
+  telemetry_output_file[0] = 0;
+  sweep_file[0] = 0;
   if ((i = ArgPos((char *)"-initSize", argc, argv)) > 0) embed_current_size = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-maxSize", argc, argv)) > 0) embed_max_size = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-train", argc, argv)) > 0) strcpy(train_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-save-vocab", argc, argv)) > 0) strcpy(save_vocab_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-read-vocab", argc, argv)) > 0) strcpy(read_vocab_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-init-input", argc, argv)) > 0) strcpy(init_input_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-init-context", argc, argv)) > 0) strcpy(init_context_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-raggedOutput", argc, argv)) > 0) strcpy(ragged_output_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-raggedMass", argc, argv)) > 0) ragged_mass = atof(argv[i + 1]);
   if ((i = ArgPos((char *)"-debug", argc, argv)) > 0) debug_mode = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-alpha", argc, argv)) > 0) alpha = atof(argv[i + 1]);
   if ((i = ArgPos((char *)"-dimPenalty", argc, argv)) > 0) dim_penalty = atof(argv[i+1]);
   if ((i = ArgPos((char *)"-sparsityWeight", argc, argv)) > 0) sparsity_weight = atof(argv[i+1]);
+  if ((i = ArgPos((char *)"-sweep", argc, argv)) > 0) strcpy(sweep_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-output", argc, argv)) > 0) strcpy(output_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-contextOutput", argc, argv)) > 0) strcpy(context_output_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-window", argc, argv)) > 0) window = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-sample", argc, argv)) > 0) sample = atof(argv[i + 1]);
   if ((i = ArgPos((char *)"-negative", argc, argv)) > 0) negative = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-hs", argc, argv)) > 0) hs = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-sharedNegatives", argc, argv)) > 0) shared_negatives = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-batch", argc, argv)) > 0) batch_size = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-deterministic", argc, argv)) > 0) deterministic = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-chunk", argc, argv)) > 0) chunk_size = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-seed", argc, argv)) > 0) seed = strtoull(argv[i + 1], NULL, 10);
+  if ((i = ArgPos((char *)"-readers", argc, argv)) > 0) num_readers = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-nodes", argc, argv)) > 0) num_nodes = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-rank", argc, argv)) > 0) node_rank = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-coordinator", argc, argv)) > 0) strcpy(coordinator_address, argv[i + 1]);
+  if ((i = ArgPos((char *)"-shardVocab", argc, argv)) > 0) shard_vocab = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-peers", argc, argv)) > 0) strncpy(peer_list, argv[i + 1], sizeof(peer_list) - 1);
+  if ((i = ArgPos((char *)"-shardCache", argc, argv)) > 0) shard_cache = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-shardFlush", argc, argv)) > 0) shard_flush_batches = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-syncWords", argc, argv)) > 0) sync_words = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-hotRows", argc, argv)) > 0) hot_rows = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-hotMerge", argc, argv)) > 0) hot_merge = atoll(argv[i + 1]);
   if ((i = ArgPos((char *)"-iter", argc, argv)) > 0) iter = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-min-count", argc, argv)) > 0) min_count = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-numSamples", argc, argv)) >0 ) num_z_samples = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-exactZGrad", argc, argv)) > 0) exact_z_grad = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-optimizeType", argc, argv)) >0 ) learning_rate_flag = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-temperature", argc, argv)) > 0) temperature = atof(argv[i + 1]);
-
-  vocab = (struct vocab_word *)calloc(vocab_max_size, sizeof(struct vocab_word));
-  vocab_hash = (int *)calloc(vocab_hash_size, sizeof(int));
+  if ((i = ArgPos((char *)"-telemetry", argc, argv)) > 0) strcpy(telemetry_output_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-reportInterval", argc, argv)) > 0) report_interval = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-stream", argc, argv)) > 0) stream = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-streamVocab", argc, argv)) > 0) stream_vocab_size = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-admitCount", argc, argv)) > 0) admit_count = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-publishInterval", argc, argv)) > 0) publish_interval = atof(argv[i + 1]);
+
+  if (hs && learning_rate_flag == 3) {
+    printf("ERROR: -hs does not support AdaM (-optimizeType 3)\n");
+    exit(1);
+  }
+  if (hs && init_context_file[0] != 0) {
+    printf("ERROR: -init-context cannot be used with -hs, which has no context vectors\n");
+    exit(1);
+  }
+  if (stream && hs) {
+    printf("ERROR: -stream cannot grow the Huffman tree of -hs\n");
+    exit(1);
+  }
+  if (hs && (batch_size > 1 || shared_negatives)) {
+    printf("ERROR: -batch and -sharedNegatives train negative sampling and cannot be used with -hs\n");
+    exit(1);
+  }
+  if (batch_size > 1 && shared_negatives) {
+    printf("ERROR: -batch already shares one negative set per minibatch; drop -sharedNegatives\n");
+    exit(1);
+  }
+  if (deterministic && (stream || hs || learning_rate_flag == 3 || hot_rows > 0)) {
+    printf("ERROR: -deterministic cannot be used with -stream, -hs, AdaM (-optimizeType 3) or -hotRows\n");
+    exit(1);
+  }
+  if (num_nodes < 1 || node_rank < 0 || node_rank >= num_nodes) {
+    printf("ERROR: -rank must be between 0 and -nodes - 1\n");
+    exit(1);
+  }
+  if (num_nodes > 1 && (stream || hs || deterministic)) {
+    printf("ERROR: -nodes cannot be used with -stream, -hs or -deterministic\n");
+    exit(1);
+  }
+  if (num_nodes == 1) shard_vocab = 0;
+  if (shard_vocab && (batch_size < 2 || learning_rate_flag == 3 || hot_rows > 0 || init_input_file[0] != 0 ||
+                      init_context_file[0] != 0 || strlen(ragged_output_file) > 0)) {
+    printf("ERROR: -shardVocab needs -batch and cannot be used with AdaM (-optimizeType 3), -hotRows, warm starts or -raggedOutput\n");
+    exit(1);
+  }
+  if (shard_flush_batches < 1) shard_flush_batches = 1;
+  if (sweep_file[0] != 0) {
+    if (stream || num_nodes > 1) {
+      printf("ERROR: -sweep cannot be used with -stream or -nodes\n");
+      exit(1);
+    }
+    ReadSweepFile();
+    // the cores are split among the configurations
+    num_threads /= sweep_size;
+    if (num_threads < 1) num_threads = 1;
+  }
+  // every reader serves at least one training thread
+  if (num_readers < 1) num_readers = 1;
+  if (num_readers > num_threads) num_readers = num_threads;
   print_args();
   TrainModel();
   return 0;
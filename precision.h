@@ -0,0 +1,168 @@
+/*
+  Storage precision of the embedding tables, shared by iSG and iCBOW.
+
+  Built with -DEMBED_FP16 or -DEMBED_BF16, input_embed and context_embed
+  hold 16 bit values, which halves the model footprint and the memory
+  traffic of every update.  The trainers only touch the tables through
+  embed_get, embed_set and embed_add, so energies and gradients are still
+  computed in fp32.  embed_add rounds the updated value stochastically:
+  an update smaller than half a unit in the last place then still moves the
+  weight in expectation instead of being rounded away, which is what keeps
+  late, small learning rate updates from stalling.  embed_set (init and
+  warm start) rounds to nearest.
+
+  The conversions use F16C (fp16) and AVX512-BF16 (bf16) when the compiler
+  targets them (-march=native on CPUs that have them) and portable bit
+  manipulation otherwise.  Without either flag embed_t is float and the
+  accessors compile to plain loads and stores.
+*/
+#include <math.h>
+#include <string.h>
+#if defined(__F16C__) || defined(__AVX512BF16__)
+#include <immintrin.h>
+#endif
+
+#if defined(EMBED_FP16) && defined(EMBED_BF16)
+#error "EMBED_FP16 and EMBED_BF16 are exclusive"
+#endif
+
+// per-thread generator of the stochastic rounding bits; the trainers seed it from an rng.h stream
+static __thread unsigned int embed_round_state = 1;
+
+static inline void embed_round_seed(unsigned long long seed) {
+  embed_round_state = (unsigned int)(seed * 2654435761ULL) | 1;
+}
+
+static inline unsigned int embed_round_bits() {
+  // xorshift32
+  unsigned int x = embed_round_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return embed_round_state = x;
+}
+
+static inline unsigned int float_bits(float f) {
+  unsigned int x;
+  memcpy(&x, &f, sizeof(x));
+  return x;
+}
+
+static inline float bits_float(unsigned int x) {
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+// fp16 <-> fp32
+static inline float half_to_float(unsigned short h) {
+#ifdef __F16C__
+  return _cvtsh_ss(h);
+#else
+  unsigned int sign = (unsigned int)(h & 0x8000) << 16, e = (h >> 10) & 0x1f, m = h & 0x3ff;
+  if (e == 0x1f) return bits_float(sign | 0x7f800000 | (m << 13));
+  if (e == 0) return sign ? -ldexpf(m, -24) : ldexpf(m, -24);
+  return bits_float(sign | ((e + 112) << 23) | (m << 13));
+#endif
+}
+
+// rounds toward zero
+static inline unsigned short float_to_half_trunc(float f) {
+#ifdef __F16C__
+  return _cvtss_sh(f, _MM_FROUND_TO_ZERO);
+#else
+  unsigned int x = float_bits(f), sign = (x >> 16) & 0x8000, mant = x & 0x7fffff;
+  int e = (int)((x >> 23) & 0xff) - 127 + 15;
+  if (((x >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mant ? 0x200 : 0);
+  if (e >= 31) return sign | 0x7bff;
+  if (e <= 0) return e < -10 ? sign : sign | ((mant | 0x800000) >> (14 - e));
+  return sign | (e << 10) | (mant >> 13);
+#endif
+}
+
+/*
+  Rounds to one of the two neighbouring fp16 values; with random bits, up in
+  proportion to the distance from the lower one, else to the nearest one
+*/
+static inline unsigned short float_to_half_round(float f, int stochastic) {
+#ifdef __F16C__
+  if (!stochastic) return _cvtss_sh(f, _MM_FROUND_TO_NEAREST_INT);
+#endif
+  unsigned short lo = float_to_half_trunc(f);
+  if ((lo & 0x7fff) >= 0x7bff) return lo;  // max finite, inf or nan
+  float down = fabsf(half_to_float(lo)), up = fabsf(half_to_float(lo + 1)), mag = fabsf(f);
+  if (mag == down) return lo;
+  float fraction = (mag - down) / (up - down);
+  if (stochastic) return (embed_round_bits() >> 8) * (1.0f / 16777216) < fraction ? lo + 1 : lo;
+  return fraction > 0.5f ? lo + 1 : lo;
+}
+
+// bf16 <-> fp32: bf16 is the upper half of an fp32
+static inline float bf16_to_float(unsigned short h) {
+  return bits_float((unsigned int)h << 16);
+}
+
+static inline unsigned short float_to_bf16_round(float f, int stochastic) {
+  unsigned int x = float_bits(f);
+  if ((x & 0x7f800000) == 0x7f800000) return (x >> 16) | ((x & 0xffff) ? 0x40 : 0);  // inf or nan
+  // adding uniform low bits before truncating rounds the magnitude up with the probability of its remainder
+  if (stochastic) return (x + (embed_round_bits() & 0xffff)) >> 16;
+#if defined(__AVX512BF16__) && defined(__AVX512VL__)
+  __m128bh v = _mm_cvtneps_pbh(_mm_set_ss(f));
+  unsigned short h;
+  memcpy(&h, &v, sizeof(h));
+  return h;
+#else
+  return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+#endif
+}
+
+#if defined(EMBED_FP16) || defined(EMBED_BF16)
+typedef unsigned short embed_t;
+#ifdef EMBED_FP16
+#define EMBED_PRECISION "fp16"
+#define embed_to_float half_to_float
+#define embed_from_float float_to_half_round
+#else
+#define EMBED_PRECISION "bf16"
+#define embed_to_float bf16_to_float
+#define embed_from_float float_to_bf16_round
+#endif
+
+static inline float embed_get(const embed_t *table, long long i) {
+  return embed_to_float(table[i]);
+}
+
+static inline void embed_set(embed_t *table, long long i, float value) {
+  table[i] = embed_from_float(value, 0);
+}
+
+static inline void embed_add(embed_t *table, long long i, float delta) {
+  table[i] = embed_from_float(embed_to_float(table[i]) + delta, 1);
+}
+#else
+typedef float embed_t;
+#define EMBED_PRECISION "fp32"
+
+static inline float embed_get(const embed_t *table, long long i) {
+  return table[i];
+}
+
+static inline void embed_set(embed_t *table, long long i, float value) {
+  table[i] = value;
+}
+
+static inline void embed_add(embed_t *table, long long i, float delta) {
+  table[i] += delta;
+}
+#endif
+
+// requests the first n values of a row into the cache ahead of a read-modify-write
+static inline void embed_prefetch_row(const embed_t *row, long long n) {
+  for (long long i = 0; i < n; i += 64 / sizeof(embed_t)) __builtin_prefetch(row + i, 1, 3);
+}
+
+// widens n values of a row into an fp32 buffer
+static inline void embed_load_row(float *dest, const embed_t *row, long long n) {
+  for (long long i = 0; i < n; i++) dest[i] = embed_get(row, i);
+}
@@ -0,0 +1,156 @@
+/*
+  Ragged export (-raggedOutput), shared by iSG and iCBOW.
+
+  Every word has its own effective dimensionality, but save_vectors writes
+  embed_current_size values for each of them, long zero tails included.
+  The ragged export keeps for word w only its first z_w dims, z_w being
+  the smallest z whose cumulative p(z|w) reaches -raggedMass.  p(z|w) is
+  estimated with the energy both trainers share,
+    E(w,c,z) = sum_{i<=z} -w_i c_i + log(dim_penalty) + s/i (w_i^2 + c_i^2),
+  summing e^(-E) over the RAGGED_CONTEXTS most frequent context words; with
+  no context vectors (-hs) the c terms drop and only the prior is left.
+  Zero tails are dropped in any case.
+
+  The output is a binary image read by map_ragged in Evaluation/eval_lib.h
+  and read_ragged_file in Evaluation/eval_lib.py: a 128 byte header, the
+  vocab (RAGGED_WORD_WIDTH bytes per word), vocab_size + 1 row offsets and
+  the packed float rows, each section 64 byte aligned.  Row a is
+  values[offsets[a] .. offsets[a+1]).  Native byte order.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define RAGGED_MAGIC "IWERAGGD"
+#define RAGGED_VERSION 1
+#define RAGGED_WORD_WIDTH 50  // max_w of Evaluation/eval_lib.h
+#define RAGGED_CONTEXTS 100
+
+typedef struct {
+  char magic[8];
+  long long version, vocab_size, embed_size, word_width, vocab_offset, offsets_offset, values_offset, num_values, size;
+  long long reserved[6];
+} RaggedHeader;
+
+typedef struct {
+  embed_t *input, *context;
+  long long rows, dims, stride, *lengths;
+  float log_dim_penalty, sparsity_weight, mass;
+  int id, num_threads;
+} RaggedJob;
+
+// z_w for the rows id, id + num_threads, ...
+void *RaggedLengthThread(void *arg) {
+  RaggedJob *job = (RaggedJob *)arg;
+  long long contexts = job->context == NULL ? 1 : (job->rows < RAGGED_CONTEXTS ? job->rows : RAGGED_CONTEXTS);
+  float *energy = (float *)malloc(contexts * job->dims * sizeof(float));
+  double *p_z = (double *)malloc(job->dims * sizeof(double));
+  for (long long w = job->id; w < job->rows; w += job->num_threads) {
+    const embed_t *in = job->input + w * job->stride;
+    long long length = job->dims;
+    // zero tails carry nothing
+    while (length > 1 && embed_get(in, length - 1) == 0) length--;
+    float max_value = -INFINITY;
+    for (long long c = 0; c < contexts; c++) {
+      const embed_t *ctx = job->context == NULL ? NULL : job->context + c * job->stride;
+      float e = 0;
+      for (long long i = 0; i < job->dims; i++) {
+        float wi = embed_get(in, i), ci = ctx == NULL ? 0 : embed_get(ctx, i);
+        e += -wi * ci + job->log_dim_penalty + job->sparsity_weight / (i + 1) * (wi * wi + ci * ci);
+        energy[c * job->dims + i] = -e;
+        if (-e > max_value) max_value = -e;
+      }
+    }
+    double norm = 0, cdf = 0;
+    for (long long i = 0; i < job->dims; i++) {
+      p_z[i] = 0;
+      for (long long c = 0; c < contexts; c++) p_z[i] += exp(energy[c * job->dims + i] - max_value);
+      norm += p_z[i];
+    }
+    for (long long i = 0; i < length; i++) {
+      cdf += p_z[i] / norm;
+      if (cdf >= job->mass) {
+        length = i + 1;
+        break;
+      }
+    }
+    job->lengths[w] = length;
+  }
+  free(energy);
+  free(p_z);
+  return NULL;
+}
+
+long long ragged_write_section(FILE *f, const void *data, long long bytes) {
+  long long offset = (ftell(f) + 63) / 64 * 64;
+  while (ftell(f) < offset) fputc(0, f);
+  if (data != NULL) fwrite(data, 1, bytes, f);
+  return offset;
+}
+
+/*
+  Writes the first rows of input (row stride embed_max_size, dims in use)
+  as a ragged image; context may be NULL.  Returns the number of values.
+*/
+long long save_ragged_vectors(char *file_name, long long rows, long long dims, long long stride, struct vocab_word *words,
+  embed_t *input, embed_t *context, float log_dim_penalty, float sparsity_weight, float mass, int num_threads) {
+  long long a, i, *lengths = (long long *)malloc(rows * sizeof(long long));
+  long long *offsets = (long long *)malloc((rows + 1) * sizeof(long long));
+  RaggedJob *jobs = (RaggedJob *)malloc(num_threads * sizeof(RaggedJob));
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  for (a = 0; a < num_threads; a++) {
+    jobs[a] = (RaggedJob){input, context, rows, dims, stride, lengths, log_dim_penalty, sparsity_weight, mass, a, num_threads};
+    pthread_create(&pt[a], NULL, RaggedLengthThread, &jobs[a]);
+  }
+  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  offsets[0] = 0;
+  for (a = 0; a < rows; a++) offsets[a + 1] = offsets[a] + lengths[a];
+
+  RaggedHeader header;
+  char tmp_name[MAX_STRING + 16], word[RAGGED_WORD_WIDTH];
+  float *row = (float *)malloc(dims * sizeof(float));
+  memset(&header, 0, sizeof(header));
+  sprintf(tmp_name, "%s.tmp%d", file_name, (int)getpid());
+  FILE *fo = fopen(tmp_name, "wb");
+  if (fo == NULL) {
+    printf("ERROR: cannot write %s\n", tmp_name);
+    exit(1);
+  }
+  fwrite(&header, sizeof(header), 1, fo);
+  header.vocab_offset = ragged_write_section(fo, NULL, 0);
+  for (a = 0; a < rows; a++) {
+    memset(word, 0, RAGGED_WORD_WIDTH);
+    strncpy(word, words[a].word, RAGGED_WORD_WIDTH - 1);
+    fwrite(word, 1, RAGGED_WORD_WIDTH, fo);
+  }
+  header.offsets_offset = ragged_write_section(fo, offsets, (rows + 1) * sizeof(long long));
+  header.values_offset = ragged_write_section(fo, NULL, 0);
+  for (a = 0; a < rows; a++) {
+    for (i = 0; i < lengths[a]; i++) row[i] = embed_get(input, a * stride + i);
+    fwrite(row, sizeof(float), lengths[a], fo);
+  }
+  memcpy(header.magic, RAGGED_MAGIC, 8);
+  header.version = RAGGED_VERSION;
+  header.vocab_size = rows;
+  header.embed_size = dims;
+  header.word_width = RAGGED_WORD_WIDTH;
+  header.num_values = offsets[rows];
+  header.size = ftell(fo);
+  fseek(fo, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, fo);
+  if (fclose(fo) != 0) {
+    printf("ERROR: cannot write %s\n", tmp_name);
+    exit(1);
+  }
+  rename(tmp_name, file_name);
+  long long num_values = offsets[rows];
+  free(lengths);
+  free(offsets);
+  free(jobs);
+  free(pt);
+  free(row);
+  return num_values;
+}
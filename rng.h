@@ -0,0 +1,101 @@
+/*
+  Counter-based random numbers for the trainers, shared by iSG and iCBOW.
+
+  Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2,
+  3", SC 2011) maps a 128 bit counter and a 64 bit key to 128 random bits
+  with ten rounds of multiplies and xors; distinct counters give
+  independent outputs.  A stream's key is the global -seed and its counter
+  holds (block, stream, epoch, chunk), so any thread can start the stream
+  of any (thread, epoch, chunk) directly, without stepping a generator
+  there or sharing state with the others: runs are reproducible for a
+  given -seed, and two threads never draw the same sequence.  Streams are
+  numbered by training thread; the corpus readers use RNG_READER_STREAM |
+  shard, and precision.h's rounding generators are seeded from
+  RNG_ROUND_STREAM | thread.  iSG's -nodes numbers them across processes,
+  rank * threads + thread, so the ranks' updates do not share their draws.
+  The LCG that initializes the embeddings starts from -seed itself, the
+  same on every rank, since all of them must build the same initial model.
+
+  rng_fill produces a batch of whole blocks in one loop, which the
+  compiler vectorizes across blocks.  A draw costs a fraction of
+  gsl_ran_multinomial's per-bin binomial draws, and z sampling now takes
+  its N uniforms at once and finds all of them in one pass over the bins.
+*/
+#include <string.h>
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define RNG_READER_STREAM 0x80000000u
+#define RNG_ROUND_STREAM 0x40000000u
+
+typedef struct {
+  unsigned int key[2], counter[4];  // counter[0] is the block within the stream
+  unsigned int block[4];
+  int used;                         // values of block already returned
+} Rng;
+
+static inline void philox4x32(const unsigned int counter[4], const unsigned int key[2], unsigned int out[4]) {
+  unsigned int c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3], k0 = key[0], k1 = key[1];
+  for (int round = 0; round < 10; round++) {
+    unsigned long long p0 = (unsigned long long)PHILOX_M0 * c0, p1 = (unsigned long long)PHILOX_M1 * c2;
+    c0 = (unsigned int)(p1 >> 32) ^ c1 ^ k0;
+    c1 = (unsigned int)p1;
+    c2 = (unsigned int)(p0 >> 32) ^ c3 ^ k1;
+    c3 = (unsigned int)p0;
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+  out[0] = c0;
+  out[1] = c1;
+  out[2] = c2;
+  out[3] = c3;
+}
+
+// positions r at the start of the stream (seed, stream, epoch, chunk)
+static inline void rng_seed(Rng *r, unsigned long long seed, unsigned int stream, unsigned int epoch, unsigned int chunk) {
+  r->key[0] = (unsigned int)seed;
+  r->key[1] = (unsigned int)(seed >> 32);
+  r->counter[0] = 0;
+  r->counter[1] = stream;
+  r->counter[2] = epoch;
+  r->counter[3] = chunk;
+  r->used = 4;
+}
+
+static inline unsigned int rng_next(Rng *r) {
+  if (r->used == 4) {
+    philox4x32(r->counter, r->key, r->block);
+    r->counter[0]++;
+    r->used = 0;
+  }
+  return r->block[r->used++];
+}
+
+// n values into dest: what is left of the current block, then whole blocks, then a partial one
+static inline void rng_fill(Rng *r, unsigned int *dest, int n) {
+  int i = 0;
+  while (i < n && r->used < 4) dest[i++] = r->block[r->used++];
+  int blocks = (n - i) / 4;
+  for (int b = 0; b < blocks; b++) {
+    unsigned int counter[4] = {r->counter[0] + b, r->counter[1], r->counter[2], r->counter[3]};
+    philox4x32(counter, r->key, dest + i + 4 * b);
+  }
+  r->counter[0] += blocks;
+  for (i += 4 * blocks; i < n; i++) dest[i] = rng_next(r);
+}
+
+// bits scaled to [0, n) by a multiply, no division
+static inline unsigned int rng_scale(unsigned int bits, unsigned int n) {
+  return (unsigned int)(((unsigned long long)bits * n) >> 32);
+}
+
+static inline unsigned int rng_below(Rng *r, unsigned int n) {
+  return rng_scale(rng_next(r), n);
+}
+
+// uniform in [0, 1) with 24 random bits
+static inline float rng_uniform(Rng *r) {
+  return (rng_next(r) >> 8) * (1.0f / 16777216);
+}
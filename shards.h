@@ -0,0 +1,489 @@
+/*
+  Vocabulary-sharded model-parallel training (-shardVocab), used by iSG with
+  the minibatch engine; builds on the socket helpers of cluster.h.
+
+  The -nodes processes split the rows of input_embed and context_embed
+  between them: word w lives on rank w % N, at local row w / N, which deals
+  the frequency-sorted vocabulary out evenly, so every process holds 1/N of
+  the model.  Each process trains its shard of the corpus.  Every process
+  listens for the others, and each training thread has its own connection to
+  each of them, served on the other side by a thread of its own.
+
+  A batch's rows are read from the process's own shard directly; the other
+  shards' come from the thread's row cache or, on a miss, from their
+  owners, one FETCH request per owner for the whole batch, all requests
+  sent before the first reply is read.  Updates of the process's own rows
+  go straight to its tables, Hogwild-style; the deltas of other shards' rows
+  are summed per row into the thread's pending buffer (and into its cached
+  copy, so the thread sees its own updates) and pushed to their owners,
+  again one PUSH per owner, every -shardFlush batches.  A push also empties
+  the cache, which bounds how stale a cached row can be.
+
+  Every message carries the sender's embed_current_size and local corpus
+  word count; the receiver grows to the largest size it sees and counts the
+  other processes' words into its learning rate schedule.
+
+  At the end a process closes its connections once its threads have pushed
+  their last deltas.  Rank 0 waits until every other process has closed its
+  connections to it, then reads all remote rows for the output over its
+  thread 0 connections with FINAL requests, which a process only answers
+  once all its other connections are closed, i.e. all pushes to it are in.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+enum { SHARD_FETCH = 1, SHARD_PUSH, SHARD_FINAL };
+
+typedef struct {
+  long long op, width, num_rows;
+  long long rank, embed_size, words;  // the sender's
+} ShardHeader;
+
+// rows of embed_max_size floats by key (table * vocab_size + word), open addressing
+typedef struct {
+  long long capacity, stride, count;  // capacity is a power of 2
+  long long *key;                     // -1 if free
+  int *width;                         // values in use; -1 while a fetch is outstanding
+  float *value;
+  long long *used;                    // slots in use, in insertion order
+} ShardRows;
+
+// this process's side: its rows and the threads serving the other processes
+typedef struct {
+  embed_t *tables[2];                 // input and context rows of the owned words
+  long long vocab_size, stride;
+  int rank, num_shards, num_threads;
+  long long *embed_size;
+  long long (*local_words)(void);
+  void (*observe)(int rank, long long embed_size, long long words);  // every header received
+  unsigned long long fingerprint;
+  int listener, expected, accepted, open;
+  pthread_t acceptor, *servers;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} ShardServer;
+
+// a training thread's side
+typedef struct {
+  ShardServer *server;
+  int *fds;                           // by rank, -1 for this process
+  ShardRows *cache, *pending;
+  long long max_keys;
+  long long *keys, *owner_count, **owner_keys;
+  float **dest, ***owner_dest, *buffer;
+  long long buffer_size;
+  long long hits, misses, bytes_fetched, bytes_pushed;
+} ShardClient;
+
+typedef struct {
+  ShardServer *server;
+  int fd, peer;
+} ShardConnection;
+
+static inline int shard_owner(long long word, int num_shards) {
+  return (int)(word % num_shards);
+}
+
+ShardRows *shard_rows_new(long long capacity, long long stride) {
+  ShardRows *r = (ShardRows *) calloc(1, sizeof(ShardRows));
+  r->capacity = 1;
+  while (r->capacity < capacity) r->capacity <<= 1;
+  r->stride = stride;
+  r->key = (long long *) malloc(r->capacity * sizeof(long long));
+  r->width = (int *) calloc(r->capacity, sizeof(int));
+  r->value = (float *) malloc(r->capacity * stride * sizeof(float));
+  r->used = (long long *) malloc(r->capacity * sizeof(long long));
+  if (r->key == NULL || r->width == NULL || r->value == NULL || r->used == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  for (long long s = 0; s < r->capacity; s++) r->key[s] = -1;
+  return r;
+}
+
+void shard_rows_free(ShardRows *r) {
+  free(r->key);
+  free(r->width);
+  free(r->value);
+  free(r->used);
+  free(r);
+}
+
+static inline long long shard_rows_slot(ShardRows *r, long long key) {
+  long long s = (long long)(((unsigned long long)key * 0x9E3779B97F4A7C15ULL) >> 20) & (r->capacity - 1);
+  while (r->key[s] != -1 && r->key[s] != key) s = (s + 1) & (r->capacity - 1);
+  return s;
+}
+
+// the slot of key, or -1
+static inline long long shard_rows_find(ShardRows *r, long long key) {
+  long long s = shard_rows_slot(r, key);
+  return r->key[s] == key ? s : -1;
+}
+
+// the slot of key, added with zeroed values if new; the caller keeps count below capacity / 2
+long long shard_rows_insert(ShardRows *r, long long key) {
+  long long s = shard_rows_slot(r, key);
+  if (r->key[s] == key) return s;
+  r->key[s] = key;
+  r->width[s] = 0;
+  memset(r->value + s * r->stride, 0, r->stride * sizeof(float));
+  r->used[r->count++] = s;
+  return s;
+}
+
+void shard_rows_clear(ShardRows *r) {
+  for (long long i = 0; i < r->count; i++) r->key[r->used[i]] = -1;
+  r->count = 0;
+}
+
+void shard_send_header(ShardServer *s, int fd, long long op, long long width, long long num_rows) {
+  ShardHeader h = {op, width, num_rows, s->rank, *s->embed_size, s->local_words()};
+  cluster_send_all(NULL, fd, &h, sizeof(h));
+}
+
+void shard_recv_header(ShardServer *s, int fd, ShardHeader *h) {
+  cluster_recv_all(fd, h, sizeof(ShardHeader));
+  if (h->rank < 0 || h->rank >= s->num_shards) {
+    printf("ERROR: a message from rank %lld of %d\n", h->rank, s->num_shards);
+    exit(1);
+  }
+  s->observe((int)h->rank, h->embed_size, h->words);
+}
+
+// the owned row of key
+static inline embed_t *shard_local_row(ShardServer *s, long long key) {
+  long long word = key % s->vocab_size;
+  return s->tables[key / s->vocab_size] + word / s->num_shards * s->stride;
+}
+
+// serves one connection until the other side closes it
+void *ShardServeThread(void *arg) {
+  ShardConnection *conn = (ShardConnection *)arg;
+  ShardServer *s = conn->server;
+  ShardHeader h;
+  long long *keys = NULL, max_rows = 0;
+  float *values = NULL;
+  while (1) {
+    if (recv(conn->fd, &h, sizeof(h), MSG_PEEK) <= 0) break;
+    shard_recv_header(s, conn->fd, &h);
+    if (h.width > s->stride) {
+      printf("ERROR: rank %d was sent rows wider than -maxSize\n", s->rank);
+      exit(1);
+    }
+    if (h.num_rows > max_rows) {
+      max_rows = h.num_rows;
+      keys = (long long *) realloc(keys, max_rows * sizeof(long long));
+      values = (float *) realloc(values, max_rows * s->stride * sizeof(float));
+    }
+    cluster_recv_all(conn->fd, keys, h.num_rows * sizeof(long long));
+    for (long long a = 0; a < h.num_rows; a++) {
+      if (keys[a] < 0 || keys[a] >= 2 * s->vocab_size || shard_owner(keys[a] % s->vocab_size, s->num_shards) != s->rank) {
+        printf("ERROR: rank %d was asked for a row it does not own\n", s->rank);
+        exit(1);
+      }
+    }
+    if (h.op == SHARD_PUSH) {
+      cluster_recv_all(conn->fd, values, h.num_rows * h.width * sizeof(float));
+      for (long long a = 0; a < h.num_rows; a++) {
+        embed_t *row = shard_local_row(s, keys[a]);
+        for (long long i = 0; i < h.width; i++) embed_add(row, i, values[a * h.width + i]);
+      }
+      continue;
+    }
+    if (h.op == SHARD_FINAL) {
+      pthread_mutex_lock(&s->lock);
+      while (s->accepted < s->expected || s->open > 1) pthread_cond_wait(&s->changed, &s->lock);
+      pthread_mutex_unlock(&s->lock);
+    }
+    for (long long a = 0; a < h.num_rows; a++) embed_load_row(values + a * h.width, shard_local_row(s, keys[a]), h.width);
+    shard_send_header(s, conn->fd, h.op, h.width, h.num_rows);
+    cluster_send_all(NULL, conn->fd, values, h.num_rows * h.width * sizeof(float));
+  }
+  close(conn->fd);
+  free(keys);
+  free(values);
+  free(conn);
+  pthread_mutex_lock(&s->lock);
+  s->open--;
+  pthread_cond_broadcast(&s->changed);
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+// accepts a connection from every training thread of every other process
+void *ShardAcceptThread(void *arg) {
+  ShardServer *s = (ShardServer *)arg;
+  int one = 1;
+  for (int a = 0; a < s->expected; a++) {
+    long long hello[2];
+    int fd = accept(s->listener, NULL, NULL);
+    if (fd < 0) {
+      printf("ERROR: rank %d cannot accept connections\n", s->rank);
+      exit(1);
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    cluster_recv_all(fd, hello, sizeof(hello));
+    cluster_send_all(NULL, fd, &s->fingerprint, sizeof(s->fingerprint));
+    if ((unsigned long long)hello[1] != s->fingerprint) {
+      printf("ERROR: rank %lld has a different vocabulary, -maxSize or -threads\n", hello[0]);
+      exit(1);
+    }
+    ShardConnection *conn = (ShardConnection *) malloc(sizeof(ShardConnection));
+    *conn = (ShardConnection){s, fd, (int)hello[0]};
+    pthread_mutex_lock(&s->lock);
+    s->accepted++;
+    s->open++;
+    pthread_mutex_unlock(&s->lock);
+    pthread_create(&s->servers[a], NULL, ShardServeThread, conn);
+  }
+  close(s->listener);
+  return NULL;
+}
+
+// starts listening on address for the num_threads connections of each other process
+void shard_server_start(ShardServer *s, const char *address) {
+  char host[256], port[32];
+  struct addrinfo hints, *addr;
+  int one = 1;
+  cluster_parse_address(address, host, port);
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &addr) != 0) {
+    printf("ERROR: cannot resolve %s\n", address);
+    exit(1);
+  }
+  s->listener = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+  setsockopt(s->listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (s->listener < 0 || bind(s->listener, addr->ai_addr, addr->ai_addrlen) != 0 || listen(s->listener, 64) != 0) {
+    printf("ERROR: cannot listen on %s\n", address);
+    exit(1);
+  }
+  freeaddrinfo(addr);
+  s->expected = (s->num_shards - 1) * s->num_threads;
+  s->servers = (pthread_t *) calloc(s->expected > 0 ? s->expected : 1, sizeof(pthread_t));
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->changed, NULL);
+  pthread_create(&s->acceptor, NULL, ShardAcceptThread, s);
+}
+
+// blocks until every other process has connected and all but open of the connections are closed again
+void shard_server_wait(ShardServer *s, int open) {
+  pthread_mutex_lock(&s->lock);
+  while (s->accepted < s->expected || s->open > open) pthread_cond_wait(&s->changed, &s->lock);
+  pthread_mutex_unlock(&s->lock);
+}
+
+void shard_server_stop(ShardServer *s) {
+  shard_server_wait(s, 0);
+  pthread_join(s->acceptor, NULL);
+  for (int a = 0; a < s->expected; a++) pthread_join(s->servers[a], NULL);
+  free(s->servers);
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->changed);
+}
+
+// connects to address, retrying for CLUSTER_CONNECT_SECONDS while it comes up
+int shard_connect(ShardServer *s, const char *address) {
+  char host[256], port[32];
+  struct addrinfo hints, *addr;
+  int fd = -1, one = 1;
+  long long hello[2] = {s->rank, (long long)s->fingerprint};
+  unsigned long long theirs;
+  cluster_parse_address(address, host, port);
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &addr) != 0) {
+    printf("ERROR: cannot resolve %s\n", address);
+    exit(1);
+  }
+  for (int attempt = 0; fd < 0; attempt++) {
+    fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd >= 0 && connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) break;
+    if (fd >= 0) close(fd);
+    fd = -1;
+    if (attempt >= CLUSTER_CONNECT_SECONDS * 10) {
+      printf("ERROR: cannot connect to %s\n", address);
+      exit(1);
+    }
+    struct timespec pause = {0, 100000000};
+    nanosleep(&pause, NULL);
+  }
+  freeaddrinfo(addr);
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  cluster_send_all(NULL, fd, hello, sizeof(hello));
+  cluster_recv_all(fd, &theirs, sizeof(theirs));
+  if (theirs != s->fingerprint) {
+    printf("ERROR: %s has a different vocabulary, -maxSize or -threads\n", address);
+    exit(1);
+  }
+  return fd;
+}
+
+// a thread's connections to the other processes; addresses by rank
+ShardClient *shard_client_new(ShardServer *s, char **addresses, long long max_keys, long long cache_rows) {
+  ShardClient *c = (ShardClient *) calloc(1, sizeof(ShardClient));
+  c->server = s;
+  c->max_keys = max_keys;
+  if (cache_rows < 4 * max_keys) cache_rows = 4 * max_keys;
+  c->cache = shard_rows_new(cache_rows, s->stride);
+  c->pending = shard_rows_new(cache_rows, s->stride);
+  c->fds = (int *) malloc(s->num_shards * sizeof(int));
+  c->keys = (long long *) malloc(max_keys * sizeof(long long));
+  c->dest = (float **) malloc(max_keys * sizeof(float *));
+  c->owner_count = (long long *) calloc(s->num_shards, sizeof(long long));
+  c->owner_keys = (long long **) malloc(s->num_shards * sizeof(long long *));
+  c->owner_dest = (float ***) malloc(s->num_shards * sizeof(float **));
+  for (int r = 0; r < s->num_shards; r++) {
+    c->fds[r] = r == s->rank ? -1 : shard_connect(s, addresses[r]);
+    c->owner_keys[r] = (long long *) malloc(c->pending->capacity * sizeof(long long));
+    c->owner_dest[r] = (float **) malloc(c->pending->capacity * sizeof(float *));
+  }
+  return c;
+}
+
+// closes the connections; the other processes see the end of this thread's requests
+void shard_client_close(ShardClient *c) {
+  for (int r = 0; r < c->server->num_shards; r++) if (c->fds[r] >= 0) close(c->fds[r]);
+  for (int r = 0; r < c->server->num_shards; r++) c->fds[r] = -1;
+}
+
+void shard_client_free(ShardClient *c) {
+  shard_client_close(c);
+  for (int r = 0; r < c->server->num_shards; r++) {
+    free(c->owner_keys[r]);
+    free(c->owner_dest[r]);
+  }
+  shard_rows_free(c->cache);
+  shard_rows_free(c->pending);
+  free(c->fds);
+  free(c->keys);
+  free(c->dest);
+  free(c->owner_count);
+  free(c->owner_keys);
+  free(c->owner_dest);
+  free(c->buffer);
+  free(c);
+}
+
+/*
+  width values of each of the n rows keys into dest[0 .. n), one request
+  per owner; the owned rows are read locally
+*/
+void shard_fetch(ShardClient *c, long long op, const long long *keys, float **dest, long long n, long long width) {
+  ShardServer *s = c->server;
+  memset(c->owner_count, 0, s->num_shards * sizeof(long long));
+  for (long long a = 0; a < n; a++) {
+    int r = shard_owner(keys[a] % s->vocab_size, s->num_shards);
+    if (r == s->rank) embed_load_row(dest[a], shard_local_row(s, keys[a]), width);
+    else {
+      c->owner_keys[r][c->owner_count[r]] = keys[a];
+      c->owner_dest[r][c->owner_count[r]++] = dest[a];
+    }
+  }
+  for (int r = 0; r < s->num_shards; r++) {
+    if (r == s->rank || (c->owner_count[r] == 0 && op != SHARD_FINAL)) continue;
+    shard_send_header(s, c->fds[r], op, width, c->owner_count[r]);
+    cluster_send_all(NULL, c->fds[r], c->owner_keys[r], c->owner_count[r] * sizeof(long long));
+  }
+  for (int r = 0; r < s->num_shards; r++) {
+    if (r == s->rank || (c->owner_count[r] == 0 && op != SHARD_FINAL)) continue;
+    ShardHeader h;
+    shard_recv_header(s, c->fds[r], &h);
+    if (h.num_rows * width > c->buffer_size) {
+      c->buffer_size = h.num_rows * width;
+      c->buffer = (float *) realloc(c->buffer, c->buffer_size * sizeof(float));
+    }
+    cluster_recv_all(c->fds[r], c->buffer, h.num_rows * width * sizeof(float));
+    for (long long a = 0; a < h.num_rows; a++) memcpy(c->owner_dest[r][a], c->buffer + a * width, width * sizeof(float));
+    c->bytes_fetched += h.num_rows * (width * sizeof(float) + sizeof(long long));
+  }
+}
+
+/*
+  A batch's rows: width values of each of the n rows keys into dest, from
+  the owned tables, the cache or, for the misses, their owners
+*/
+void shard_gather(ShardClient *c, const long long *keys, float **dest, long long n, long long width) {
+  ShardServer *s = c->server;
+  ShardRows *cache = c->cache;
+  long long misses = 0;
+  if (cache->count + n > cache->capacity / 2) shard_rows_clear(cache);
+  for (long long a = 0; a < n; a++) {
+    if (shard_owner(keys[a] % s->vocab_size, s->num_shards) == s->rank) continue;
+    long long slot = shard_rows_insert(cache, keys[a]);
+    if (cache->width[slot] == -1 || cache->width[slot] >= width) {
+      c->hits += cache->width[slot] != -1;
+      continue;
+    }
+    cache->width[slot] = -1;
+    c->keys[misses] = keys[a];
+    c->dest[misses++] = cache->value + slot * cache->stride;
+  }
+  c->misses += misses;
+  shard_fetch(c, SHARD_FETCH, c->keys, c->dest, misses, width);
+  // the thread's own deltas that are not pushed yet
+  for (long long a = 0; a < misses; a++) {
+    long long slot = shard_rows_find(cache, c->keys[a]), p = shard_rows_find(c->pending, c->keys[a]);
+    cache->width[slot] = width;
+    if (p < 0) continue;
+    for (long long i = 0; i < width && i < c->pending->width[p]; i++) c->dest[a][i] += c->pending->value[p * c->pending->stride + i];
+  }
+  for (long long a = 0; a < n; a++) {
+    if (shard_owner(keys[a] % s->vocab_size, s->num_shards) == s->rank) embed_load_row(dest[a], shard_local_row(s, keys[a]), width);
+    else memcpy(dest[a], cache->value + shard_rows_find(cache, keys[a]) * cache->stride, width * sizeof(float));
+  }
+}
+
+// pushes the pending deltas to their owners and empties the cache
+void shard_flush(ShardClient *c) {
+  ShardServer *s = c->server;
+  ShardRows *pending = c->pending;
+  for (int r = 0; r < s->num_shards; r++) {
+    if (r == s->rank) continue;
+    long long count = 0, width = 0;
+    for (long long i = 0; i < pending->count; i++) {
+      long long slot = pending->used[i];
+      if (shard_owner(pending->key[slot] % s->vocab_size, s->num_shards) != r) continue;
+      c->owner_keys[r][count++] = pending->key[slot];
+      if (pending->width[slot] > width) width = pending->width[slot];
+    }
+    if (count == 0) continue;
+    if (count * width > c->buffer_size) {
+      c->buffer_size = count * width;
+      c->buffer = (float *) realloc(c->buffer, c->buffer_size * sizeof(float));
+    }
+    for (long long a = 0; a < count; a++) {
+      long long slot = shard_rows_find(pending, c->owner_keys[r][a]);
+      memcpy(c->buffer + a * width, pending->value + slot * pending->stride, width * sizeof(float));
+    }
+    shard_send_header(s, c->fds[r], SHARD_PUSH, width, count);
+    cluster_send_all(NULL, c->fds[r], c->owner_keys[r], count * sizeof(long long));
+    cluster_send_all(NULL, c->fds[r], c->buffer, count * width * sizeof(float));
+    c->bytes_pushed += count * (width * sizeof(float) + sizeof(long long));
+  }
+  shard_rows_clear(pending);
+  shard_rows_clear(c->cache);
+}
+
+// adds delta[0 .. width) to row key: the owned table, or the pending buffer and the cached copy
+void shard_add(ShardClient *c, long long key, const float *delta, int width) {
+  ShardServer *s = c->server;
+  if (shard_owner(key % s->vocab_size, s->num_shards) == s->rank) {
+    embed_t *row = shard_local_row(s, key);
+    for (int i = 0; i < width; i++) embed_add(row, i, delta[i]);
+    return;
+  }
+  if (c->pending->count + 1 > c->pending->capacity / 2) shard_flush(c);
+  long long p = shard_rows_insert(c->pending, key), slot = shard_rows_find(c->cache, key);
+  float *dest = c->pending->value + p * c->pending->stride;
+  for (int i = 0; i < width; i++) dest[i] += delta[i];
+  if (width > c->pending->width[p]) c->pending->width[p] = width;
+  if (slot < 0) return;
+  dest = c->cache->value + slot * c->cache->stride;
+  for (int i = 0; i < width && i < c->cache->width[slot]; i++) dest[i] += delta[i];
+}
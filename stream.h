@@ -0,0 +1,219 @@
+/*
+  Building blocks for streaming (online) training, shared by iSG and iCBOW.
+
+  In -stream mode one reader thread tokenizes stdin, maps tokens to ids and
+  applies subsampling, and the training threads pop finished id sentences
+  from a bounded queue.  Tokens that are not yet in the vocabulary are
+  counted in a count-min sketch; a word is admitted (and gets its rows) once
+  its estimated count reaches the admission threshold, so the one-off noise
+  of an unbounded feed never reaches the model.  Memory stays bounded: the
+  sketch has a fixed size and the vocabulary is capped at -streamVocab rows.
+  The main thread publishes the vectors on a wall-clock schedule until the
+  feed ends.
+
+  Training from a file uses the same queues: every training thread has its
+  own, filled from its shard of the corpus by a reader thread (-readers of
+  them serve all shards), so reading, hashing and subsampling overlap with
+  training instead of alternating with it.
+
+  iSG's -sweep forks a trainer process per configuration and keeps the
+  readers in the parent; their queues then live in shared memory, with
+  process-shared locks, and every sentence is pushed to each configuration's
+  queue for the shard.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define CMS_DEPTH 4
+
+// count-min sketch with conservative update
+typedef struct {
+  long long width;  // power of 2
+  unsigned int *counts;
+} CountMinSketch;
+
+CountMinSketch *cms_new(long long width) {
+  CountMinSketch *s = (CountMinSketch *) calloc(1, sizeof(CountMinSketch));
+  s->width = 1;
+  while (s->width < width) s->width <<= 1;
+  s->counts = (unsigned int *) calloc(CMS_DEPTH * s->width, sizeof(unsigned int));
+  if (s->counts == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  return s;
+}
+
+void cms_free(CountMinSketch *s) {
+  free(s->counts);
+  free(s);
+}
+
+// Counts one more occurrence of word and returns its estimated count
+unsigned int cms_add(CountMinSketch *s, const char *word) {
+  unsigned long long h1 = 1469598103934665603ULL, h2;
+  long long cell[CMS_DEPTH];
+  unsigned int estimate = ~0u;
+  for (const unsigned char *p = (const unsigned char *)word; *p; p++) h1 = (h1 ^ *p) * 1099511628211ULL;
+  h2 = (h1 >> 32) | 1;
+  // double hashing gives the independent rows
+  for (int d = 0; d < CMS_DEPTH; d++) {
+    cell[d] = d * s->width + ((h1 + d * h2) & (s->width - 1));
+    if (s->counts[cell[d]] < estimate) estimate = s->counts[cell[d]];
+  }
+  estimate++;
+  for (int d = 0; d < CMS_DEPTH; d++) if (s->counts[cell[d]] < estimate) s->counts[cell[d]] = estimate;
+  return estimate;
+}
+
+// bounded queue of id sentences from the reader to the training threads
+typedef struct {
+  long long *ids;
+  int *lengths;
+  long long *words;  // tokens read from the feed for the sentence, before subsampling
+  int slots, max_length, head, count, closed;
+  int shared;        // in memory shared with forked processes, see sentence_queue_init_shared
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty, not_full, ended;
+} SentenceQueue;
+
+void sentence_queue_init(SentenceQueue *q, int slots, int max_length) {
+  q->ids = (long long *) calloc((long long)slots * max_length, sizeof(long long));
+  q->lengths = (int *) calloc(slots, sizeof(int));
+  q->words = (long long *) calloc(slots, sizeof(long long));
+  q->slots = slots;
+  q->max_length = max_length;
+  q->head = q->count = q->closed = q->shared = 0;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->not_empty, NULL);
+  pthread_cond_init(&q->not_full, NULL);
+  pthread_cond_init(&q->ended, NULL);
+}
+
+// zeroed memory that stays shared with the processes forked after it is mapped
+void *shared_calloc(size_t bytes) {
+  int fd = open("/dev/zero", O_RDWR);
+  void *p = fd < 0 ? MAP_FAILED : mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (fd >= 0) close(fd);
+  if (p == MAP_FAILED) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  return p;
+}
+
+/*
+  A queue whose buffers and locks work across fork(), for a reader in one
+  process and a training thread in another; q itself must come from
+  shared_calloc too
+*/
+void sentence_queue_init_shared(SentenceQueue *q, int slots, int max_length) {
+  pthread_mutexattr_t mutex_attr;
+  pthread_condattr_t cond_attr;
+  q->ids = (long long *) shared_calloc((long long)slots * max_length * sizeof(long long));
+  q->lengths = (int *) shared_calloc(slots * sizeof(int));
+  q->words = (long long *) shared_calloc(slots * sizeof(long long));
+  q->slots = slots;
+  q->max_length = max_length;
+  q->head = q->count = q->closed = 0;
+  q->shared = 1;
+  pthread_mutexattr_init(&mutex_attr);
+  pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&q->lock, &mutex_attr);
+  pthread_cond_init(&q->not_empty, &cond_attr);
+  pthread_cond_init(&q->not_full, &cond_attr);
+  pthread_cond_init(&q->ended, &cond_attr);
+  pthread_mutexattr_destroy(&mutex_attr);
+  pthread_condattr_destroy(&cond_attr);
+}
+
+void sentence_queue_free(SentenceQueue *q) {
+  if (q->shared) {
+    munmap(q->ids, (long long)q->slots * q->max_length * sizeof(long long));
+    munmap(q->lengths, q->slots * sizeof(int));
+    munmap(q->words, q->slots * sizeof(long long));
+  } else {
+    free(q->ids);
+    free(q->lengths);
+    free(q->words);
+  }
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->not_empty);
+  pthread_cond_destroy(&q->not_full);
+  pthread_cond_destroy(&q->ended);
+}
+
+// blocks while the queue is full
+void sentence_queue_push(SentenceQueue *q, long long *ids, int length, long long words) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == q->slots) pthread_cond_wait(&q->not_full, &q->lock);
+  int slot = (q->head + q->count) % q->slots;
+  memcpy(q->ids + (long long)slot * q->max_length, ids, length * sizeof(long long));
+  q->lengths[slot] = length;
+  q->words[slot] = words;
+  q->count++;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// blocks while the queue is empty; returns 0 once it is closed and drained
+int sentence_queue_pop(SentenceQueue *q, long long *ids, long long *length, long long *words) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0 && !q->closed) pthread_cond_wait(&q->not_empty, &q->lock);
+  if (q->count == 0) {
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+  }
+  int slot = q->head;
+  *length = q->lengths[slot];
+  *words = q->words[slot];
+  memcpy(ids, q->ids + (long long)slot * q->max_length, *length * sizeof(long long));
+  q->head = (q->head + 1) % q->slots;
+  q->count--;
+  pthread_cond_signal(&q->not_full);
+  pthread_mutex_unlock(&q->lock);
+  return 1;
+}
+
+// sentences waiting; a snapshot, for a reader choosing which queue to fill next
+int sentence_queue_count(SentenceQueue *q) {
+  pthread_mutex_lock(&q->lock);
+  int count = q->count;
+  pthread_mutex_unlock(&q->lock);
+  return count;
+}
+
+void sentence_queue_close(SentenceQueue *q) {
+  pthread_mutex_lock(&q->lock);
+  q->closed = 1;
+  pthread_cond_broadcast(&q->not_empty);
+  pthread_cond_broadcast(&q->ended);
+  pthread_mutex_unlock(&q->lock);
+}
+
+/*
+  Waits until the next publication is due; returns 0 without waiting out the
+  interval once the queue is closed, i.e. the feed has ended
+*/
+int stream_wait_publish(SentenceQueue *q, double interval) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  long long ns = deadline.tv_nsec + (long long)(interval * 1e9);
+  deadline.tv_sec += ns / 1000000000LL;
+  deadline.tv_nsec = ns % 1000000000LL;
+  pthread_mutex_lock(&q->lock);
+  while (!q->closed) {
+    if (pthread_cond_timedwait(&q->ended, &q->lock, &deadline) != 0) break;
+  }
+  int open = !q->closed;
+  pthread_mutex_unlock(&q->lock);
+  return open;
+}
@@ -0,0 +1,278 @@
+/*
+  Training telemetry shared by iSG and iCBOW.
+
+  Every training thread owns one cache-line aligned counter block that only it
+  writes, so the hot loop never contends on shared counters.  A reporter thread
+  wakes up on a wall-clock interval, aggregates the blocks and emits:
+    -> the console progress line (when debug_mode > 1)
+    -> one JSON object per line to the telemetry file (when one is given)
+  Dimension growth events are recorded in a slot per dimension; since only the
+  thread that wins the compare-and-swap on embed_current_size writes a slot,
+  no locking is needed there either.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define TELEMETRY_CACHE_LINE 64
+#define TELEMETRY_REMOTE -1 // the "thread" of a growth event adopted from another process
+
+enum { PHASE_READ, PHASE_POSTERIOR, PHASE_PREDICTION, PHASE_UPDATE, PHASE_SYNC, NUM_PHASES };
+const char *telemetry_phase_names[NUM_PHASES] = {"read", "posterior", "prediction", "update", "sync"};
+
+// per-thread counters; written by the owning thread only
+typedef struct {
+  long long words;                 // corpus tokens consumed
+  long long loss_count;            // number of terms summed into loss
+  double loss;                     // summed negative log-likelihood
+  long long dim_growths;           // number of dimensions this thread added
+  long long phase_ns[NUM_PHASES];  // wall time spent in each phase
+} __attribute__((aligned(TELEMETRY_CACHE_LINE))) ThreadTelemetry;
+
+// one slot per dimension, filled by the thread which grew the model to that size
+typedef struct {
+  int ready;
+  int thread;
+  long long words;
+  double seconds;
+} DimGrowthEvent;
+
+ThreadTelemetry *telemetry_threads;
+DimGrowthEvent *telemetry_growth;
+int telemetry_num_threads = 0, telemetry_phases_on = 0, telemetry_stopping = 0;
+long long telemetry_total_words = 0, telemetry_max_dim = 0, telemetry_next_event = 0;
+long long *telemetry_embed_size;
+double telemetry_interval = 1.0;
+int telemetry_console = 1;
+FILE *telemetry_file;
+float (*telemetry_alpha)(void);
+struct timespec telemetry_start_time;
+pthread_t telemetry_reporter;
+pthread_mutex_t telemetry_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t telemetry_wake = PTHREAD_COND_INITIALIZER;
+
+static inline long long telemetry_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+double telemetry_elapsed() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec - telemetry_start_time.tv_sec) + (ts.tv_nsec - telemetry_start_time.tv_nsec) / 1e9;
+}
+
+// single-writer updates: relaxed stores are enough for the reporter to see whole values
+static inline void telemetry_add_words(ThreadTelemetry *t, long long n) {
+  __atomic_store_n(&t->words, t->words + n, __ATOMIC_RELAXED);
+}
+
+static inline void telemetry_add_loss(ThreadTelemetry *t, double loss, long long count) {
+  double total = t->loss + loss;
+  __atomic_store(&t->loss, &total, __ATOMIC_RELAXED);
+  __atomic_store_n(&t->loss_count, t->loss_count + count, __ATOMIC_RELAXED);
+}
+
+// charge the time since *mark to phase and move the mark forward
+static inline void telemetry_phase(ThreadTelemetry *t, int phase, long long *mark) {
+  if (!telemetry_phases_on) return;
+  long long now = telemetry_now_ns();
+  __atomic_store_n(&t->phase_ns[phase], t->phase_ns[phase] + (now - *mark), __ATOMIC_RELAXED);
+  *mark = now;
+}
+
+static inline void telemetry_mark(long long *mark) {
+  if (telemetry_phases_on) *mark = telemetry_now_ns();
+}
+
+/*
+  record that thread id grew the model to new_dim dimensions; id is
+  TELEMETRY_REMOTE when this process took on a dimension another one grew
+  (-nodes), and before telemetry_start there is nothing to record
+*/
+void telemetry_dim_growth(int id, long long new_dim, long long words) {
+  if (telemetry_growth == NULL) return;
+  if (id != TELEMETRY_REMOTE) {
+    ThreadTelemetry *t = &telemetry_threads[id];
+    __atomic_store_n(&t->dim_growths, t->dim_growths + 1, __ATOMIC_RELAXED);
+  }
+  if (new_dim > telemetry_max_dim) return;
+  DimGrowthEvent *e = &telemetry_growth[new_dim];
+  e->thread = id;
+  e->words = words;
+  e->seconds = telemetry_elapsed();
+  __atomic_store_n(&e->ready, 1, __ATOMIC_RELEASE);
+}
+
+/*
+  Snapshot of all counters; the reporter diffs consecutive snapshots to get
+  interval rates
+*/
+typedef struct {
+  double seconds;
+  long long words, loss_count;
+  double loss;
+  long long *thread_words;
+  long long phase_ns[NUM_PHASES];
+} TelemetrySnapshot;
+
+void telemetry_snapshot(TelemetrySnapshot *s) {
+  memset(s->phase_ns, 0, sizeof(s->phase_ns));
+  s->seconds = telemetry_elapsed();
+  s->words = s->loss_count = 0;
+  s->loss = 0.0;
+  for (int i = 0; i < telemetry_num_threads; i++) {
+    ThreadTelemetry *t = &telemetry_threads[i];
+    double loss;
+    s->thread_words[i] = __atomic_load_n(&t->words, __ATOMIC_RELAXED);
+    s->words += s->thread_words[i];
+    s->loss_count += __atomic_load_n(&t->loss_count, __ATOMIC_RELAXED);
+    __atomic_load(&t->loss, &loss, __ATOMIC_RELAXED);
+    s->loss += loss;
+    for (int p = 0; p < NUM_PHASES; p++) s->phase_ns[p] += __atomic_load_n(&t->phase_ns[p], __ATOMIC_RELAXED);
+  }
+}
+
+void telemetry_emit_growth_events() {
+  while (telemetry_next_event <= telemetry_max_dim &&
+         __atomic_load_n(&telemetry_growth[telemetry_next_event].ready, __ATOMIC_ACQUIRE)) {
+    DimGrowthEvent *e = &telemetry_growth[telemetry_next_event];
+    if (telemetry_file != NULL) {
+      fprintf(telemetry_file, "{\"event\":\"dim_growth\",\"time\":%.3f,\"dim\":%lld,\"thread\":%d,\"words\":%lld}\n",
+              e->seconds, telemetry_next_event, e->thread, e->words);
+    }
+    telemetry_next_event++;
+  }
+}
+
+void telemetry_report(TelemetrySnapshot *prev, TelemetrySnapshot *cur, const char *event) {
+  double dt = cur->seconds - prev->seconds;
+  if (dt <= 0) dt = 1e-9;
+  long long dwords = cur->words - prev->words;
+  long long dcount = cur->loss_count - prev->loss_count;
+  double interval_loss = dcount > 0 ? (cur->loss - prev->loss) / dcount : 0.0;
+  double total_loss = cur->loss_count > 0 ? cur->loss / cur->loss_count : 0.0;
+  long long embed_size = __atomic_load_n(telemetry_embed_size, __ATOMIC_RELAXED);
+  float lr = telemetry_alpha();
+  // no known total (streaming): progress stays at 0
+  double progress = telemetry_total_words > 0 ? cur->words / (double)(telemetry_total_words + 1) : 0.0;
+
+  if (telemetry_console) {
+    printf("%cAlpha: %f  Progress: %.2f%%  Words/thread/sec: %.2fk  ", 13, lr,
+           progress * 100,
+           dwords / dt / telemetry_num_threads / 1000);
+    printf("loss: %f  ", total_loss);
+    printf("curr dim: %lld\n", embed_size);
+    fflush(stdout);
+  }
+  if (telemetry_file == NULL) return;
+  telemetry_emit_growth_events();
+  fprintf(telemetry_file, "{\"event\":\"%s\",\"time\":%.3f,\"words\":%lld,\"progress\":%.6f,\"tokens_per_sec\":%.1f,"
+          "\"alpha\":%g,\"loss\":%.6f,\"loss_total\":%.6f,\"embed_current_size\":%lld,\"thread_tokens_per_sec\":[",
+          event, cur->seconds, cur->words, progress, dwords / dt,
+          lr, interval_loss, total_loss, embed_size);
+  for (int i = 0; i < telemetry_num_threads; i++) {
+    fprintf(telemetry_file, "%s%.1f", i ? "," : "", (cur->thread_words[i] - prev->thread_words[i]) / dt);
+  }
+  fprintf(telemetry_file, "]");
+  if (telemetry_phases_on) {
+    fprintf(telemetry_file, ",\"phase_sec\":{");
+    for (int p = 0; p < NUM_PHASES; p++) {
+      fprintf(telemetry_file, "%s\"%s\":%.4f", p ? "," : "", telemetry_phase_names[p], (cur->phase_ns[p] - prev->phase_ns[p]) / 1e9);
+    }
+    fprintf(telemetry_file, "}");
+  }
+  fprintf(telemetry_file, "}\n");
+  fflush(telemetry_file);
+}
+
+void *TelemetryReporterThread(void *unused) {
+  TelemetrySnapshot prev, cur;
+  prev.thread_words = (long long *) calloc(telemetry_num_threads, sizeof(long long));
+  cur.thread_words = (long long *) calloc(telemetry_num_threads, sizeof(long long));
+  telemetry_snapshot(&prev);
+  pthread_mutex_lock(&telemetry_lock);
+  while (!telemetry_stopping) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    long long ns = deadline.tv_nsec + (long long)(telemetry_interval * 1e9);
+    deadline.tv_sec += ns / 1000000000LL;
+    deadline.tv_nsec = ns % 1000000000LL;
+    pthread_cond_timedwait(&telemetry_wake, &telemetry_lock, &deadline);
+    if (telemetry_stopping) break;
+    telemetry_snapshot(&cur);
+    telemetry_report(&prev, &cur, "progress");
+    long long *swap = prev.thread_words;
+    prev = cur;
+    cur.thread_words = swap;
+  }
+  pthread_mutex_unlock(&telemetry_lock);
+  // final line covers the whole run
+  memset(prev.phase_ns, 0, sizeof(prev.phase_ns));
+  memset(prev.thread_words, 0, telemetry_num_threads * sizeof(long long));
+  prev.seconds = 0;
+  prev.words = prev.loss_count = 0;
+  prev.loss = 0.0;
+  telemetry_snapshot(&cur);
+  telemetry_console = 0;
+  telemetry_report(&prev, &cur, "summary");
+  free(prev.thread_words);
+  free(cur.thread_words);
+  return NULL;
+}
+
+/*
+  Set up counters and start the reporter
+  -> path: JSON lines output file; empty string disables JSON output (and phase timing)
+  -> console: print the human readable progress line every interval
+  -> embed_size: pointer to the trainer's embed_current_size
+  -> current_alpha: callback giving the learning rate to report
+*/
+void telemetry_start(int num_threads, const char *path, double interval, int console, long long total_words,
+                     long long max_dim, long long *embed_size, float (*current_alpha)(void)) {
+  telemetry_num_threads = num_threads;
+  telemetry_total_words = total_words;
+  telemetry_max_dim = max_dim;
+  telemetry_embed_size = embed_size;
+  telemetry_next_event = *embed_size + 1;
+  telemetry_alpha = current_alpha;
+  telemetry_console = console;
+  if (interval > 0) telemetry_interval = interval;
+  if (posix_memalign((void **)&telemetry_threads, TELEMETRY_CACHE_LINE, num_threads * sizeof(ThreadTelemetry))) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  memset(telemetry_threads, 0, num_threads * sizeof(ThreadTelemetry));
+  telemetry_growth = (DimGrowthEvent *) calloc(max_dim + 1, sizeof(DimGrowthEvent));
+  telemetry_file = NULL;
+  if (path[0] != 0) {
+    telemetry_file = fopen(path, "w");
+    if (telemetry_file == NULL) {
+      printf("ERROR: cannot open telemetry file %s\n", path);
+      exit(1);
+    }
+    telemetry_phases_on = 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &telemetry_start_time);
+  telemetry_stopping = 0;
+  pthread_create(&telemetry_reporter, NULL, TelemetryReporterThread, NULL);
+}
+
+// stop the reporter, emitting the summary line, and release everything
+void telemetry_stop() {
+  pthread_mutex_lock(&telemetry_lock);
+  telemetry_stopping = 1;
+  pthread_cond_signal(&telemetry_wake);
+  pthread_mutex_unlock(&telemetry_lock);
+  pthread_join(telemetry_reporter, NULL);
+  if (telemetry_file != NULL) {
+    telemetry_emit_growth_events();
+    fclose(telemetry_file);
+  }
+  free(telemetry_threads);
+  free(telemetry_growth);
+  telemetry_growth = NULL;
+}
@@ -0,0 +1,200 @@
+/*
+  Vocabulary shared by the trainers and the perplexity tools.
+
+  Word strings live in a string arena made of large blocks instead of one
+  calloc per word; blocks are never moved, so vocab[a].word stays valid while
+  the vocabulary grows (the -stream publisher relies on that).  Lookups go
+  through an open-addressing table whose size is a power of two kept at
+  about twice the vocabulary, so masking replaces the modulo and the table
+  costs a few bytes per word instead of a fixed 30M entries.
+
+  Files needing more per-word fields define VOCAB_WORD_EXTRA before including
+  this header.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef MAX_STRING
+#define MAX_STRING 100
+#endif
+#ifndef VOCAB_WORD_EXTRA
+#define VOCAB_WORD_EXTRA
+#endif
+
+#define VOCAB_ARENA_BLOCK (1 << 20)
+
+struct vocab_word {
+  long long cn;
+  char *word;
+  VOCAB_WORD_EXTRA
+};
+
+typedef struct VocabArenaBlock {
+  struct VocabArenaBlock *next;
+  long long used;
+  char data[VOCAB_ARENA_BLOCK];
+} VocabArenaBlock;
+
+const long long vocab_max_words = 21000000;  // LearnVocabFromTrainFile reduces the vocabulary beyond this
+struct vocab_word *vocab;
+long long vocab_max_size = 1000, vocab_size = 0;
+int *vocab_hash;
+long long vocab_hash_size = 0;  // power of 2
+VocabArenaBlock *vocab_arena;
+
+// Copies a word into the arena
+char *VocabStoreWord(const char *word) {
+  long long length = strlen(word) + 1;
+  if (length > MAX_STRING) length = MAX_STRING;
+  if (vocab_arena == NULL || vocab_arena->used + length > VOCAB_ARENA_BLOCK) {
+    VocabArenaBlock *block = (VocabArenaBlock *) malloc(sizeof(VocabArenaBlock));
+    if (block == NULL) {
+      printf("Memory allocation failed\n");
+      exit(1);
+    }
+    block->next = vocab_arena;
+    block->used = 0;
+    vocab_arena = block;
+  }
+  char *stored = vocab_arena->data + vocab_arena->used;
+  memcpy(stored, word, length - 1);
+  stored[length - 1] = 0;
+  vocab_arena->used += length;
+  return stored;
+}
+
+void FreeVocabArena(VocabArenaBlock *block) {
+  while (block != NULL) {
+    VocabArenaBlock *next = block->next;
+    free(block);
+    block = next;
+  }
+}
+
+// Returns hash value of a word: 64-bit FNV-1a with a final avalanche so the low bits can be masked
+unsigned long long GetWordHash(const char *word) {
+  unsigned long long hash = 14695981039346656037ULL;
+  for (const unsigned char *p = (const unsigned char *)word; *p; p++) hash = (hash ^ *p) * 1099511628211ULL;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+// Sizes the hash table for the current vocabulary and re-inserts every word
+void RebuildVocabHash() {
+  long long a, size = 1024;
+  unsigned long long hash;
+  while (size < 2 * (vocab_size + 1)) size <<= 1;
+  if (size != vocab_hash_size) {
+    free(vocab_hash);
+    vocab_hash = (int *)malloc(size * sizeof(int));
+    vocab_hash_size = size;
+  }
+  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
+  for (a = 0; a < vocab_size; a++) {
+    hash = GetWordHash(vocab[a].word) & (vocab_hash_size - 1);
+    while (vocab_hash[hash] != -1) hash = (hash + 1) & (vocab_hash_size - 1);
+    vocab_hash[hash] = a;
+  }
+}
+
+// Empty vocabulary; also used to start over before reading a vocabulary
+void InitVocab() {
+  if (vocab == NULL) vocab = (struct vocab_word *)calloc(vocab_max_size, sizeof(struct vocab_word));
+  FreeVocabArena(vocab_arena);
+  vocab_arena = NULL;
+  vocab_size = 0;
+  RebuildVocabHash();
+}
+
+void FreeVocab() {
+  FreeVocabArena(vocab_arena);
+  vocab_arena = NULL;
+  free(vocab);
+  free(vocab_hash);
+  vocab = NULL;
+  vocab_hash = NULL;
+  vocab_size = vocab_hash_size = 0;
+}
+
+// Returns position of a word in the vocabulary; if the word is not found, returns -1
+int SearchVocab(char *word) {
+  unsigned long long hash = GetWordHash(word) & (vocab_hash_size - 1);
+  while (1) {
+    if (vocab_hash[hash] == -1) return -1;
+    if (!strcmp(word, vocab[vocab_hash[hash]].word)) return vocab_hash[hash];
+    hash = (hash + 1) & (vocab_hash_size - 1);
+  }
+  return -1;
+}
+
+// Adds a word to the vocabulary
+int AddWordToVocab(char *word) {
+  unsigned long long hash;
+  vocab[vocab_size].word = VocabStoreWord(word);
+  vocab[vocab_size].cn = 0;
+  vocab_size++;
+  // Reallocate memory if needed
+  if (vocab_size + 2 >= vocab_max_size) {
+    vocab_max_size += 1000;
+    vocab = (struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
+  }
+  // keep the table at most half full
+  if (2 * vocab_size > vocab_hash_size) {
+    RebuildVocabHash();
+    return vocab_size - 1;
+  }
+  hash = GetWordHash(word) & (vocab_hash_size - 1);
+  while (vocab_hash[hash] != -1) hash = (hash + 1) & (vocab_hash_size - 1);
+  vocab_hash[hash] = vocab_size - 1;
+  return vocab_size - 1;
+}
+
+// Moves the words still in the vocabulary to a fresh arena, releasing the discarded ones
+void CompactVocabArena() {
+  VocabArenaBlock *old = vocab_arena;
+  vocab_arena = NULL;
+  for (long long a = 0; a < vocab_size; a++) vocab[a].word = VocabStoreWord(vocab[a].word);
+  FreeVocabArena(old);
+}
+
+// Used later for sorting by word counts
+int VocabCompare(const void *a, const void *b) {
+  long long l = ((struct vocab_word *)b)->cn - ((struct vocab_word *)a)->cn;
+  return (l > 0) - (l < 0);
+}
+
+/*
+  Sorts the vocabulary by frequency using word counts; words occurring less
+  than min_count times are discarded.  Returns the number of words in the
+  training data that the remaining vocabulary covers.
+*/
+long long SortVocab(int min_count) {
+  long long a, words = 0;
+  // Sort the vocabulary and keep </s> at the first position
+  qsort(&vocab[1], vocab_size - 1, sizeof(struct vocab_word), VocabCompare);
+  // after sorting, the discarded words form the tail
+  while (vocab_size > 1 && vocab[vocab_size - 1].cn < min_count) vocab_size--;
+  for (a = 0; a < vocab_size; a++) words += vocab[a].cn;
+  vocab_max_size = vocab_size + 1;
+  vocab = (struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
+  CompactVocabArena();
+  RebuildVocabHash();
+  return words;
+}
+
+// Reduces the vocabulary by removing tokens seen min_reduce times or less
+void ReduceVocab(int min_reduce) {
+  long long a, b = 0;
+  for (a = 0; a < vocab_size; a++) if (vocab[a].cn > min_reduce) {
+      vocab[b].cn = vocab[a].cn;
+      vocab[b].word = vocab[a].word;
+      b++;
+    }
+  vocab_size = b;
+  CompactVocabArena();
+  RebuildVocabHash();
+  fflush(stdout);
+}